@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "arena.h"
+#include "metrics.h"
+
+#define ARENA_SLAB_SIZE (1024 * 1024)
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+
+arena_t* arena_init(void) {
+    arena_t* ret = malloc(sizeof(arena_t));
+    if (ret == NULL) exit(errno);
+    ret->slabs = NULL;
+    ret->num_slabs = 0;
+    for (size_t i=0; i<ARENA_MAX_RECYCLED / ARENA_ALIGN; i++)
+        ret->free_lists[i] = NULL;
+    return ret;
+}
+
+static arena_slab_t* arena_add_slab(arena_t* arena, const size_t size) {
+    // the slab header and its bytes share one allocation
+    arena_slab_t* slab = malloc(sizeof(arena_slab_t) + size);
+    if (slab == NULL) exit(errno);
+    slab->bytes = (char*) (slab + 1);
+    slab->size = size;
+    slab->used = 0;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->num_slabs++;
+    return slab;
+}
+
+void* arena_alloc(arena_t* arena, const size_t size) {
+    metrics_count(METRICS_ALLOCATIONS, 1);
+    metrics_count(METRICS_ALLOCATED_BYTES, size);
+    if (arena == NULL) {
+        void* ret = malloc(size);
+        if (ret == NULL) exit(errno);
+        return ret;
+    }
+
+    size_t rounded = ARENA_ROUND(size ? size : 1);
+    if (rounded <= ARENA_MAX_RECYCLED) {
+        arena_block_t** list = &(arena->free_lists[rounded / ARENA_ALIGN - 1]);
+        if (*list != NULL) {
+            arena_block_t* block = *list;
+            *list = block->next;
+            return block;
+        }
+    }
+
+    // oversized blocks get a slab of their own, put behind the current
+    // one so that it keeps being filled up
+    if (rounded > ARENA_SLAB_SIZE / 4) {
+        arena_slab_t* current = arena->slabs;
+        arena_slab_t* slab = arena_add_slab(arena, rounded);
+        slab->used = rounded;
+        if (current != NULL) {
+            arena->slabs = current;
+            slab->next = current->next;
+            current->next = slab;
+        }
+        return slab->bytes;
+    }
+
+    arena_slab_t* slab = arena->slabs;
+    if (slab == NULL || slab->size - slab->used < rounded)
+        slab = arena_add_slab(arena, ARENA_SLAB_SIZE);
+    void* ret = slab->bytes + slab->used;
+    slab->used += rounded;
+    return ret;
+}
+
+void arena_release(arena_t* arena, void* ptr, const size_t size) {
+    if (arena == NULL) {
+        free(ptr);
+        return;
+    }
+
+    // larger blocks are only reclaimed along with the whole arena
+    size_t rounded = ARENA_ROUND(size ? size : 1);
+    if (rounded > ARENA_MAX_RECYCLED)
+        return;
+
+    arena_block_t* block = ptr;
+    block->next = arena->free_lists[rounded / ARENA_ALIGN - 1];
+    arena->free_lists[rounded / ARENA_ALIGN - 1] = block;
+}
+
+void arena_free(arena_t* arena) {
+    arena_slab_t* slab = arena->slabs;
+    while (slab != NULL) {
+        arena_slab_t* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    arena->slabs = NULL;
+    free(arena);
+    arena = NULL;
+}
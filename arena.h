@@ -0,0 +1,54 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+#include <stddef.h>
+
+// blocks are handed out in multiples of this many bytes
+#define ARENA_ALIGN 8
+
+// released blocks up to this size are kept on free lists for reuse
+#define ARENA_MAX_RECYCLED 512
+
+
+/*
+ * structs
+ */
+
+typedef struct arena_slab_struct {
+    struct arena_slab_struct* next;
+    size_t size;
+    size_t used;
+    char* bytes;
+} arena_slab_t;
+
+typedef struct arena_block_struct {
+    struct arena_block_struct* next;
+} arena_block_t;
+
+// bump-pointer allocator; everything allocated from an arena is released
+// at once when the arena is freed
+typedef struct arena_struct {
+    arena_slab_t* slabs;
+    size_t num_slabs;
+    arena_block_t* free_lists[ARENA_MAX_RECYCLED / ARENA_ALIGN];
+} arena_t;
+
+
+/*
+ * function prototypes
+ */
+
+// allocates a new empty arena
+arena_t* arena_init(void);
+
+// allocates size bytes from the arena, reusing a released block if possible;
+// a NULL arena falls back to malloc()
+void* arena_alloc(arena_t* arena, const size_t size);
+
+// gives a block of the given size back to the arena for reuse;
+// a NULL arena falls back to free()
+void arena_release(arena_t* arena, void* ptr, const size_t size);
+
+// deallocates the arena along with everything allocated from it
+void arena_free(arena_t* arena);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "autosave.h"
+
+static void* autosave_run(void* arg) {
+    autosave_t* autosave = arg;
+    pthread_mutex_lock(&(autosave->mutex));
+    while (!autosave->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += autosave->interval;
+        while (!autosave->stopping
+                && pthread_cond_timedwait(&(autosave->cond), &(autosave->mutex), &deadline) != ETIMEDOUT)
+            ;
+        if (autosave->stopping)
+            break;
+        autosave->due = true;
+        pthread_mutex_unlock(&(autosave->mutex));
+
+        // a bookstore in use gets checkpointed once the change at hand is made
+        if (pthread_rwlock_trywrlock(autosave->lock) == 0) {
+            autosave_poll(autosave, *(autosave->store));
+            pthread_rwlock_unlock(autosave->lock);
+        }
+        pthread_mutex_lock(&(autosave->mutex));
+    }
+    pthread_mutex_unlock(&(autosave->mutex));
+    return NULL;
+}
+
+autosave_t* autosave_start(bookstore_t** store, pthread_rwlock_t* lock,
+        const unsigned int interval, const unsigned int max_changes) {
+    autosave_t* ret = malloc(sizeof(autosave_t));
+    if (ret == NULL) exit(errno);
+    ret->store = store;
+    ret->lock = lock;
+    ret->interval = interval ? interval : 1;
+    ret->max_changes = max_changes;
+    ret->due = false;
+    ret->stopping = false;
+    pthread_mutex_init(&(ret->mutex), NULL);
+    pthread_cond_init(&(ret->cond), NULL);
+    if (pthread_create(&(ret->thread), NULL, autosave_run, ret) != 0)
+        exit(errno);
+    return ret;
+}
+
+void autosave_poll(autosave_t* autosave, bookstore_t* store) {
+    pthread_mutex_lock(&(autosave->mutex));
+    bool due = autosave->due
+        || (autosave->max_changes > 0 && store->num_changes >= autosave->max_changes);
+    // a checkpoint still being written is not waited for, the next one
+    // starts with the next change made after it is done
+    if (due && !bookstore_save_running(store)) {
+        bookstore_checkpoint(store);
+        autosave->due = false;
+    }
+    pthread_mutex_unlock(&(autosave->mutex));
+}
+
+void autosave_stop(autosave_t* autosave, bookstore_t* store) {
+    pthread_mutex_lock(&(autosave->mutex));
+    autosave->stopping = true;
+    pthread_cond_signal(&(autosave->cond));
+    pthread_mutex_unlock(&(autosave->mutex));
+    pthread_join(autosave->thread, NULL);
+
+    bookstore_checkpoint(store);
+    pthread_mutex_destroy(&(autosave->mutex));
+    pthread_cond_destroy(&(autosave->cond));
+    free(autosave);
+}
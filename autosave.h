@@ -0,0 +1,48 @@
+#ifndef __AUTOSAVE_H__
+#define __AUTOSAVE_H__
+#include <stdbool.h>
+#include <pthread.h>
+#include "bookstore.h"
+
+// seconds between checkpoints, unless told otherwise
+#define AUTOSAVE_DEFAULT_INTERVAL 5
+
+
+/*
+ * structs
+ */
+
+// a thread checkpointing a bookstore that tracks its changes every so often;
+// it never waits for the bookstore to be free, but leaves the checkpoints it
+// cannot start to whoever is changing the bookstore (see autosave_poll())
+typedef struct autosave_struct {
+    bookstore_t** store; // where the bookstore is, as it may get replaced
+    pthread_rwlock_t* lock; // held for writing by whoever changes the bookstore
+    unsigned int interval; // seconds between checkpoints
+    unsigned int max_changes; // changes that make a checkpoint due early, 0 for no limit
+    bool due; // a checkpoint is to be started as soon as possible
+    bool stopping;
+    pthread_mutex_t mutex; // guards due and stopping
+    pthread_cond_t cond;
+    pthread_t thread;
+} autosave_t;
+
+
+/*
+ * function prototypes
+ */
+
+// starts a thread checkpointing the bookstore at *store every interval
+// seconds (or after max_changes changes, if not 0)
+autosave_t* autosave_start(bookstore_t** store, pthread_rwlock_t* lock,
+        const unsigned int interval, const unsigned int max_changes);
+
+// starts a checkpoint of the bookstore if one is due, unless the last one is
+// still being written; to be called holding the bookstore after changing it
+void autosave_poll(autosave_t* autosave, bookstore_t* store);
+
+// stops the thread and starts a last checkpoint of the bookstore, which
+// bookstore_free() waits for; to be called holding the bookstore
+void autosave_stop(autosave_t* autosave, bookstore_t* store);
+
+#endif
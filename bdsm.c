@@ -3,101 +3,257 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "bookstore.h"
+#include "import.h"
+#include "output.h"
+#include "server.h"
+#include "metrics.h"
+#include "autosave.h"
 
+// longest command line, including its newline; longer ones are rejected
 #define MAXCMDLEN 1024
-#define MAXPARAMS 8
+// every parameter takes at least a character and a separator
+#define MAXPARAMS (MAXCMDLEN / 2)
 
 bool unsaved_changes = false;
+bool journaled = false;
+unsigned int autosave_interval = 0; // seconds, 0 for no autosave
+unsigned int autosave_changes = 0;
+autosave_t* autosave = NULL;
+// held for writing by the shell while it runs a command, so that the
+// autosave thread can tell when it may checkpoint the bookstore itself
+pthread_rwlock_t shell_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+// commands whose calls and latencies are recorded, the last entry
+// standing for any other (mistyped) command
+const char* cmd_names[] = {"help", "load", "save", "format", "import", "compact", "reset",
+    "bookadd", "bookdel", "byauthor", "bygenre", "bytitle", "sell", "sellbatch", "stock", "chprice", "info", "ls",
+    "top", "soldout", "pricerange", "lowstock", "revenue", "stats", "autosave", "(other)"};
 
-bookstore_t* cmd_dispatch(bookstore_t* store, unsigned int argc, char** argv);
-void bookshell(bookstore_t* store);
 
+bookstore_t* cmd_dispatch(bookstore_t* store, output_t* out, unsigned int argc, char** argv);
+bookstore_t* cmd_run(bookstore_t* store, output_t* out, char* cmd);
+bool cmd_is_read_only(const char* cmd);
+bool cmd_is_report(const char* cmd);
+void bookshell(bookstore_t* store, output_t* out);
+void import_file(bookstore_t* store, output_t* out, const char* filename);
+void metrics_write(FILE* fd);
+void autosave_write(bookstore_t* store, output_t* out);
+void journal_store(bookstore_t* store, const char* filename);
+bool changes_unsaved(const bookstore_t* store);
+bool skip_long_line(FILE* fd, const char* line);
 
-bookstore_t* cmd_dispatch(bookstore_t* store, unsigned int argc, char** argv) {
+
+void import_file(bookstore_t* store, output_t* out, const char* filename) {
+    import_stats_t stats;
+    if (!bookstore_import(store, filename, &stats)) {
+        fprintf(out->fd, "Failed to import books from %s!\n", filename);
+        return;
+    }
+    fprintf(out->fd, "Imported %u of %u books from %s\n", stats.num_imported, stats.num_rows, filename);
+    if (stats.num_imported > 0)
+        unsaved_changes = true;
+}
+
+// journals the changes to a bookstore, only keeping track of them for the
+// autosave to checkpoint if there is one
+void journal_store(bookstore_t* store, const char* filename) {
+    bookstore_journal(store, filename);
+    if (autosave_interval > 0)
+        bookstore_track_changes(store);
+}
+
+// whether there are changes that would be lost, the ones the autosave
+// keeps track of being checkpointed before leaving
+bool changes_unsaved(const bookstore_t* store) {
+    if (autosave_interval > 0 && store->journal != NULL && store->journal->deferred)
+        return false;
+    return unsaved_changes;
+}
+
+// tells how the autosave checkpoints went and what is waiting for the next one
+void autosave_write(bookstore_t* store, output_t* out) {
+    if (autosave == NULL) {
+        fprintf(out->fd, "Autosave is off, use --autosave <seconds> to turn it on\n");
+        return;
+    }
+    const bookstore_checkpoint_stats_t* stats = &(store->checkpoints);
+    fprintf(out->fd, "Checkpoints: %" PRIu64 " (%" PRIu64 " failed), every %u s", stats->count,
+            stats->failed, autosave->interval);
+    if (autosave->max_changes > 0)
+        fprintf(out->fd, " or %u changes", autosave->max_changes);
+    fprintf(out->fd, "\n");
+    fprintf(out->fd, "Last checkpoint: %u books in %.03f ms, %.03f ms after the oldest change\n",
+            stats->last_books, (double) stats->last_duration / 1e6, (double) stats->last_lag / 1e6);
+    fprintf(out->fd, "Pending: %" PRIu64 " changes to %u books", store->num_changes,
+            store->num_dirty + store->num_removed);
+    if (store->dirty_since != 0)
+        fprintf(out->fd, ", oldest %.03f s ago", (double) (metrics_now() - store->dirty_since) / 1e9);
+    if (bookstore_save_running(store))
+        fprintf(out->fd, ", a checkpoint is being written");
+    fprintf(out->fd, "\n");
+}
+
+
+bookstore_t* cmd_dispatch(bookstore_t* store, output_t* out, unsigned int argc, char** argv) {
     if (strcmp(argv[0], "exit") == 0) {
-        if (unsaved_changes) {
-            printf("You have unsaved changes. Really exit? [yN] ");
+        if (changes_unsaved(store) && out->interactive) {
+            fprintf(out->fd, "You have unsaved changes. Really exit? [yN] ");
             int choice = getchar();
             if (choice != 'y' && choice != 'Y' && choice != EOF)
                 return store;
         }
-        printf("Bye.\n");
+        if (out->interactive)
+            fprintf(out->fd, "Bye.\n");
+        if (autosave != NULL)
+            autosave_stop(autosave, store);
         bookstore_free(store);
         exit(0);
     } else if (strcmp(argv[0], "help") == 0) {
-        printf("List of available commands:\n");
-        printf("\texit\n\t\texit the BDSM program\n");
-        printf("\thelp\n\t\tthis text\n");
-        printf("\tload <filename>\n\t\tloads a bookstore from file\n");
-        printf("\tsave <filename>\n\t\tsaves bookstore to a file\n");
-        printf("\treset\n\t\tre-initializes the bookstore\n");
-        printf("\tbookadd <isbn> <title> <author> <genre> <stocked_qty> <sold_qty> <price>\n\t\tadds a new book to the bookstore\n");
-        printf("\tbookdel <isbn>\n\t\tremoves a book from the bookstore\n");
-        printf("\tbyauthor <author>\n\t\tfinds all books by author\n");
-        printf("\tbygenre <genre>\n\t\tfind all books by genre\n");
-        printf("\tsell <isbn> <qty>\n\t\tsells specified quantity of a book\n");
-        printf("\tstock <isbn> <qty>\n\t\tadds specified quantity of a book to the stock\n");
-        printf("\tchprice <isbn> <newprice>\n\t\tchanges price of a book\n");
-        printf("\tinfo <isbn>\n\t\tshows details of a book\n");
-        printf("\tls\n\t\tlists all books in the bookstore\n");
-        printf("\ttop <N>\n\t\tlists top N bestsellers\n");
-        printf("\tsoldout\n\t\tlists all sold-out books\n");
-        printf("\trevenue\n\t\tprints number of books sold and their total price\n");
+        fprintf(out->fd, "List of available commands:\n");
+        fprintf(out->fd, "\texit\n\t\texit the BDSM program\n");
+        fprintf(out->fd, "\thelp\n\t\tthis text\n");
+        fprintf(out->fd, "\tload <filename>\n\t\tloads a bookstore from file\n");
+        fprintf(out->fd, "\tsave <filename> [compressed|plain]\n\t\tsaves bookstore to a file (in the same format it was loaded from, unless told)\n");
+        fprintf(out->fd, "\tsave\n\t\tcommits the changes to the journal (when journaled)\n");
+        fprintf(out->fd, "\tcompact\n\t\tfolds the journal into a new snapshot (when journaled)\n");
+        fprintf(out->fd, "\timport <filename>\n\t\timports books from a CSV or TSV file\n");
+        fprintf(out->fd, "\treset\n\t\tre-initializes the bookstore\n");
+        fprintf(out->fd, "\tbookadd <isbn> <title> <author> <genre> <stocked_qty> <sold_qty> <price>\n\t\tadds a new book to the bookstore\n");
+        fprintf(out->fd, "\tbookdel <isbn>\n\t\tremoves a book from the bookstore\n");
+        fprintf(out->fd, "\tbyauthor <author>\n\t\tfinds all books by author\n");
+        fprintf(out->fd, "\tbygenre <genre>\n\t\tfind all books by genre\n");
+        fprintf(out->fd, "\tbytitle <text>\n\t\tfinds all books with the text in their title, ignoring case\n");
+        fprintf(out->fd, "\tsell <isbn> <qty>\n\t\tsells specified quantity of a book\n");
+        fprintf(out->fd, "\tsellbatch <isbn> <qty> [<isbn> <qty>...]\n\t\tsells all the specified quantities of books at once, or none of them\n\t\t(as many as fit on a command line of %d bytes)\n", MAXCMDLEN - 1);
+        fprintf(out->fd, "\tstock <isbn> <qty>\n\t\tadds specified quantity of a book to the stock\n");
+        fprintf(out->fd, "\tchprice <isbn> <newprice>\n\t\tchanges price of a book\n");
+        fprintf(out->fd, "\tinfo <isbn>\n\t\tshows details of a book\n");
+        fprintf(out->fd, "\tls\n\t\tlists all books in the bookstore\n");
+        fprintf(out->fd, "\ttop <N> [hour|day|week]\n\t\tlists top N bestsellers (of all time, or of the last hour, day or week)\n");
+        fprintf(out->fd, "\tsoldout\n\t\tlists all sold-out books\n");
+        fprintf(out->fd, "\tpricerange <min> <max>\n\t\tlists books priced between min and max, cheapest first\n");
+        fprintf(out->fd, "\tlowstock <N>\n\t\tlists books with fewer than N pieces in stock, lowest stock first\n");
+        fprintf(out->fd, "\trevenue\n\t\tprints number of books sold and their total price\n");
+        fprintf(out->fd, "\tformat <text|tsv|jsonl>\n\t\tsets how books and totals are printed\n");
+        fprintf(out->fd, "\tstats [check|metrics]\n\t\tprints sales and inventory totals (or checks them against the books,\n\t\tor prints command latencies and operation counters)\n");
+        fprintf(out->fd, "\tautosave\n\t\tprints how the autosave checkpoints went and the changes waiting for the next one\n");
         return store;
     } else if (strcmp(argv[0], "load") == 0) {
         if (argc <= 1) {
-            printf("The \"load\" command requires a filename as a parameter\n");
+            fprintf(out->fd, "The \"load\" command requires a filename as a parameter\n");
             return store;
         }
-        if (unsaved_changes) {
-            printf("You have unsaved changes. Really load a new bookstore? [yN] ");
+        if (changes_unsaved(store) && out->interactive) {
+            fprintf(out->fd, "You have unsaved changes. Really load a new bookstore? [yN] ");
             int choice = getchar();
             if (choice == EOF) {
-                printf("Bye.\n");
+                fprintf(out->fd, "Bye.\n");
                 bookstore_free(store);
                 exit(0);
             }
             if (choice != 'y' && choice != 'Y')
                 return store;
         }
+        // the changes not checkpointed yet are not to be lost, and the
+        // file may be the one still being saved
+        if (autosave != NULL)
+            bookstore_checkpoint(store);
+        bookstore_wait_save(store);
         bookstore_t* newstore;
         if ((newstore = bookstore_load(argv[1])) != NULL) {
             bookstore_free(store);
             store = newstore;
             unsaved_changes = false;
-            printf("Loaded bookstore from %s\n", argv[1]);
+            if (journaled)
+                journal_store(store, argv[1]);
+            fprintf(out->fd, "Loaded bookstore from %s\n", argv[1]);
         } else {
-            printf("Failed to load bookstore from %s!\n", argv[1]);
+            fprintf(out->fd, "Failed to load bookstore from %s!\n", argv[1]);
         }
         return store;
     } else if (strcmp(argv[0], "save") == 0) {
+        if (argc > 2) {
+            if (strcmp(argv[2], "compressed") == 0) {
+                store->compressed = true;
+            } else if (strcmp(argv[2], "plain") == 0) {
+                store->compressed = false;
+            } else {
+                fprintf(out->fd, "The \"save\" command takes either compressed or plain as its format\n");
+                return store;
+            }
+        }
+        if (store->journal != NULL && (argc <= 1 || strcmp(argv[1], store->journal->snapshot) == 0)) {
+            // switching formats takes writing a new snapshot
+            if (argc > 2)
+                bookstore_compact(store);
+            else
+                bookstore_commit(store);
+            unsaved_changes = false;
+            return store;
+        }
         if (argc <= 1) {
-            printf("The \"save\" command requires a filename as a parameter\n");
+            fprintf(out->fd, "The \"save\" command requires a filename as a parameter\n");
             return store;
         }
-        bookstore_save(store, argv[1]);
+        bookstore_save_background(store, argv[1]);
+        unsaved_changes = false;
+        return store;
+    } else if (strcmp(argv[0], "format") == 0) {
+        if (argc <= 1 || !output_parse_format(argv[1], &(out->format)))
+            fprintf(out->fd, "The \"format\" command requires one of text, tsv or jsonl as a parameter\n");
+        return store;
+    } else if (strcmp(argv[0], "import") == 0) {
+        if (argc <= 1) {
+            fprintf(out->fd, "The \"import\" command requires a filename as a parameter\n");
+            return store;
+        }
+        import_file(store, out, argv[1]);
+        return store;
+    } else if (strcmp(argv[0], "compact") == 0) {
+        if (store->journal == NULL) {
+            fprintf(out->fd, "The bookstore is not journaled, use \"save\" instead\n");
+            return store;
+        }
+        bookstore_compact(store);
         unsaved_changes = false;
         return store;
     } else if (strcmp(argv[0], "reset") == 0) {
+        // the journal is not to be written to by both bookstores
+        bookstore_wait_save(store);
+        bookstore_t* newstore = bookstore_init();
+        if (store->journal != NULL)
+            journal_store(newstore, store->journal->snapshot);
         bookstore_free(store);
         unsaved_changes = true;
-        return bookstore_init();
+        return newstore;
     } else if (strcmp(argv[0], "bookadd") == 0) {
         if (argc <= 7) {
-            printf("The \"bookadd\" command requires book details as parameters (see \"help\" for details)\n");
+            fprintf(out->fd, "The \"bookadd\" command requires book details as parameters (see \"help\" for details)\n");
             return store;
         }
-        bookstore_add_book(store,
-                book_init(argv[1], argv[2], argv[3],
-                    argv[4], (unsigned int) atoi(argv[5]),
-                    (unsigned int) atoi(argv[6]), atof(argv[7])));
-        unsaved_changes = true;
+        // checked here too, so that the message goes to the client
+        if (book_find(store, argv[1]) != NULL) {
+            fprintf(out->fd, "Book with the same ISBN already exists in the bookstore!\n");
+            return store;
+        }
+        double price;
+        if (!import_parse_price(argv[7], &price)) {
+            fprintf(out->fd, "Price has to be a non-negative number!\n");
+            return store;
+        }
+        book_t* b = bookstore_new_book(store, argv[1], argv[2], argv[3],
+                argv[4], (unsigned int) atoi(argv[5]),
+                (unsigned int) atoi(argv[6]), price);
+        if (bookstore_add_book(store, b))
+            unsaved_changes = true;
+        else
+            book_free(b);
         return store;
     } else if (strcmp(argv[0], "bookdel") == 0) {
         if (argc <= 1) {
-            printf("The \"bookdel\" command requires book ISBN as a pameter\n");
+            fprintf(out->fd, "The \"bookdel\" command requires book ISBN as a pameter\n");
             return store;
         }
         book_t* b = book_find(store, argv[1]);
@@ -106,43 +262,88 @@ bookstore_t* cmd_dispatch(bookstore_t* store, unsigned int argc, char** argv) {
             book_free(b);
             unsaved_changes = true;
         } else {
-            printf("Cannot find book with ISBN %s!\n", argv[1]);
+            fprintf(out->fd, "Cannot find book with ISBN %s!\n", argv[1]);
         }
         return store;
     } else if (strcmp(argv[0], "byauthor") == 0) {
         if (argc <= 1) {
-            printf("The \"byauthor\" command requires an author name as a pameter\n");
+            fprintf(out->fd, "The \"byauthor\" command requires an author name as a pameter\n");
             return store;
         }
-        book_t* b = NULL;
-        while ((b = books_by_author(store, argv[1], b)) != NULL)
-            book_print(b);
+        book_iter_t it;
+        book_t* b;
+        books_by_author_iter(store, argv[1], &it);
+        while ((b = book_iter_next(&it)) != NULL)
+            output_book(out, b);
         return store;
     } else if (strcmp(argv[0], "bygenre") == 0) {
         if (argc <= 1) {
-            printf("The \"bygenre\" command requires a genre as a pameter\n");
+            fprintf(out->fd, "The \"bygenre\" command requires a genre as a pameter\n");
             return store;
         }
-        book_t* b = NULL;
-        while ((b = books_by_genre(store, argv[1], b)) != NULL)
-            book_print(b);
+        book_iter_t it;
+        book_t* b;
+        books_by_genre_iter(store, argv[1], &it);
+        while ((b = book_iter_next(&it)) != NULL)
+            output_book(out, b);
+        return store;
+    } else if (strcmp(argv[0], "bytitle") == 0) {
+        if (argc <= 1) {
+            fprintf(out->fd, "The \"bytitle\" command requires a part of the title as a parameter\n");
+            return store;
+        }
+        // the parameters are looked for as one text, separated by single spaces
+        char text[MAXCMDLEN] = "";
+        for (unsigned int i=1; i<argc; i++) {
+            if (i > 1)
+                strcat(text, " ");
+            strcat(text, argv[i]);
+        }
+        unsigned int num_found;
+        book_t** found = books_by_title(store, text, &num_found);
+        for (unsigned int i=0; i<num_found; i++)
+            output_book(out, found[i]);
+        free(found);
         return store;
     } else if (strcmp(argv[0], "sell") == 0) {
         if (argc <= 2) {
-            printf("The \"sell\" command requires book ISBN and quantity as pameters\n");
+            fprintf(out->fd, "The \"sell\" command requires book ISBN and quantity as parameters\n");
             return store;
         }
         book_t* b = book_find(store, argv[1]);
-        if (b != NULL) {
+        if (b != NULL && b->stocked_qty < (unsigned int) atoi(argv[2])) {
+            fprintf(out->fd, "Stocked quantity is less than requested, cannot sell!\n");
+        } else if (b != NULL) {
             book_sell(b, (unsigned int) atoi(argv[2]));
             unsaved_changes = true;
         } else {
-            printf("Cannot find book with ISBN %s!\n", argv[1]);
+            fprintf(out->fd, "Cannot find book with ISBN %s!\n", argv[1]);
+        }
+        return store;
+    } else if (strcmp(argv[0], "sellbatch") == 0) {
+        if (argc < 3 || argc % 2 == 0) {
+            fprintf(out->fd, "The \"sellbatch\" command requires pairs of book ISBN and quantity as parameters\n");
+            return store;
+        }
+        unsigned int num_sales = (argc - 1) / 2;
+        book_sale_t sales[MAXPARAMS / 2];
+        for (unsigned int i=0; i<num_sales; i++) {
+            sales[i].isbn = argv[1 + 2 * i];
+            sales[i].qty = (unsigned int) atoi(argv[2 + 2 * i]);
+        }
+        unsigned int failed;
+        if (bookstore_sell_batch(store, sales, num_sales, &failed)) {
+            unsaved_changes = true;
+        } else if (book_find(store, sales[failed].isbn) == NULL) {
+            fprintf(out->fd, "Cannot find book with ISBN %s, nothing sold!\n", sales[failed].isbn);
+        } else {
+            fprintf(out->fd, "Stocked quantity of book with ISBN %s is less than requested, nothing sold!\n",
+                    sales[failed].isbn);
         }
         return store;
     } else if (strcmp(argv[0], "stock") == 0) {
         if (argc <= 2) {
-            printf("The \"stock\" command requires book ISBN and quantity as pameters\n");
+            fprintf(out->fd, "The \"stock\" command requires book ISBN and quantity as parameters\n");
             return store;
         }
         book_t* b = book_find(store, argv[1]);
@@ -150,130 +351,367 @@ bookstore_t* cmd_dispatch(bookstore_t* store, unsigned int argc, char** argv) {
             book_stock(b, (unsigned int) atoi(argv[2]));
             unsaved_changes = true;
         } else {
-            printf("Cannot find book with ISBN %s!\n", argv[1]);
+            fprintf(out->fd, "Cannot find book with ISBN %s!\n", argv[1]);
         }
         return store;
     } else if (strcmp(argv[0], "chprice") == 0) {
         if (argc <= 2) {
-            printf("The \"chprice\" command requires book ISBN and new price as pameters\n");
+            fprintf(out->fd, "The \"chprice\" command requires book ISBN and new price as parameters\n");
+            return store;
+        }
+        double price;
+        if (!import_parse_price(argv[2], &price)) {
+            fprintf(out->fd, "Price has to be a non-negative number!\n");
             return store;
         }
         book_t* b = book_find(store, argv[1]);
         if (b != NULL) {
-            book_change_price(b, atof(argv[2]));
+            book_change_price(b, price);
             unsaved_changes = true;
         } else {
-            printf("Cannot find book with ISBN %s!\n", argv[1]);
+            fprintf(out->fd, "Cannot find book with ISBN %s!\n", argv[1]);
         }
         return store;
     } else if (strcmp(argv[0], "info") == 0) {
         if (argc <= 1) {
-            printf("The \"info\" command requires book ISBN as a pameter\n");
+            fprintf(out->fd, "The \"info\" command requires book ISBN as a pameter\n");
             return store;
         }
         book_t* b = book_find(store, argv[1]);
         if (b != NULL)
-            book_print(b);
+            output_book(out, b);
         else
-            printf("Cannot find book with ISBN %s!\n", argv[1]);
+            fprintf(out->fd, "Cannot find book with ISBN %s!\n", argv[1]);
         return store;
     } else if (strcmp(argv[0], "ls") == 0) {
-        bookstore_print(store);
+        output_bookstore(out, store);
         return store;
     } else if (strcmp(argv[0], "top") == 0) {
         if (argc <= 1) {
-            printf("The \"top\" command requires a number as a parameter\n");
+            fprintf(out->fd, "The \"top\" command requires a number as a parameter\n");
             return store;
         }
-        bookstore_get_bestsellers(store, (unsigned int) atoi(argv[1]));
+        if (argc > 2) {
+            ledger_window_t window;
+            if (!ledger_parse_window(argv[2], &window)) {
+                fprintf(out->fd, "The \"top\" command takes either hour, day or week as its window\n");
+                return store;
+            }
+            output_window_bestsellers(out, store, (unsigned int) atoi(argv[1]), window);
+            return store;
+        }
+        output_bestsellers(out, store, (unsigned int) atoi(argv[1]));
+        return store;
+    } else if (strcmp(argv[0], "pricerange") == 0) {
+        if (argc <= 2) {
+            fprintf(out->fd, "The \"pricerange\" command requires the lowest and highest price as parameters\n");
+            return store;
+        }
+        skiplist_iter_t it;
+        book_t* b;
+        books_by_price_iter(store, atof(argv[1]), atof(argv[2]), &it);
+        while ((b = skiplist_iter_next(&it)) != NULL)
+            output_book(out, b);
+        return store;
+    } else if (strcmp(argv[0], "lowstock") == 0) {
+        if (argc <= 1) {
+            fprintf(out->fd, "The \"lowstock\" command requires a quantity as a parameter\n");
+            return store;
+        }
+        skiplist_iter_t it;
+        book_t* b;
+        books_low_stock_iter(store, (unsigned int) strtoul(argv[1], NULL, 10), &it);
+        while ((b = skiplist_iter_next(&it)) != NULL)
+            output_book(out, b);
         return store;
     } else if (strcmp(argv[0], "soldout") == 0) {
-        bookstore_get_sold_out(store);
+        output_sold_out(out, store);
         return store;
     } else if (strcmp(argv[0], "revenue") == 0) {
-        unsigned int n = 0;
-        double sum = 0;
-        for (unsigned int i=0; i<store->num_books; i++) {
-            n += store->books[i]->sold_qty;
-            sum += store->books[i]->price * store->books[i]->sold_qty;
+        if (out->format != OUTPUT_TEXT) {
+            output_totals(out, store);
+            return store;
         }
-        printf("Total %d books sold, totaling %.02f $currency\n", n, sum);
+        fprintf(out->fd, "Total %" PRIu64 " books sold, totaling %.02f $currency\n",
+                store->totals.units_sold, store->totals.revenue);
+        return store;
+    } else if (strcmp(argv[0], "stats") == 0) {
+        if (argc > 1 && strcmp(argv[1], "check") == 0) {
+            if (bookstore_check_totals(store))
+                fprintf(out->fd, "Totals are consistent with the books.\n");
+            else
+                fprintf(out->fd, "Totals do NOT match the books!\n");
+            return store;
+        }
+        if (argc > 1 && strcmp(argv[1], "metrics") == 0) {
+            output_metrics(out);
+            return store;
+        }
+        if (out->format != OUTPUT_TEXT) {
+            output_totals(out, store);
+            return store;
+        }
+        fprintf(out->fd, "Books: %u\n", store->num_books);
+        fprintf(out->fd, "Units sold: %" PRIu64 "\n", store->totals.units_sold);
+        fprintf(out->fd, "Revenue: %.02f $currency\n", store->totals.revenue);
+        fprintf(out->fd, "Units in stock: %" PRIu64 "\n", store->totals.units_in_stock);
+        fprintf(out->fd, "Stock value: %.02f $currency\n", store->totals.stock_value);
+        return store;
+    } else if (strcmp(argv[0], "autosave") == 0) {
+        autosave_write(store, out);
         return store;
     }
 
-    printf("Unknown command: %s\n", argv[0]);
-    printf("Try \"help\" to get a list of available commands\n");
+    fprintf(out->fd, "Unknown command: %s\n", argv[0]);
+    fprintf(out->fd, "Try \"help\" to get a list of available commands\n");
     return store;
 }
 
 
-void bookshell(bookstore_t* store) {
-    char cmd[MAXCMDLEN];
+// splits a command line into parameters and dispatches it
+bookstore_t* cmd_run(bookstore_t* store, output_t* out, char* cmd) {
     char* params[MAXPARAMS];
     unsigned int i;
     char* last;
 
-    printf("\nBDSM v1.3.37 shell ready.\n");
-    printf("Type \"help\" for instructions.\n");
+    params[0] = strtok_r(cmd, " \t", &last);
+    if (params[0] == NULL)
+        return store;
+    for (i=1; i<MAXPARAMS; i++) {
+         params[i] = strtok_r(NULL, " \t", &last);
+         if (params[i] == NULL)
+             break;
+    }
+
+    metrics_command_t* command = metrics_command(params[0]);
+    uint64_t start = metrics_now();
+    store = cmd_dispatch(store, out, i, params);
+    metrics_record(command, metrics_now() - start);
+    if (autosave != NULL && !cmd_is_read_only(params[0]))
+        autosave_poll(autosave, store);
+    return store;
+}
+
+// writes the metrics into a file as JSON lines
+void metrics_write(FILE* fd) {
+    output_t* out = output_init(fd, OUTPUT_JSONL, false);
+    output_metrics(out);
+    output_free(out);
+}
+
+// whether a command line leaves the bookstore as it is
+bool cmd_is_read_only(const char* cmd) {
+    static const char* read_only[] = {"help", "info", "ls", "byauthor", "bygenre",
+        "bytitle", "top", "pricerange", "lowstock", "soldout", "revenue", "stats", "format", "autosave", NULL};
+    cmd += strspn(cmd, " \t");
+    size_t len = strcspn(cmd, " \t");
+    for (unsigned int i=0; read_only[i] != NULL; i++) {
+        if (strlen(read_only[i]) == len && strncmp(cmd, read_only[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// whether a command line goes through the whole bookstore, and had better
+// do so on a snapshot of it; revenue and stats only read running totals and
+// the store's own state, so they just take the read lock
+bool cmd_is_report(const char* cmd) {
+    static const char* reports[] = {"ls", "top", "soldout", NULL};
+    cmd += strspn(cmd, " \t");
+    size_t len = strcspn(cmd, " \t");
+    // the bestsellers of a window come from the sales ledger, which
+    // snapshots do not have, and only go through the books sold lately
+    if (len == 3 && strncmp(cmd, "top", len) == 0) {
+        const char* param = cmd + len + strspn(cmd + len, " \t");
+        param += strcspn(param, " \t");
+        if (param[strspn(param, " \t")] != '\0')
+            return false;
+    }
+    for (unsigned int i=0; reports[i] != NULL; i++) {
+        if (strlen(reports[i]) == len && strncmp(cmd, reports[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// whether a line read by fgets() was cut short by the size of its buffer,
+// in which case the rest of it gets read and thrown away
+bool skip_long_line(FILE* fd, const char* line) {
+    if (strchr(line, '\n') != NULL || feof(fd))
+        return false;
+    int c;
+    while ((c = fgetc(fd)) != EOF && c != '\n')
+        ;
+    return true;
+}
+
+
+void bookshell(bookstore_t* store, output_t* out) {
+    char cmd[MAXCMDLEN];
+
+    if (out->interactive) {
+        fprintf(out->fd, "\nBDSM v1.3.37 shell ready.\n");
+        fprintf(out->fd, "Type \"help\" for instructions.\n");
+    }
+
+    if (autosave_interval > 0)
+        autosave = autosave_start(&store, &shell_lock, autosave_interval, autosave_changes);
 
     while (true) {
-        printf("> ");
+        if (out->interactive)
+            fprintf(out->fd, "> ");
 
         if (fgets(cmd, sizeof(cmd), stdin) == NULL) {
-            printf("Bye.\n");
+            if (out->interactive)
+                fprintf(out->fd, "Bye.\n");
+            if (autosave != NULL)
+                autosave_stop(autosave, store);
             bookstore_free(store);
             exit(0);
         }
+        if (skip_long_line(stdin, cmd)) {
+            fprintf(out->fd, "Command too long (over %d bytes), ignoring it!\n", MAXCMDLEN - 1);
+            continue;
+        }
 
         if (cmd[strlen(cmd)-1] == '\n')
             cmd[strlen(cmd)-1] = '\0';
 
-        params[0] = strtok_r(cmd, " \t", &last);
-        if (params[0] != NULL) {
-            for (i=1; i<MAXPARAMS; i++) {
-                 params[i] = strtok_r(NULL, " \t", &last);
-                 if (params[i] == NULL)
-                     break;
-            }
-
-            store = cmd_dispatch(store, i, params);
-        }
+        pthread_rwlock_wrlock(&shell_lock);
+        store = cmd_run(store, out, cmd);
+        pthread_rwlock_unlock(&shell_lock);
     }
 }
 
 
 int main(int argc, char** argv) {
-    printf("  ____________________________________________\n");
-    printf(" /                                            \\\n");
-    printf("| Bookstore Database and Sales Manager v1.3.37 |\n");
-    printf(" \\____________________________________________/\n\n");
-
     bookstore_t* store;
+    const char* filename = NULL;
+    const char* import = NULL;
+    const char* socket_path = NULL;
+    const char* metrics_file = NULL;
+    unsigned int metrics_interval = METRICS_DEFAULT_DUMP_INTERVAL;
+    unsigned int num_threads = SERVER_DEFAULT_THREADS;
+    bool batch = false;
+    output_format_t format = OUTPUT_TEXT;
+    bool format_given = false;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--journal") == 0) {
+            journaled = true;
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if ((strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--import") == 0) && i + 1 < argc) {
+            import = argv[++i];
+        } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--serve") == 0) && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+            num_threads = (unsigned int) atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0) && i + 1 < argc) {
+            if (!output_parse_format(argv[++i], &format)) {
+                printf("ERROR: Unknown output format %s!\n", argv[i]);
+                exit(1);
+            }
+            format_given = true;
+        } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--metrics") == 0) && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = (unsigned int) atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--autosave") == 0) && i + 1 < argc) {
+            autosave_interval = (unsigned int) atoi(argv[++i]);
+            journaled = true;
+        } else if (strcmp(argv[i], "--autosave-changes") == 0 && i + 1 < argc) {
+            autosave_changes = (unsigned int) atoi(argv[++i]);
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            printf("ERROR: Too many arguments!\n");
+            printf("Usage:\n");
+            printf("\t%s [--batch] [--format text|tsv|jsonl] [--journal] [--import <csvfile>]\n\t\t[--serve <socket> [--threads N]] [--metrics <file> [--metrics-interval S]]\n\t\t[--autosave <seconds> [--autosave-changes N]] [filename]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    if (argc == 1) {
-        printf("NOTE: No filename specified, working in-memory only.\n");
-        printf("HINT: To load and work with a file-based bookstore database, use:\n");
-        printf("\t%s <filename>\n", argv[0]);
-        printf("...or simply type \"load <filename>\". Make sure to save often!\n");
+    // scripts get no prompts or chatter, just the results, written out
+    // in big chunks instead of line by line
+    if (batch) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+        if (!format_given)
+            format = OUTPUT_TSV;
+    }
+    output_t* out = output_init(stdout, format, !batch);
+
+    metrics_init(cmd_names, sizeof(cmd_names) / sizeof(cmd_names[0]));
+    if (metrics_file != NULL) {
+        metrics_dump_start(metrics_file, metrics_interval, metrics_write);
+        // the shell leaves by calling exit(), make sure the last dump happens
+        atexit(metrics_dump_stop);
+    }
+
+    if (out->interactive) {
+        printf("  ____________________________________________\n");
+        printf(" /                                            \\\n");
+        printf("| Bookstore Database and Sales Manager v1.3.37 |\n");
+        printf(" \\____________________________________________/\n\n");
+    }
+
+    if (filename == NULL) {
+        if (out->interactive) {
+            printf("NOTE: No filename specified, working in-memory only.\n");
+            printf("HINT: To load and work with a file-based bookstore database, use:\n");
+            printf("\t%s <filename>\n", argv[0]);
+            printf("...or simply type \"load <filename>\". Make sure to save often!\n");
+        }
         store = bookstore_init();
-    } else if (argc == 2) {
-        if ((store = bookstore_load(argv[1])) != NULL) {
-            printf("Loaded bookstore database from %s...\n", argv[1]);
+    } else {
+        if ((store = bookstore_load(filename)) != NULL) {
+            if (out->interactive)
+                printf("Loaded bookstore database from %s...\n", filename);
+        } else if (access(filename, F_OK) == 0) {
+            printf("ERROR: %s is not a valid bookstore database!\n", filename);
+            exit(1);
         } else {
-            printf("Bookstore database file %s does not exist yet, creating...\n", argv[1]);
+            if (out->interactive)
+                printf("Bookstore database file %s does not exist yet, creating...\n", filename);
             store = bookstore_init();
             // or we just didn't have read permission,
             // in which case the following will terminate the program
-            bookstore_save(store, argv[1]);
+            bookstore_save(store, filename);
         }
-    } else {
-        printf("ERROR: Too many arguments!\n");
-        printf("Usage:\n");
-        printf("\t%s [filename]\n", argv[0]);
-        exit(1);
+        if (journaled) {
+            journal_store(store, filename);
+            if (out->interactive && autosave_interval > 0)
+                printf("Journaling changes to %s, saved every %u seconds.\n", store->journal->filename,
+                        autosave_interval);
+            else if (out->interactive)
+                printf("Journaling changes to %s, \"save\" commits them.\n", store->journal->filename);
+        }
+    }
+
+    if (import != NULL)
+        import_file(store, out, import);
+
+    if (socket_path != NULL) {
+        static const server_commands_t commands = {cmd_run, cmd_is_read_only, cmd_is_report};
+        server_t* server = server_init(store, socket_path, num_threads, &commands, out->format);
+        if (autosave_interval > 0)
+            autosave = autosave_start(&(server->store), &(server->store_lock), autosave_interval,
+                    autosave_changes);
+        printf("Serving the bookstore on %s with %u threads...\n", socket_path, server->num_workers);
+        fflush(stdout);
+        store = server_run(server);
+        if (autosave != NULL)
+            autosave_stop(autosave, store);
+        server_free(server);
+        if (changes_unsaved(store))
+            printf("Discarding unsaved changes.\n");
+        printf("Bye.\n");
+        bookstore_free(store);
+        output_free(out);
+        return 0;
     }
 
-    bookshell(store);
+    bookshell(store, out);
 
     return 0;
 }
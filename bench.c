@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include "bookstore.h"
+#include "import.h"
+
+#define DEFAULT_NUM_BOOKS 10000000
+#define DEFAULT_NUM_AUTHORS 100000
+#define DEFAULT_NUM_GENRES 1000
+#define DEFAULT_SKEW 0.0
+#define REPEATS 5
+#define SEED 42
+#define NUM_LOOKUPS 1000000
+#define NUM_AUTHOR_QUERIES 10000
+#define NUM_TITLE_QUERIES 1000
+#define NUM_RANGE_QUERIES 10000
+#define NUM_CHURN 2000000
+#define NUM_COMMANDS 100000
+#define NUM_SALES 4096
+#define MAX_SALES_BATCH 256
+#define IMPORT_FILE "bench.csv"
+#define LOAD_FILE "bench.dat"
+#define SCRIPT_FILE "bench.txt"
+#define EMPTY_SCRIPT_FILE "bench-empty.txt"
+
+// keeps the compiler from optimizing the measured work away
+volatile double sink;
+
+// the shape of the generated catalog
+typedef struct catalog_struct {
+    unsigned int num_books;
+    unsigned int num_authors;
+    unsigned int num_genres;
+    double skew; // exponent of the Zipf distribution of authors and genres, 0 is uniform
+    double* author_cdf;
+    double* genre_cdf;
+    uint64_t rng;
+} catalog_t;
+
+// what the query scenarios look for, generated once per catalog
+typedef struct queries_struct {
+    char (*isbns)[16];
+    char (*authors)[16];
+    char (*titles)[16];
+} queries_t;
+
+static catalog_t catalog;
+static queries_t queries;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, so that every run generates the very same catalog
+static uint64_t rng_next(void) {
+    catalog.rng ^= catalog.rng >> 12;
+    catalog.rng ^= catalog.rng << 25;
+    catalog.rng ^= catalog.rng >> 27;
+    return catalog.rng * 2685821657736338717ULL;
+}
+
+static unsigned int rng_below(const unsigned int n) {
+    return (unsigned int) (rng_next() % n);
+}
+
+// cumulative distribution of ranks 0..n-1 with weights 1/(rank+1)^skew
+static double* zipf_cdf(const unsigned int n, const double skew) {
+    double* ret = malloc(n * sizeof(double));
+    if (ret == NULL) exit(errno);
+    double sum = 0;
+    for (unsigned int i=0; i<n; i++) {
+        sum += pow(i + 1, -skew);
+        ret[i] = sum;
+    }
+    for (unsigned int i=0; i<n; i++)
+        ret[i] /= sum;
+    return ret;
+}
+
+static unsigned int zipf_next(const double* cdf, const unsigned int n) {
+    double x = (double) (rng_next() >> 11) / 9007199254740992.0;
+    unsigned int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bookstore_t* generate(void) {
+    char isbn[32], title[32], author[32], genre[32];
+    catalog.rng = SEED;
+    bookstore_t* store = bookstore_init();
+    bookstore_reserve(store, catalog.num_books);
+    for (unsigned int i=0; i<catalog.num_books; i++) {
+        snprintf(isbn, sizeof(isbn), "978%010u", i);
+        snprintf(title, sizeof(title), "Title%u", i);
+        snprintf(author, sizeof(author), "Author%u", zipf_next(catalog.author_cdf, catalog.num_authors));
+        snprintf(genre, sizeof(genre), "Genre%u", zipf_next(catalog.genre_cdf, catalog.num_genres));
+        unsigned int stocked_qty = rng_below(20);
+        unsigned int sold_qty = rng_below(37);
+        bookstore_add_book(store, bookstore_new_book(store, isbn, title, author, genre,
+                    stocked_qty, sold_qty, 5 + rng_below(1000) / 10.0));
+    }
+    return store;
+}
+
+// ISBNs are looked up uniformly, authors as skewed as they are in the catalog
+static void generate_queries(void) {
+    queries.isbns = malloc(NUM_LOOKUPS * sizeof(queries.isbns[0]));
+    queries.authors = malloc(NUM_AUTHOR_QUERIES * sizeof(queries.authors[0]));
+    queries.titles = malloc(NUM_TITLE_QUERIES * sizeof(queries.titles[0]));
+    if (queries.isbns == NULL || queries.authors == NULL || queries.titles == NULL) exit(errno);
+    for (unsigned int i=0; i<NUM_LOOKUPS; i++)
+        snprintf(queries.isbns[i], sizeof(queries.isbns[i]), "978%010u", rng_below(catalog.num_books));
+    for (unsigned int i=0; i<NUM_AUTHOR_QUERIES; i++)
+        snprintf(queries.authors[i], sizeof(queries.authors[i]), "Author%u",
+                zipf_next(catalog.author_cdf, catalog.num_authors));
+    // the middle of a title, matching one book and those whose number
+    // it is a prefix of
+    for (unsigned int i=0; i<NUM_TITLE_QUERIES; i++)
+        snprintf(queries.titles[i], sizeof(queries.titles[i]), "ITLE%u", rng_below(catalog.num_books));
+}
+
+static void report(const char* name, const unsigned int num_books, const unsigned int ops,
+        const double seconds) {
+    printf("%s\t%u\t%u\t%u\t%.2f\t%u\t%.6f\t%.3f\n", name, num_books, catalog.num_authors,
+            catalog.num_genres, catalog.skew, ops, seconds, seconds * 1e9 / (ops ? ops : 1));
+}
+
+// the way aggregates used to be computed: one book_t dereference per row
+static unsigned int revenue_rowwise(const bookstore_t* store) {
+    uint64_t n = 0;
+    double sum = 0;
+    for (unsigned int i=0; i<store->num_books; i++) {
+        n += store->books[i]->sold_qty;
+        sum += store->books[i]->price * store->books[i]->sold_qty;
+    }
+    sink = sum + (double) n;
+    return store->num_books;
+}
+
+static unsigned int revenue_columns(const bookstore_t* store) {
+    uint64_t n;
+    double sum;
+    bookstore_sales_totals(store, &n, &sum);
+    sink = sum + (double) n;
+    return store->num_books;
+}
+
+static unsigned int stock_value_rowwise(const bookstore_t* store) {
+    uint64_t n = 0;
+    double sum = 0;
+    for (unsigned int i=0; i<store->num_books; i++) {
+        n += store->books[i]->stocked_qty;
+        sum += store->books[i]->price * store->books[i]->stocked_qty;
+    }
+    sink = sum + (double) n;
+    return store->num_books;
+}
+
+static unsigned int stock_value_columns(const bookstore_t* store) {
+    uint64_t n;
+    double sum;
+    bookstore_stock_totals(store, &n, &sum);
+    sink = sum + (double) n;
+    return store->num_books;
+}
+
+static unsigned int sold_out_rowwise(const bookstore_t* store) {
+    unsigned int n = 0;
+    for (unsigned int i=0; i<store->num_books; i++)
+        n += store->books[i]->stocked_qty == 0;
+    sink = n;
+    return store->num_books;
+}
+
+static unsigned int sold_out_columns(const bookstore_t* store) {
+    unsigned int n = 0;
+    for (unsigned int i=0; i<store->num_books; i++)
+        n += store->columns.stocked_qty[i] == 0;
+    sink = n;
+    return store->num_books;
+}
+
+static unsigned int top_sellers(const bookstore_t* store) {
+    book_t* top[10];
+    sink = bookstore_top_sellers(store, 10, top);
+    return 1;
+}
+
+// goes through the books sold lately only, as run after the sales scenarios
+static unsigned int top_sellers_week(const bookstore_t* store) {
+    book_t* top[10];
+    unsigned int qty[10];
+    sink = bookstore_window_top_sellers(store, LEDGER_WEEK, 10, top, qty);
+    return 1;
+}
+
+static unsigned int find_books(const bookstore_t* store) {
+    unsigned int n = 0;
+    for (unsigned int i=0; i<NUM_LOOKUPS; i++)
+        n += book_find(store, queries.isbns[i]) != NULL;
+    sink = n;
+    return NUM_LOOKUPS;
+}
+
+static unsigned int find_by_author(const bookstore_t* store) {
+    unsigned int n = 0;
+    book_iter_t it;
+    for (unsigned int i=0; i<NUM_AUTHOR_QUERIES; i++) {
+        books_by_author_iter(store, queries.authors[i], &it);
+        while (book_iter_next(&it) != NULL)
+            n++;
+    }
+    sink = n;
+    return NUM_AUTHOR_QUERIES;
+}
+
+static unsigned int find_by_title(const bookstore_t* store) {
+    unsigned int n = 0;
+    for (unsigned int i=0; i<NUM_TITLE_QUERIES; i++) {
+        unsigned int num_found;
+        free(books_by_title(store, queries.titles[i], &num_found));
+        n += num_found;
+    }
+    sink = n;
+    return NUM_TITLE_QUERIES;
+}
+
+// ranges of a single price out of the 1000 generated, or about 1000 books
+// on 1M of them
+static unsigned int find_by_price(const bookstore_t* store) {
+    unsigned int n = 0;
+    skiplist_iter_t it;
+    for (unsigned int i=0; i<NUM_RANGE_QUERIES; i++) {
+        double price = 5 + (i % 1000) / 10.0;
+        books_by_price_iter(store, price - 0.01, price + 0.01, &it);
+        while (skiplist_iter_next(&it) != NULL)
+            n++;
+    }
+    sink = n;
+    return NUM_RANGE_QUERIES;
+}
+
+// reports the best of several runs of a read-only scenario
+static void run(const char* name, unsigned int (*scenario)(const bookstore_t*), const bookstore_t* store) {
+    double best = 0;
+    unsigned int ops = 0;
+    for (unsigned int i=0; i<REPEATS; i++) {
+        double start = now();
+        ops = scenario(store);
+        double elapsed = now() - start;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    report(name, store->num_books, ops, best);
+}
+
+// removes random books and adds them right back, recycling their memory
+static void run_churn(bookstore_t* store) {
+    char isbn[32], title[32], author[32], genre[32];
+    unsigned int ops = store->num_books ? NUM_CHURN : 0;
+    double start = now();
+    for (unsigned int i=0; i<ops; i++) {
+        book_t* book = book_find(store, queries.isbns[i % NUM_LOOKUPS]);
+        unsigned int stocked_qty = book->stocked_qty;
+        unsigned int sold_qty = book->sold_qty;
+        double price = book->price;
+        snprintf(isbn, sizeof(isbn), "%s", book->isbn);
+        snprintf(title, sizeof(title), "%s", book->title);
+        snprintf(author, sizeof(author), "%s", book->author);
+        snprintf(genre, sizeof(genre), "%s", book->genre);
+        bookstore_remove_book(store, book);
+        book_free(book);
+        bookstore_add_book(store, bookstore_new_book(store, isbn, title, author, genre,
+                    stocked_qty, sold_qty, price));
+    }
+    report("churn_remove_add", store->num_books, ops, now() - start);
+}
+
+// removes every tenth book at once, then puts them all back
+static void run_remove_bulk(bookstore_t* store) {
+    unsigned int ops = store->num_books / 10;
+    book_t** removed = malloc((ops + 1) * sizeof(book_t*));
+    if (removed == NULL) exit(errno);
+    for (unsigned int i=0; i<ops; i++)
+        removed[i] = store->books[i * 10];
+    double start = now();
+    for (unsigned int i=0; i<ops; i++)
+        bookstore_remove_book(store, removed[i]);
+    report("remove_bulk", store->num_books + ops, ops, now() - start);
+    for (unsigned int i=0; i<ops; i++)
+        bookstore_add_book(store, removed[i]);
+    free(removed);
+}
+
+// times a single import of the whole bookstore from a CSV file
+static void run_import(const bookstore_t* store) {
+    FILE* fd = fopen(IMPORT_FILE, "w");
+    if (fd == NULL)
+        return;
+    for (unsigned int i=0; i<store->num_books; i++) {
+        const book_t* b = store->books[i];
+        fprintf(fd, "%s,\"%s\",%s,%s,%u,%u,%.2f\n", b->isbn, b->title, b->author, b->genre,
+                b->stocked_qty, b->sold_qty, b->price);
+    }
+    fclose(fd);
+
+    bookstore_t* imported = bookstore_init();
+    import_stats_t stats;
+    double start = now();
+    bookstore_import(imported, IMPORT_FILE, &stats);
+    report("import_csv", stats.num_imported, stats.num_imported, now() - start);
+    bookstore_free(imported);
+    unlink(IMPORT_FILE);
+}
+
+// times a run of bdsm in batch mode over a script, including loading the file
+static double run_bdsm(const char* script) {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "./bdsm --batch %s < %s > /dev/null", LOAD_FILE, script);
+    double start = now();
+    if (system(cmd) != 0)
+        return -1;
+    return now() - start;
+}
+
+// times commands going through the whole bdsm command loop over the saved
+// file: the time of an empty script (starting up and loading it) is subtracted
+static void run_dispatch(const bookstore_t* store) {
+    if (access("./bdsm", X_OK) != 0 || store->num_books == 0)
+        return;
+
+    FILE* script = fopen(SCRIPT_FILE, "w");
+    FILE* empty = fopen(EMPTY_SCRIPT_FILE, "w");
+    if (script == NULL || empty == NULL)
+        exit(errno);
+    for (unsigned int i=0; i<NUM_COMMANDS; i++) {
+        unsigned int kind = rng_below(100);
+        const char* isbn = queries.isbns[rng_below(NUM_LOOKUPS)];
+        if (kind < 70)
+            fprintf(script, "info %s\n", isbn);
+        else if (kind < 85)
+            fprintf(script, "byauthor Author%u\n", rng_below(catalog.num_authors));
+        else if (kind < 95)
+            fprintf(script, "sell %s 1\n", isbn);
+        else
+            fprintf(script, "top 10\n");
+    }
+    fclose(script);
+    fclose(empty);
+
+    double best = 0;
+    for (unsigned int i=0; i<REPEATS; i++) {
+        double base = run_bdsm(EMPTY_SCRIPT_FILE);
+        double elapsed = run_bdsm(SCRIPT_FILE);
+        if (base < 0 || elapsed < 0)
+            break;
+        if (i == 0 || elapsed - base < best)
+            best = elapsed - base;
+    }
+    report("command_dispatch", store->num_books, NUM_COMMANDS, best);
+    unlink(SCRIPT_FILE);
+    unlink(EMPTY_SCRIPT_FILE);
+}
+
+// sells books in batches of a given size on the journaled bookstore, every
+// batch being synced to disk before the next one starts
+static void run_sell_batch(bookstore_t* store, const unsigned int batch_size) {
+    book_sale_t sales[MAX_SALES_BATCH];
+    unsigned int failed;
+    unsigned int ops = NUM_SALES - NUM_SALES % batch_size;
+    double start = now();
+    for (unsigned int i=0; i<ops; i += batch_size) {
+        for (unsigned int j=0; j<batch_size; j++) {
+            sales[j].isbn = queries.isbns[i + j];
+            sales[j].qty = 1;
+        }
+        if (!bookstore_sell_batch(store, sales, batch_size, &failed))
+            exit(1);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "sell_batch_%u", batch_size);
+    report(name, store->num_books, ops, now() - start);
+}
+
+// journals the bookstore saved last, then times durable sales one at a
+// time and in ever larger batches
+static void run_sell_batches(bookstore_t* store) {
+    // enough stock for every size of batch to sell all the books it picks
+    for (unsigned int i=0; i<NUM_SALES; i++)
+        book_stock(book_find(store, queries.isbns[i]), 3);
+    bookstore_save(store, LOAD_FILE);
+    bookstore_journal(store, LOAD_FILE);
+    run_sell_batch(store, 1);
+    run_sell_batch(store, 16);
+    run_sell_batch(store, MAX_SALES_BATCH);
+    journal_close(store->journal);
+    store->journal = NULL;
+    char* journal = journal_path(LOAD_FILE);
+    unlink(journal);
+    free(journal);
+}
+
+// times saving the whole bookstore and loading it back
+static void run_save_load(bookstore_t* store, const char* save_name, const char* load_name) {
+    double best = 0;
+    for (unsigned int i=0; i<REPEATS; i++) {
+        double start = now();
+        bookstore_save(store, LOAD_FILE);
+        double elapsed = now() - start;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    report(save_name, store->num_books, store->num_books, best);
+
+    best = 0;
+    for (unsigned int i=0; i<REPEATS; i++) {
+        double start = now();
+        bookstore_t* loaded = bookstore_load(LOAD_FILE);
+        double elapsed = now() - start;
+        if (loaded == NULL)
+            break;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+        bookstore_free(loaded);
+    }
+    report(load_name, store->num_books, store->num_books, best);
+}
+
+// reads a positive count from a command line argument, returns false if
+// it is anything else
+static bool parse_count(const char* str, unsigned int* value) {
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(str, &end, 10);
+    if (*str < '0' || *str > '9' || *end != '\0' || errno != 0 || n == 0 || n > UINT_MAX)
+        return false;
+    *value = (unsigned int) n;
+    return true;
+}
+
+// reads a non-negative number from a command line argument, returns false
+// if it is anything else
+static bool parse_skew(const char* str, double* value) {
+    char* end;
+    errno = 0;
+    *value = strtod(str, &end);
+    return end != str && *end == '\0' && errno == 0 && isfinite(*value) && *value >= 0;
+}
+
+int main(int argc, char** argv) {
+    catalog.num_books = DEFAULT_NUM_BOOKS;
+    catalog.num_authors = DEFAULT_NUM_AUTHORS;
+    catalog.num_genres = DEFAULT_NUM_GENRES;
+    catalog.skew = DEFAULT_SKEW;
+    if (argc > 5 || (argc > 1 && !parse_count(argv[1], &(catalog.num_books)))
+            || (argc > 2 && !parse_count(argv[2], &(catalog.num_authors)))
+            || (argc > 3 && !parse_count(argv[3], &(catalog.num_genres)))
+            || (argc > 4 && !parse_skew(argv[4], &(catalog.skew)))) {
+        printf("Usage:\n");
+        printf("\t%s [books] [authors] [genres] [skew]\n", argv[0]);
+        return 1;
+    }
+    catalog.author_cdf = zipf_cdf(catalog.num_authors, catalog.skew);
+    catalog.genre_cdf = zipf_cdf(catalog.num_genres, catalog.skew);
+
+    bookstore_t* store = generate();
+    if (store->num_books > 0)
+        generate_queries();
+
+    printf("scenario\tbooks\tauthors\tgenres\tskew\tops\tseconds\tns_per_op\n");
+    run("revenue_rowwise", revenue_rowwise, store);
+    run("revenue_columns", revenue_columns, store);
+    run("stock_value_rowwise", stock_value_rowwise, store);
+    run("stock_value_columns", stock_value_columns, store);
+    run("sold_out_rowwise", sold_out_rowwise, store);
+    run("sold_out_columns", sold_out_columns, store);
+    run("top_sellers_10", top_sellers, store);
+    if (store->num_books > 0) {
+        run("book_find", find_books, store);
+        run("books_by_author", find_by_author, store);
+        run("books_by_title", find_by_title, store);
+        run("books_by_price", find_by_price, store);
+        run_churn(store);
+        run_remove_bulk(store);
+    }
+    run_import(store);
+    store->compressed = true;
+    run_save_load(store, "save_compressed", "load_compressed");
+    store->compressed = false;
+    run_save_load(store, "save", "load");
+    run_dispatch(store);
+    if (store->num_books > 0) {
+        run_sell_batches(store);
+        run("top_sellers_week_10", top_sellers_week, store);
+        run("top_sellers_10", top_sellers, store);
+    }
+    unlink(LOAD_FILE);
+
+    bookstore_free(store);
+    free(queries.isbns);
+    free(queries.authors);
+    free(queries.titles);
+    free(catalog.author_cdf);
+    free(catalog.genre_cdf);
+    return 0;
+}
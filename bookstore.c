@@ -3,22 +3,94 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include "bookstore.h"
+#include "metrics.h"
+#include "lz.h"
 
+#define BOOKSTORE_MIN_CAPACITY 16
+
+// rough size of a serialized book, used to presize serialization buffers
+#define BOOK_SERIALIZED_SIZE_HINT 80
+
+// fewest bytes a book takes up in a compressed file: an empty ISBN and
+// title, four one-byte varints and the price
+#define BOOK_COMPRESSED_MIN_SIZE (2 + 4 + sizeof(double))
+
+// bookstores are saved through a buffer of this size, whatever their size
+#define BOOKSTORE_SAVE_CHUNK_SIZE (1024 * 1024)
+
+// loading is split among at most this many threads, each decoding at least
+// BOOKSTORE_LOAD_MIN_SLICE records
+#define BOOKSTORE_LOAD_MAX_THREADS 16
+#define BOOKSTORE_LOAD_MIN_SLICE 65536
+
+
+static void totals_add(bookstore_totals_t* totals, const book_t* book);
+static void totals_sub(bookstore_totals_t* totals, const book_t* book);
+static void bookstore_reclaim(bookstore_t* store);
+
+
+// allocates a book from an arena (or the heap, if arena is NULL) along with
+// copies of its strings, all in one contiguous block; author and genre are
+// only copied if given, books in a bookstore use its interned copies instead
+static book_t* book_alloc(arena_t* arena, const char* isbn, const char* title,
+        const char* author, const char* genre) {
+    size_t isbn_len = strlen(isbn) + 1;
+    size_t title_len = strlen(title) + 1;
+    size_t author_len = (author == NULL) ? 0 : strlen(author) + 1;
+    size_t genre_len = (genre == NULL) ? 0 : strlen(genre) + 1;
+    size_t size = sizeof(book_t) + isbn_len + title_len + author_len + genre_len;
+
+    book_t* ret = arena_alloc(arena, size);
+    ret->arena = arena;
+    ret->alloc_size = size;
+    ret->store = NULL;
+    ret->epoch = 0;
+    ret->retired = false;
+    ret->dirty_pos = BOOK_CLEAN;
+
+    char* str = (char*) (ret + 1);
+    ret->isbn = memcpy(str, isbn, isbn_len);
+    str += isbn_len;
+    ret->title = memcpy(str, title, title_len);
+    str += title_len;
+    ret->author = (author == NULL) ? NULL : memcpy(str, author, author_len);
+    str += author_len;
+    ret->genre = (genre == NULL) ? NULL : memcpy(str, genre, genre_len);
+    return ret;
+}
+
+// points a book's author and genre to their interned copies in a bookstore
+static void book_intern(bookstore_t* store, book_t* book, const unsigned int author_id,
+        const unsigned int genre_id) {
+    book->author_id = author_id;
+    book->author = intern_get(store->strings, author_id);
+    book->genre_id = genre_id;
+    book->genre = intern_get(store->strings, genre_id);
+}
 
 book_t* book_init(const char* isbn, const char* title, const char* author,
         const char* genre, const unsigned int stocked_qty,
         const unsigned int sold_qty, const double price) {
-    book_t* ret = malloc(sizeof(book_t));
-    if (ret == NULL) exit(errno);
-    ret->isbn = strdup(isbn);
-    if (ret->isbn == NULL) exit(errno);
-    ret->title = strdup(title);
-    if (ret->title == NULL) exit(errno);
-    ret->author = strdup(author);
-    if (ret->author == NULL) exit(errno);
-    ret->genre = strdup(genre);
-    if (ret->genre == NULL) exit(errno);
+    book_t* ret = book_alloc(NULL, isbn, title, author, genre);
+    ret->author_id = ret->genre_id = INTERN_NONE;
+    ret->stocked_qty = stocked_qty;
+    ret->sold_qty = sold_qty;
+    ret->price = price;
+    return ret;
+}
+
+book_t* bookstore_new_book(bookstore_t* store, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price) {
+    book_t* ret = book_alloc(store->arena, isbn, title, NULL, NULL);
+    book_intern(store, ret, intern_str(store->strings, author), intern_str(store->strings, genre));
     ret->stocked_qty = stocked_qty;
     ret->sold_qty = sold_qty;
     ret->price = price;
@@ -29,161 +101,1635 @@ bookstore_t* bookstore_init(void) {
     bookstore_t* ret = malloc(sizeof(bookstore_t));
     if (ret == NULL) exit(errno);
     ret->num_books = 0;
+    ret->capacity = 0;
     ret->books = NULL;
+    ret->slots = NULL;
+    ret->num_slots = 0;
+    ret->slots_capacity = 0;
+    ret->free_slot = BOOKSTORE_NO_SLOT;
+    ret->columns.stocked_qty = NULL;
+    ret->columns.sold_qty = NULL;
+    ret->columns.price = NULL;
+    memset(&(ret->totals), 0, sizeof(bookstore_totals_t));
+    ret->num_heap_books = 0;
+    ret->arena = arena_init();
+    ret->strings = intern_init(ret->arena);
+    ret->map = NULL;
+    ret->map_size = 0;
+    ret->isbn_index = isbn_index_init();
+    ret->author_index = posting_index_init(BOOK_FIELD_AUTHOR);
+    ret->genre_index = posting_index_init(BOOK_FIELD_GENRE);
+    ret->title_index = trigram_index_init();
+    ret->price_index = skiplist_init(BOOK_FIELD_PRICE);
+    ret->stock_index = skiplist_init(BOOK_FIELD_STOCKED_QTY);
+    ret->ledger = ledger_init();
+    ret->bulk = false;
+    ret->bulk_start = 0;
+    ret->generation = 0;
+    ret->journal = NULL;
+    ret->next_seq = 0;
+    ret->compressed = false;
+    ret->epoch = 0;
+    ret->snapshots = NULL;
+    if (pthread_mutex_init(&(ret->snapshot_lock), NULL) != 0
+            || pthread_cond_init(&(ret->snapshot_released), NULL) != 0)
+        exit(errno);
+    ret->retired = NULL;
+    ret->num_retired = 0;
+    ret->retired_capacity = 0;
+    ret->save_job = NULL;
+    ret->dirty = NULL;
+    ret->num_dirty = 0;
+    ret->dirty_capacity = 0;
+    ret->removed = NULL;
+    ret->num_removed = 0;
+    ret->num_changes = 0;
+    ret->dirty_since = 0;
+    ret->checkpoint_seq = 0;
+    memset(&(ret->checkpoints), 0, sizeof(bookstore_checkpoint_stats_t));
     return ret;
 }
 
-void serialize_book(const book_t* book, buffer_t* buf) {
+// isbn and title are stored in the file's string heap, author and genre in
+// its dictionary, the record only refers to them
+void serialize_book(const book_t* book, buffer_t* buf, uint64_t* heap_offset,
+        const uint32_t* dict_ids) {
+    book_record_t rec;
+    rec.isbn = *heap_offset;
+    *heap_offset += strlen(book->isbn) + 1;
+    rec.title = *heap_offset;
+    *heap_offset += strlen(book->title) + 1;
+    rec.author = dict_ids[book->author_id];
+    rec.genre = dict_ids[book->genre_id];
+    rec.stocked_qty = book->stocked_qty;
+    rec.sold_qty = book->sold_qty;
+    rec.price = book->price;
+    buf_write(buf, &rec, sizeof(book_record_t));
+}
+
+void serialize_book_strings(const book_t* book, buffer_t* buf) {
     buf_write(buf, book->isbn, strlen(book->isbn) + 1);
     buf_write(buf, book->title, strlen(book->title) + 1);
-    buf_write(buf, book->author, strlen(book->author) + 1);
-    buf_write(buf, book->genre, strlen(book->genre) + 1);
-    buf_write(buf, &(book->stocked_qty), sizeof(unsigned int));
-    buf_write(buf, &(book->sold_qty), sizeof(unsigned int));
-    buf_write(buf, &(book->price), sizeof(double));
 }
 
-book_t* unserialize_book(buffer_t* buf) {
-    book_t* ret = malloc(sizeof(book_t));
-    if (ret == NULL) exit(errno);
-    ret->isbn = buf_readstr(buf);
-    ret->title = buf_readstr(buf);
-    ret->author = buf_readstr(buf);
-    ret->genre = buf_readstr(buf);
+// the heap is known to end with a null byte, so any string
+// starting inside of it is properly terminated
+static bool book_record_valid(const book_record_t* rec, const bookstore_image_t* img) {
+    return rec->isbn < img->heap_size && rec->title < img->heap_size
+        && rec->author < img->num_strings && rec->genre < img->num_strings;
+}
+
+// fills in the fields of a book from its record, except for its own strings
+static void book_from_record(book_t* book, const book_record_t* rec, bookstore_t* store,
+        const bookstore_image_t* img) {
+    book_intern(store, book, img->string_ids[rec->author], img->string_ids[rec->genre]);
+    book->stocked_qty = rec->stocked_qty;
+    book->sold_qty = rec->sold_qty;
+    book->price = rec->price;
+}
+
+book_t* unserialize_book(buffer_t* buf, bookstore_t* store, const bookstore_image_t* img) {
+    book_record_t rec;
+    buf_readbytes(buf, &rec, sizeof(book_record_t));
+    if (!book_record_valid(&rec, img))
+        return (book_t*) NULL;
+
+    book_t* ret;
+    if (img->borrow) {
+        ret = arena_alloc(store->arena, sizeof(book_t));
+        ret->arena = store->arena;
+        ret->alloc_size = sizeof(book_t);
+        ret->store = NULL;
+        ret->retired = false;
+        ret->dirty_pos = BOOK_CLEAN;
+        ret->isbn = img->heap + rec.isbn;
+        ret->title = img->heap + rec.title;
+    } else {
+        ret = book_alloc(store->arena, img->heap + rec.isbn, img->heap + rec.title, NULL, NULL);
+    }
+    book_from_record(ret, &rec, store, img);
+    return ret;
+}
+
+// reads a book in the original, header-less format
+static book_t* unserialize_book_legacy(buffer_t* buf, bookstore_t* store) {
+    const char* isbn = buf_skipstr(buf);
+    const char* title = buf_skipstr(buf);
+    const char* author = buf_skipstr(buf);
+    const char* genre = buf_skipstr(buf);
+    book_t* ret = book_alloc(store->arena, isbn, title, NULL, NULL);
+    book_intern(store, ret, intern_str(store->strings, author), intern_str(store->strings, genre));
     buf_readbytes(buf, &(ret->stocked_qty), sizeof(unsigned int));
     buf_readbytes(buf, &(ret->sold_qty), sizeof(unsigned int));
     buf_readbytes(buf, &(ret->price), sizeof(double));
     return ret;
 }
 
+// during a bulk load only the ISBN index (needed to reject duplicates) is
+// kept up to date, the rest is built once it is over
+static void bookstore_index_book(bookstore_t* store, book_t* book) {
+    isbn_index_insert(store->isbn_index, book);
+    if (store->bulk)
+        return;
+    posting_index_insert(store->author_index, book);
+    posting_index_insert(store->genre_index, book);
+    trigram_index_insert(store->title_index, book);
+    skiplist_insert(store->price_index, book);
+    skiplist_insert(store->stock_index, book);
+}
+
+static void bookstore_unindex_book(bookstore_t* store, const book_t* book) {
+    isbn_index_remove(store->isbn_index, book);
+    posting_index_remove(store->author_index, book);
+    posting_index_remove(store->genre_index, book);
+    trigram_index_remove(store->title_index, book);
+    skiplist_remove(store->price_index, book);
+    skiplist_remove(store->stock_index, book);
+}
+
+static book_handle_t book_handle(const uint32_t generation, const unsigned int slot) {
+    return (book_handle_t) generation << 32 | slot;
+}
+
+// takes a free slot for the book in a row (there is always one, as there
+// are at least as many slots as rows), reusing the last one freed first
+static book_handle_t bookstore_take_slot(bookstore_t* store, const unsigned int row) {
+    unsigned int slot = store->free_slot;
+    if (slot != BOOKSTORE_NO_SLOT) {
+        store->free_slot = store->slots[slot].row;
+    } else {
+        slot = store->num_slots++;
+        store->slots[slot].generation = 1;
+    }
+    store->slots[slot].row = row;
+    return book_handle(store->slots[slot].generation, slot);
+}
+
+// frees the slot of a book, making its handle refer to no book
+static void bookstore_release_slot(bookstore_t* store, const book_handle_t handle) {
+    bookstore_slot_t* slot = &(store->slots[(uint32_t) handle]);
+    // never wrapping around to 0, which no handle has
+    slot->generation = (slot->generation == UINT32_MAX) ? 1 : slot->generation + 1;
+    slot->row = store->free_slot;
+    store->free_slot = (uint32_t) handle;
+}
+
+// puts a book into the next row of the bookstore, which has to have room for it
+static void bookstore_append_book(bookstore_t* store, book_t* book) {
+    book->store = store;
+    book->row = store->num_books;
+    book->handle = bookstore_take_slot(store, book->row);
+    book->seq = store->next_seq++;
+    book->epoch = store->epoch;
+    store->books[book->row] = book;
+    store->columns.stocked_qty[book->row] = book->stocked_qty;
+    store->columns.sold_qty[book->row] = book->sold_qty;
+    store->columns.price[book->row] = book->price;
+    store->num_books++;
+    totals_add(&(store->totals), book);
+    bookstore_index_book(store, book);
+}
+
+// the journal to log every change to a bookstore into as it is made, if any
+static journal_t* bookstore_log(const bookstore_t* store) {
+    if (store == NULL || store->journal == NULL || store->journal->deferred)
+        return (journal_t*) NULL;
+    return store->journal;
+}
+
+// whether the books changed in a bookstore are kept track of
+static bool bookstore_tracks_changes(const bookstore_t* store) {
+    return store->journal != NULL && store->journal->deferred;
+}
+
+static void bookstore_count_change(bookstore_t* store) {
+    if (store->dirty_since == 0)
+        store->dirty_since = metrics_now();
+    store->num_changes++;
+}
+
+// remembers a book as changed since the last checkpoint
+static void bookstore_mark_dirty(bookstore_t* store, book_t* book) {
+    if (!bookstore_tracks_changes(store))
+        return;
+    bookstore_count_change(store);
+    if (book->dirty_pos != BOOK_CLEAN)
+        return;
+    if (store->num_dirty == store->dirty_capacity) {
+        store->dirty_capacity = store->dirty_capacity ? store->dirty_capacity * 2 : 64;
+        store->dirty = realloc(store->dirty, store->dirty_capacity * sizeof(book_t*));
+        if (store->dirty == NULL) exit(errno);
+    }
+    book->dirty_pos = store->num_dirty;
+    store->dirty[store->num_dirty++] = book;
+}
+
+// remembers a book as removed since the last checkpoint, unless it was
+// added after it, so that the journal never heard of it
+static void bookstore_mark_removed(bookstore_t* store, book_t* book) {
+    if (!bookstore_tracks_changes(store))
+        return;
+    bookstore_count_change(store);
+    if (book->dirty_pos != BOOK_CLEAN) {
+        book_t* last = store->dirty[--store->num_dirty];
+        store->dirty[book->dirty_pos] = last;
+        last->dirty_pos = book->dirty_pos;
+        book->dirty_pos = BOOK_CLEAN;
+    }
+    if (book->seq >= store->checkpoint_seq)
+        return;
+    buf_write(store->removed, book->isbn, strlen(book->isbn) + 1);
+    store->num_removed++;
+}
+
+// forgets about the changes made before a checkpoint
+static void bookstore_clear_dirty(bookstore_t* store) {
+    for (unsigned int i=0; i<store->num_dirty; i++)
+        store->dirty[i]->dirty_pos = BOOK_CLEAN;
+    store->num_dirty = 0;
+    if (store->removed != NULL)
+        store->removed->pivot = store->removed->size = 0;
+    store->num_removed = 0;
+    store->num_changes = 0;
+    store->dirty_since = 0;
+    store->checkpoint_seq = store->next_seq;
+}
+
+// builds the dictionary of a file, which only holds the strings still in
+// use, numbered in the order they are first used: dict_ids maps intern ids
+// to dictionary ids and dict holds the strings, returns its size; it only
+// goes through the books, as the intern table may be changing while a
+// snapshot gets saved
+static unsigned int bookstore_dictionary(const bookstore_t* store, uint32_t** dict_ids,
+        const char*** dict) {
+    unsigned int max_id = 0;
+    for (unsigned int i=0; i<store->num_books; i++) {
+        const book_t* book = store->books[i];
+        if (book->author_id > max_id)
+            max_id = book->author_id;
+        if (book->genre_id > max_id)
+            max_id = book->genre_id;
+    }
+    *dict_ids = malloc(((size_t) max_id + 1) * sizeof(uint32_t));
+    *dict = malloc(((size_t) max_id + 1) * sizeof(const char*));
+    if (*dict_ids == NULL || *dict == NULL) exit(errno);
+    memset(*dict_ids, 0xff, ((size_t) max_id + 1) * sizeof(uint32_t));
+    unsigned int ret = 0;
+    for (unsigned int i=0; i<store->num_books; i++) {
+        const book_t* book = store->books[i];
+        if ((*dict_ids)[book->author_id] == UINT32_MAX) {
+            (*dict_ids)[book->author_id] = ret;
+            (*dict)[ret++] = book->author;
+        }
+        if ((*dict_ids)[book->genre_id] == UINT32_MAX) {
+            (*dict_ids)[book->genre_id] = ret;
+            (*dict)[ret++] = book->genre;
+        }
+    }
+    return ret;
+}
+
 void serialize_bookstore(const bookstore_t* store, buffer_t* buf) {
-    buf_write(buf, &(store->num_books), sizeof(unsigned int));
+    uint32_t* dict_ids;
+    const char** dict;
+    unsigned int num_strings = bookstore_dictionary(store, &dict_ids, &dict);
+
+    buf_reserve(buf, buf->pivot + sizeof(bookstore_header_t)
+            + (size_t) store->num_books * BOOK_SERIALIZED_SIZE_HINT);
+
+    bookstore_header_t hdr;
+    memset(&hdr, 0, sizeof(bookstore_header_t));
+    memcpy(hdr.magic, BOOKSTORE_MAGIC, sizeof(hdr.magic));
+    hdr.version = BOOKSTORE_VERSION;
+    hdr.num_books = store->num_books;
+    hdr.num_strings = num_strings;
+    hdr.generation = store->generation;
+    hdr.dict_offset = sizeof(bookstore_header_t);
+    hdr.records_offset = hdr.dict_offset + (uint64_t) num_strings * sizeof(uint64_t);
+    hdr.heap_offset = hdr.records_offset + (uint64_t) store->num_books * sizeof(book_record_t);
+    buf_write(buf, &hdr, sizeof(bookstore_header_t));
+
+    // the dictionary strings come first in the heap, then the books' own
+    uint64_t heap_offset = 0;
+    for (unsigned int i=0; i<num_strings; i++) {
+        buf_write(buf, &heap_offset, sizeof(uint64_t));
+        heap_offset += strlen(dict[i]) + 1;
+    }
+    for (unsigned int i=0; i<store->num_books; i++)
+        serialize_book(store->books[i], buf, &heap_offset, dict_ids);
+    for (unsigned int i=0; i<num_strings; i++)
+        buf_write(buf, dict[i], strlen(dict[i]) + 1);
     for (unsigned int i=0; i<store->num_books; i++)
-        serialize_book(store->books[i], buf);
+        serialize_book_strings(store->books[i], buf);
+    metrics_count(METRICS_BYTES_SERIALIZED, hdr.heap_offset + heap_offset);
+
+    free(dict);
+    free(dict_ids);
+}
+
+// the header of a compressed file, which stays uncompressed so that its
+// generation can be read as easily as that of any other file
+static void bookstore_compressed_header(const bookstore_t* store, bookstore_header_t* hdr) {
+    memset(hdr, 0, sizeof(bookstore_header_t));
+    memcpy(hdr->magic, BOOKSTORE_MAGIC, sizeof(hdr->magic));
+    hdr->version = BOOKSTORE_VERSION;
+    hdr->flags = BOOKSTORE_FLAG_COMPRESSED;
+    hdr->num_books = store->num_books;
+    hdr->generation = store->generation;
+}
+
+void serialize_bookstore_compressed(const bookstore_t* store, buffer_t* buf) {
+    uint32_t* dict_ids;
+    const char** dict;
+    unsigned int num_strings = bookstore_dictionary(store, &dict_ids, &dict);
+
+    buf_write_varint(buf, num_strings);
+    for (unsigned int i=0; i<num_strings; i++)
+        buf_write(buf, dict[i], strlen(dict[i]) + 1);
+    for (unsigned int i=0; i<store->num_books; i++) {
+        const book_t* book = store->books[i];
+        serialize_book_strings(book, buf);
+        buf_write_varint(buf, dict_ids[book->author_id]);
+        buf_write_varint(buf, dict_ids[book->genre_id]);
+        buf_write_varint(buf, book->stocked_qty);
+        buf_write_varint(buf, book->sold_qty);
+        buf_write(buf, &(book->price), sizeof(double));
+    }
+
+    free(dict);
+    free(dict_ids);
+}
+
+// reads a string out of decompressed data, which is known to end with a
+// null byte past its size
+static const char* unpack_str(buffer_t* buf) {
+    if (buf->pivot >= buf->size)
+        return (const char*) NULL;
+    const char* ret = buf_skipstr(buf);
+    return (buf->pivot <= buf->size) ? ret : (const char*) NULL;
+}
+
+static bool unpack_uint(buffer_t* buf, unsigned int* value) {
+    uint64_t ret;
+    if (!buf_read_varint(buf, &ret) || ret > UINT32_MAX)
+        return false;
+    *value = (unsigned int) ret;
+    return true;
+}
+
+// decompresses all the blocks following the header of a compressed file
+static bool unpack_blocks(const char* bytes, const size_t size, buffer_t* raw) {
+    // freed by the caller even when the blocks are rejected before it is allocated
+    raw->bytes = NULL;
+    size_t raw_size = 0;
+    size_t pos = sizeof(bookstore_header_t);
+    while (pos < size) {
+        uint32_t sizes[2];
+        if (size - pos < sizeof(sizes))
+            return false;
+        memcpy(sizes, bytes + pos, sizeof(sizes));
+        // no block holds more than one chunk of the buffer it was written
+        // through, so a larger one cannot be genuine
+        if (sizes[0] > BOOKSTORE_BLOCK_SIZE || sizes[1] > sizes[0]
+                || sizes[1] > size - pos - sizeof(sizes))
+            return false;
+        raw_size += sizes[0];
+        pos += sizeof(sizes) + sizes[1];
+    }
+
+    raw->pivot = 0;
+    raw->size = raw->capacity = raw_size;
+    raw->bytes = malloc(raw_size + 1);
+    raw->sink = NULL;
+    if (raw->bytes == NULL) exit(errno);
+    ((char*) raw->bytes)[raw_size] = '\0';
+
+    char* out = raw->bytes;
+    for (pos = sizeof(bookstore_header_t); pos < size; ) {
+        uint32_t sizes[2];
+        memcpy(sizes, bytes + pos, sizeof(sizes));
+        pos += sizeof(sizes);
+        if (sizes[1] == sizes[0])
+            memcpy(out, bytes + pos, sizes[0]);
+        else if (!lz_decompress(bytes + pos, sizes[1], out, sizes[0]))
+            return false;
+        out += sizes[0];
+        pos += sizes[1];
+    }
+    return true;
+}
+
+// builds a bookstore from the contents of a compressed file; unlike with
+// uncompressed ones, the books get their own copies of all the strings
+static bookstore_t* bookstore_from_compressed(const char* bytes, const size_t size) {
+    bookstore_header_t hdr;
+    if (size < sizeof(bookstore_header_t))
+        return (bookstore_t*) NULL;
+    memcpy(&hdr, bytes, sizeof(bookstore_header_t));
+    if (memcmp(hdr.magic, BOOKSTORE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != BOOKSTORE_VERSION || hdr.flags != BOOKSTORE_FLAG_COMPRESSED)
+        return (bookstore_t*) NULL;
+
+    buffer_t raw;
+    if (!unpack_blocks(bytes, size, &raw)) {
+        printf("Corrupted compressed block!\n");
+        free(raw.bytes);
+        return (bookstore_t*) NULL;
+    }
+
+    bookstore_t* ret = bookstore_init();
+    ret->generation = hdr.generation;
+    ret->compressed = true;
+    unsigned int num_strings = 0;
+    unsigned int* string_ids = NULL;
+    bool ok = unpack_uint(&raw, &num_strings) && num_strings <= raw.size;
+    if (ok) {
+        string_ids = malloc(((size_t) num_strings + 1) * sizeof(unsigned int));
+        if (string_ids == NULL) exit(errno);
+    }
+    for (unsigned int i=0; ok && i<num_strings; i++) {
+        const char* str = unpack_str(&raw);
+        ok = str != NULL;
+        if (ok)
+            string_ids[i] = intern_str(ret->strings, str);
+    }
+
+    // the count comes from the file too, so it is checked against the data
+    // left before anything gets reserved for it
+    if (ok && hdr.num_books > (raw.size - raw.pivot) / BOOK_COMPRESSED_MIN_SIZE) {
+        printf("Compressed file claims more books than it holds!\n");
+        ok = false;
+    }
+    if (ok)
+        bookstore_begin_bulk(ret, hdr.num_books);
+    for (unsigned int i=0; ok && i<hdr.num_books; i++) {
+        const char* isbn = unpack_str(&raw);
+        const char* title = unpack_str(&raw);
+        unsigned int author, genre, stocked_qty, sold_qty;
+        ok = isbn != NULL && title != NULL && unpack_uint(&raw, &author) && author < num_strings
+            && unpack_uint(&raw, &genre) && genre < num_strings
+            && unpack_uint(&raw, &stocked_qty) && unpack_uint(&raw, &sold_qty)
+            && raw.size - raw.pivot >= sizeof(double);
+        if (!ok) {
+            printf("Corrupted record of book #%u!\n", i);
+            break;
+        }
+        book_t* book = book_alloc(ret->arena, isbn, title, NULL, NULL);
+        book_intern(ret, book, string_ids[author], string_ids[genre]);
+        book->stocked_qty = stocked_qty;
+        book->sold_qty = sold_qty;
+        buf_readbytes(&raw, &(book->price), sizeof(double));
+        bookstore_append_book(ret, book);
+    }
+    bookstore_end_bulk(ret);
+
+    free(string_ids);
+    free(raw.bytes);
+    if (!ok) {
+        bookstore_free(ret);
+        return (bookstore_t*) NULL;
+    }
+    return ret;
+}
+
+// decodes a slice of the record table straight into the rows of the bookstore
+static void* bookstore_load_slice(void* arg) {
+    bookstore_load_slice_t* slice = arg;
+    bookstore_t* store = slice->store;
+    memset(&(slice->totals), 0, sizeof(bookstore_totals_t));
+    slice->ok = true;
+
+    for (unsigned int i=slice->first; i<slice->last; i++) {
+        book_record_t rec;
+        memcpy(&rec, slice->records + (size_t) i * sizeof(book_record_t), sizeof(book_record_t));
+        if (!book_record_valid(&rec, slice->img)) {
+            slice->ok = false;
+            slice->bad_record = i;
+            return NULL;
+        }
+
+        book_t* book = &(slice->books[i]);
+        book->arena = store->arena;
+        book->alloc_size = sizeof(book_t);
+        book->isbn = slice->img->heap + rec.isbn;
+        book->title = slice->img->heap + rec.title;
+        book_from_record(book, &rec, store, slice->img);
+        book->store = store;
+        book->row = i;
+        book->handle = book_handle(1, i); // and so are its slots
+        store->slots[i].generation = 1;
+        store->slots[i].row = i;
+        book->seq = i; // the bookstore is a new one
+        book->epoch = store->epoch;
+        book->retired = false;
+        book->dirty_pos = BOOK_CLEAN;
+        store->books[i] = book;
+        store->columns.stocked_qty[i] = book->stocked_qty;
+        store->columns.sold_qty[i] = book->sold_qty;
+        store->columns.price[i] = book->price;
+        totals_add(&(slice->totals), book);
+        slice->hashes[i] = str_hash(book->isbn);
+    }
+    return NULL;
+}
+
+// decodes all the records of a mapped image, splitting the work among as
+// many threads as there are processors; as the records have a fixed width,
+// every thread can start right at its own slice of them
+static bool bookstore_load_records(bookstore_t* store, const bookstore_image_t* img,
+        const char* records, const unsigned int num_books) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int num_threads = num_books / BOOKSTORE_LOAD_MIN_SLICE;
+    if (num_cpus > 0 && num_threads > (unsigned long) num_cpus)
+        num_threads = (unsigned int) num_cpus;
+    if (num_threads > BOOKSTORE_LOAD_MAX_THREADS)
+        num_threads = BOOKSTORE_LOAD_MAX_THREADS;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    // all the books share one block, which still gets recycled book by
+    // book as they are removed
+    book_t* books = arena_alloc(store->arena, (size_t) num_books * sizeof(book_t));
+    size_t* hashes = malloc(((size_t) num_books + 1) * sizeof(size_t));
+    bookstore_load_slice_t* slices = malloc(num_threads * sizeof(bookstore_load_slice_t));
+    if (hashes == NULL || slices == NULL) exit(errno);
+
+    for (unsigned int t=0; t<num_threads; t++) {
+        slices[t].store = store;
+        slices[t].img = img;
+        slices[t].records = records;
+        slices[t].books = books;
+        slices[t].hashes = hashes;
+        slices[t].first = (unsigned int) ((uint64_t) num_books * t / num_threads);
+        slices[t].last = (unsigned int) ((uint64_t) num_books * (t + 1) / num_threads);
+    }
+    // the calling thread takes the first slice itself
+    for (unsigned int t=1; t<num_threads; t++) {
+        if (pthread_create(&(slices[t].thread), NULL, bookstore_load_slice, &slices[t]) != 0)
+            exit(errno);
+    }
+    bookstore_load_slice(&slices[0]);
+    for (unsigned int t=1; t<num_threads; t++)
+        pthread_join(slices[t].thread, NULL);
+
+    bool ret = true;
+    for (unsigned int t=0; t<num_threads; t++) {
+        if (!slices[t].ok) {
+            printf("Corrupted record of book #%u!\n", slices[t].bad_record);
+            ret = false;
+            break;
+        }
+        store->totals.units_sold += slices[t].totals.units_sold;
+        store->totals.revenue += slices[t].totals.revenue;
+        store->totals.units_in_stock += slices[t].totals.units_in_stock;
+        store->totals.stock_value += slices[t].totals.stock_value;
+    }
+
+    // the hash table is filled in by a single thread, but with the hashes
+    // already computed
+    if (ret) {
+        store->num_books = num_books;
+        store->num_slots = num_books;
+        store->next_seq = num_books;
+        for (unsigned int i=0; i<num_books; i++)
+            isbn_index_insert_hashed(store->isbn_index, store->books[i], hashes[i]);
+    }
+
+    free(slices);
+    free(hashes);
+    return ret;
+}
+
+// builds a bookstore from a serialized image of it, either copying the
+// strings or (if borrow is set) pointing the books straight into the image
+static bookstore_t* bookstore_from_image(char* bytes, const size_t size, const bool borrow) {
+    bookstore_header_t hdr;
+    if (size < sizeof(bookstore_header_t))
+        return (bookstore_t*) NULL;
+    memcpy(&hdr, bytes, sizeof(bookstore_header_t));
+
+    if (memcmp(hdr.magic, BOOKSTORE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != BOOKSTORE_VERSION || hdr.flags != 0
+            || hdr.dict_offset < sizeof(bookstore_header_t)
+            || hdr.records_offset < hdr.dict_offset
+            || hdr.heap_offset < hdr.records_offset
+            || hdr.heap_offset > size
+            || (hdr.records_offset - hdr.dict_offset) / sizeof(uint64_t) < hdr.num_strings
+            || (hdr.heap_offset - hdr.records_offset) / sizeof(book_record_t) < hdr.num_books)
+        return (bookstore_t*) NULL;
+
+    bookstore_image_t img;
+    img.heap = bytes + hdr.heap_offset;
+    img.heap_size = size - (size_t) hdr.heap_offset;
+    img.num_strings = hdr.num_strings;
+    img.borrow = borrow;
+    if (img.heap_size > 0 && bytes[size - 1] != '\0')
+        return (bookstore_t*) NULL;
+
+    bookstore_t* ret = bookstore_init();
+    ret->generation = hdr.generation;
+    img.string_ids = malloc((hdr.num_strings + 1) * sizeof(unsigned int));
+    if (img.string_ids == NULL) exit(errno);
+    for (unsigned int i=0; i<hdr.num_strings; i++) {
+        uint64_t offset;
+        memcpy(&offset, bytes + hdr.dict_offset + i * sizeof(uint64_t), sizeof(uint64_t));
+        if (offset >= img.heap_size) {
+            printf("Corrupted dictionary string #%u!\n", i);
+            free(img.string_ids);
+            bookstore_free(ret);
+            return (bookstore_t*) NULL;
+        }
+        img.string_ids[i] = borrow ? intern_borrow(ret->strings, img.heap + offset)
+            : intern_str(ret->strings, img.heap + offset);
+    }
+
+    // a read-only view of the record table, nothing gets copied
+    buffer_t records;
+    records.pivot = 0;
+    records.size = records.capacity = (size_t) (hdr.heap_offset - hdr.records_offset);
+    records.bytes = bytes + hdr.records_offset;
+    records.sink = NULL;
+
+    bookstore_begin_bulk(ret, hdr.num_books);
+    if (borrow && hdr.num_books > 0) {
+        if (!bookstore_load_records(ret, &img, records.bytes, hdr.num_books)) {
+            free(img.string_ids);
+            bookstore_free(ret);
+            return (bookstore_t*) NULL;
+        }
+    }
+    for (unsigned int i=0; !borrow && i<hdr.num_books; i++) {
+        book_t* book = unserialize_book(&records, ret, &img);
+        if (book == NULL) {
+            printf("Corrupted record of book #%u!\n", i);
+            free(img.string_ids);
+            bookstore_free(ret);
+            return (bookstore_t*) NULL;
+        }
+        bookstore_append_book(ret, book);
+    }
+    bookstore_end_bulk(ret);
+
+    free(img.string_ids);
+    return ret;
 }
 
 bookstore_t* unserialize_bookstore(buffer_t* buf) {
+    bookstore_t* ret = bookstore_from_image((char*) buf->bytes + buf->pivot,
+            buf->size - buf->pivot, false);
+    if (ret != NULL)
+        buf->pivot = buf->size;
+    return ret;
+}
+
+// checks that a whole legacy book record is left in the buffer
+static bool legacy_book_fits(const buffer_t* buf) {
+    size_t pivot = buf->pivot;
+    for (unsigned int i=0; i<4; i++) {
+        const char* nul = memchr((char*) buf->bytes + pivot, '\0', buf->size - pivot);
+        if (nul == NULL)
+            return false;
+        pivot = (size_t) (nul - (char*) buf->bytes) + 1;
+    }
+    return buf->size - pivot >= 2 * sizeof(unsigned int) + sizeof(double);
+}
+
+// reads a bookstore in the original, header-less format
+static bookstore_t* unserialize_bookstore_legacy(buffer_t* buf) {
     bookstore_t* ret = bookstore_init();
-    buf_readbytes(buf, &(ret->num_books), sizeof(unsigned int));
-    ret->books = malloc(ret->num_books * sizeof(book_t*));
-    if (ret->books == NULL) exit(errno);
-    for (unsigned int i=0; i<ret->num_books; i++)
-        ret->books[i] = unserialize_book(buf);
+    unsigned int num_books;
+    buf_readbytes(buf, &num_books, sizeof(unsigned int));
+    // every legacy record holds at least four empty strings and the numbers
+    if (num_books > (buf->size - buf->pivot) / (4 + 2 * sizeof(unsigned int) + sizeof(double))) {
+        bookstore_free(ret);
+        return (bookstore_t*) NULL;
+    }
+    bookstore_begin_bulk(ret, num_books);
+    for (unsigned int i=0; i<num_books; i++) {
+        if (!legacy_book_fits(buf)) {
+            bookstore_free(ret);
+            return (bookstore_t*) NULL;
+        }
+        book_t* book = unserialize_book_legacy(buf, ret);
+        bookstore_append_book(ret, book);
+    }
+    bookstore_end_bulk(ret);
     return ret;
 }
 
-void bookstore_save(const bookstore_t* store, const char* filename) {
-    buffer_t* buf = buf_init();
-    serialize_bookstore(store, buf);
+// writes bookstore into a new file and renames it over the given one,
+// returns false (leaving the file as it was) if that fails
+static bool bookstore_write_file(const bookstore_t* store, const char* filename) {
+    // the current file may still be mapped by a loaded bookstore, so never
+    // truncate it: write a new file and atomically rename it over the old one
+    char* tmpname = malloc(strlen(filename) + sizeof(".tmp"));
+    if (tmpname == NULL) exit(errno);
+    strcpy(tmpname, filename);
+    strcat(tmpname, ".tmp");
+
+    FILE* fd = fopen(tmpname, "wb");
+    if (fd == NULL) {
+        free(tmpname);
+        return false;
+    }
+
+    // the file is written chunk by chunk as it gets serialized, rather than
+    // serializing all of it into memory first
+    buffer_t* buf;
+    if (store->compressed) {
+        bookstore_header_t hdr;
+        bookstore_compressed_header(store, &hdr);
+        buf = buf_init_compressed_sink(fd, BOOKSTORE_BLOCK_SIZE);
+        buf->sink_failed = fwrite(&hdr, sizeof(bookstore_header_t), 1, fd) != 1;
+        serialize_bookstore_compressed(store, buf);
+    } else {
+        buf = buf_init_sink(fd, BOOKSTORE_SAVE_CHUNK_SIZE);
+        serialize_bookstore(store, buf);
+    }
 
-    FILE* fd = fopen(filename, "wb");
-    if (fd == NULL) exit(errno);
+    bool ret = buf_flush(buf) && fflush(fd) == 0;
+    if (ret && store->compressed)
+        metrics_count(METRICS_BYTES_SERIALIZED, (uint64_t) ftell(fd));
+    ret = ret && fsync(fileno(fd)) == 0;
+    ret = fclose(fd) == 0 && ret && rename(tmpname, filename) == 0;
+    if (!ret)
+        unlink(tmpname);
+    free(tmpname);
+    buf_free(buf);
+    return ret;
+}
 
-    if (fwrite(buf->bytes, 1, buf->size, fd) != buf->size) {
+// removes the journal of a snapshot file, which a new snapshot supersedes
+// (as it has a new generation, a leftover journal would not be replayed anyway)
+static void bookstore_drop_journal(const char* filename) {
+    char* journal = journal_path(filename);
+    unlink(journal);
+    free(journal);
+}
+
+void bookstore_save(bookstore_t* store, const char* filename) {
+    // a checkpoint may still be writing into the journal
+    bookstore_wait_save(store);
+    store->generation++;
+    if (!bookstore_write_file(store, filename)) {
         printf("Error saving bookstore!\n");
-        fclose(fd);
-        buf_free(buf);
         exit(1);
     }
 
-    fclose(fd);
-    buf_free(buf);
+    // the new snapshot has everything the file's journal had
+    if (store->journal != NULL && strcmp(store->journal->snapshot, filename) == 0) {
+        if (!journal_reset(store->journal, store->generation))
+            exit(1);
+        bookstore_clear_dirty(store);
+    } else {
+        bookstore_drop_journal(filename);
+    }
+}
+
+static void* bookstore_save_job_run(void* arg) {
+    bookstore_save_job_t* job = arg;
+    uint64_t start = metrics_now();
+    if (job->records != NULL) {
+        job->ok = journal_append(job->journal, job->records);
+        job->records = NULL;
+    } else {
+        job->ok = bookstore_write_file(&(job->snap->view), job->filename);
+        if (!job->ok)
+            printf("Error saving bookstore!\n");
+        else if (job->journal != NULL)
+            job->ok = journal_reset(job->journal, job->generation);
+        else
+            bookstore_drop_journal(job->filename);
+        bookstore_snapshot_release(job->snap);
+        job->snap = NULL;
+    }
+    // the changes it was to save are only in the bookstore now, so the
+    // next checkpoint has to write a new snapshot with all of them
+    if (!job->ok && job->journal != NULL)
+        job->journal->stale = true;
+    job->finished = metrics_now();
+    job->duration = job->finished - start;
+    atomic_store(&(job->done), true);
+    return NULL;
+}
+
+static bookstore_save_job_t* bookstore_save_job_init(const char* filename) {
+    bookstore_save_job_t* ret = malloc(sizeof(bookstore_save_job_t));
+    if (ret == NULL) exit(errno);
+    ret->snap = NULL;
+    ret->filename = NULL;
+    if (filename != NULL) {
+        ret->filename = malloc(strlen(filename) + 1);
+        if (ret->filename == NULL) exit(errno);
+        strcpy(ret->filename, filename);
+    }
+    ret->records = NULL;
+    ret->journal = NULL;
+    ret->generation = 0;
+    ret->checkpoint = false;
+    ret->num_books = 0;
+    ret->oldest_change = 0;
+    ret->duration = 0;
+    ret->finished = 0;
+    ret->ok = false;
+    atomic_init(&(ret->done), false);
+    return ret;
+}
+
+static void bookstore_save_job_start(bookstore_t* store, bookstore_save_job_t* job) {
+    if (pthread_create(&(job->thread), NULL, bookstore_save_job_run, job) != 0)
+        exit(errno);
+    store->save_job = job;
+}
+
+void bookstore_save_background(bookstore_t* store, const char* filename) {
+    // the journal has to be reset along with the snapshot it is on top of
+    if (store->journal != NULL && strcmp(store->journal->snapshot, filename) == 0) {
+        bookstore_save(store, filename);
+        return;
+    }
+
+    bookstore_wait_save(store);
+    store->generation++;
+    bookstore_save_job_t* job = bookstore_save_job_init(filename);
+    job->snap = bookstore_snapshot(store);
+    bookstore_save_job_start(store, job);
+}
+
+bool bookstore_wait_save(bookstore_t* store) {
+    bookstore_save_job_t* job = store->save_job;
+    if (job == NULL)
+        return true;
+    pthread_join(job->thread, NULL);
+    bool ret = job->ok;
+    if (job->checkpoint) {
+        bookstore_checkpoint_stats_t* stats = &(store->checkpoints);
+        if (ret) {
+            stats->count++;
+            stats->last_duration = job->duration;
+            stats->last_lag = job->finished - job->oldest_change;
+            stats->last_books = job->num_books;
+        } else {
+            // the books it was to save count as changed until the next
+            // checkpoint saves them, along with all the other books
+            stats->failed++;
+            store->num_changes += job->num_books > 0 ? job->num_books : 1;
+            if (store->dirty_since == 0 || store->dirty_since > job->oldest_change)
+                store->dirty_since = job->oldest_change;
+        }
+    }
+    free(job->filename);
+    free(job);
+    store->save_job = NULL;
+    bookstore_reclaim(store);
+    return ret;
+}
+
+bool bookstore_save_running(const bookstore_t* store) {
+    return store->save_job != NULL && !atomic_load(&(store->save_job->done));
+}
+
+void bookstore_track_changes(bookstore_t* store) {
+    if (store->journal == NULL || store->journal->deferred)
+        return;
+    bookstore_wait_save(store);
+    journal_commit(store->journal);
+    store->journal->deferred = true;
+    if (store->removed == NULL)
+        store->removed = buf_init();
+    bookstore_clear_dirty(store);
+}
+
+bool bookstore_checkpoint(bookstore_t* store) {
+    bookstore_wait_save(store);
+    journal_t* journal = store->journal;
+    if (!bookstore_tracks_changes(store) || (store->num_changes == 0 && !journal->stale))
+        return false;
+
+    bookstore_save_job_t* job;
+    if (journal_needs_compaction(journal)) {
+        // the new snapshot has all the changes made so far
+        job = bookstore_save_job_init(journal->snapshot);
+        job->num_books = store->num_books;
+        job->generation = ++store->generation;
+        job->snap = bookstore_snapshot(store);
+    } else {
+        // removals come first, the ISBNs may have been taken by new books since
+        job = bookstore_save_job_init(NULL);
+        for (size_t pos=0; pos<store->removed->pivot; pos += strlen((char*) store->removed->bytes + pos) + 1)
+            journal_log_remove(journal, (char*) store->removed->bytes + pos);
+        for (unsigned int i=0; i<store->num_dirty; i++) {
+            const book_t* book = store->dirty[i];
+            journal_log_book(journal, book->isbn, book->title, book->author, book->genre,
+                    book->stocked_qty, book->sold_qty, book->price);
+        }
+        job->num_books = store->num_dirty + store->num_removed;
+        job->records = journal_detach(journal);
+    }
+    job->journal = journal;
+    job->checkpoint = true;
+    job->oldest_change = (store->dirty_since != 0) ? store->dirty_since : metrics_now();
+    bookstore_clear_dirty(store);
+    bookstore_save_job_start(store, job);
+    return true;
 }
 
 bookstore_t* bookstore_load(const char* filename) {
-    FILE* fd = fopen(filename, "rb");
-    if (fd == NULL) exit(errno);
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return (bookstore_t*) NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(unsigned int)) {
+        close(fd);
+        return (bookstore_t*) NULL;
+    }
+    size_t size = (size_t) st.st_size;
+
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return (bookstore_t*) NULL;
+
+    bookstore_t* ret;
+    bookstore_header_t hdr;
+    if (size >= sizeof(bookstore_header_t)) {
+        memcpy(&hdr, map, sizeof(bookstore_header_t));
+    } else {
+        hdr.flags = 0;
+    }
+    if (size >= sizeof(BOOKSTORE_MAGIC) - 1
+            && memcmp(map, BOOKSTORE_MAGIC, sizeof(BOOKSTORE_MAGIC) - 1) == 0
+            && hdr.flags == BOOKSTORE_FLAG_COMPRESSED) {
+        // all of it gets decompressed (and copied) in one go
+        madvise(map, size, MADV_SEQUENTIAL);
+        ret = bookstore_from_compressed(map, size);
+        munmap(map, size);
+        if (ret == NULL)
+            return (bookstore_t*) NULL;
+    } else if (size >= sizeof(BOOKSTORE_MAGIC) - 1
+            && memcmp(map, BOOKSTORE_MAGIC, sizeof(BOOKSTORE_MAGIC) - 1) == 0) {
+        // books borrow their strings from the mapping, which therefore
+        // has to stay around for as long as the bookstore does
+        ret = bookstore_from_image(map, size, true);
+        if (ret == NULL) {
+            munmap(map, size);
+            return (bookstore_t*) NULL;
+        }
+        madvise(map, size, MADV_RANDOM);
+        ret->map = map;
+        ret->map_size = size;
+    } else {
+        buffer_t legacy;
+        legacy.pivot = 0;
+        legacy.size = legacy.capacity = size;
+        legacy.bytes = map;
+        legacy.sink = NULL;
+        ret = unserialize_bookstore_legacy(&legacy);
+        munmap(map, size);
+        if (ret == NULL)
+            return (bookstore_t*) NULL;
+    }
+
+    journal_replay(ret, filename);
+    return ret;
+}
 
-    buffer_t* buf = buf_init_from_fd(fd);
+// reads the generation of a snapshot file, fails for missing files and for
+// ones that were never saved with a generation
+static bool snapshot_generation(const char* filename, uint32_t* generation) {
+    bookstore_header_t hdr;
+    FILE* fd = fopen(filename, "rb");
+    if (fd == NULL)
+        return false;
+    bool ret = fread(&hdr, sizeof(bookstore_header_t), 1, fd) == 1
+        && memcmp(hdr.magic, BOOKSTORE_MAGIC, sizeof(hdr.magic)) == 0
+        && hdr.version == BOOKSTORE_VERSION && hdr.generation != 0;
     fclose(fd);
+    *generation = hdr.generation;
+    return ret;
+}
 
-    bookstore_t* ret = unserialize_bookstore(buf);
-    buf_free(buf);
+void bookstore_journal(bookstore_t* store, const char* filename) {
+    bookstore_wait_save(store);
+    if (store->journal != NULL)
+        journal_close(store->journal);
+
+    // a bookstore that is not the one in the file (anymore) can only be
+    // journaled after writing a new snapshot of it
+    uint32_t generation;
+    bool stale = !snapshot_generation(filename, &generation) || generation != store->generation;
+    store->journal = journal_open(filename, store->generation, stale);
+}
+
+void bookstore_commit(bookstore_t* store) {
+    if (store->journal == NULL)
+        return;
+    if (store->journal->deferred) {
+        bookstore_checkpoint(store);
+        bookstore_wait_save(store);
+    } else if (journal_needs_compaction(store->journal))
+        bookstore_compact(store);
+    else
+        journal_commit(store->journal);
+}
+
+void bookstore_compact(bookstore_t* store) {
+    if (store->journal != NULL)
+        bookstore_save(store, store->journal->snapshot);
+}
+
+static void bookstore_resize_columns(bookstore_t* store, const unsigned int num_rows) {
+    store->columns.stocked_qty = realloc(store->columns.stocked_qty, sizeof(unsigned int) * num_rows);
+    store->columns.sold_qty = realloc(store->columns.sold_qty, sizeof(unsigned int) * num_rows);
+    store->columns.price = realloc(store->columns.price, sizeof(double) * num_rows);
+    if (store->columns.stocked_qty == NULL || store->columns.sold_qty == NULL
+            || store->columns.price == NULL)
+        exit(errno);
+}
+
+void bookstore_reserve(bookstore_t* store, const unsigned int num_books) {
+    if (num_books <= store->capacity)
+        return;
+    store->books = realloc(store->books, sizeof(book_t*) * num_books);
+    if (store->books == NULL) exit(errno);
+    bookstore_resize_columns(store, num_books);
+    store->capacity = num_books;
+    isbn_index_reserve(store->isbn_index, num_books);
+    // slots are never given back by bookstore_shrink(), as the books
+    // left may be in any of them
+    if (num_books > store->slots_capacity) {
+        store->slots = realloc(store->slots, sizeof(bookstore_slot_t) * num_books);
+        if (store->slots == NULL) exit(errno);
+        store->slots_capacity = num_books;
+    }
+}
+
+void bookstore_shrink(bookstore_t* store) {
+    if (store->num_books == store->capacity || store->num_books == 0)
+        return;
+    store->books = realloc(store->books, sizeof(book_t*) * store->num_books);
+    if (store->books == NULL) exit(errno);
+    bookstore_resize_columns(store, store->num_books);
+    store->capacity = store->num_books;
+}
+
+void bookstore_begin_bulk(bookstore_t* store, const unsigned int num_books) {
+    bookstore_reserve(store, store->num_books + num_books);
+    if (store->bulk)
+        return;
+    store->bulk = true;
+    store->bulk_start = store->num_books;
+    // the books added get tracked as any others when changes are
+    if (store->journal != NULL && !store->journal->deferred)
+        journal_suspend(store->journal);
+}
+
+void bookstore_end_bulk(bookstore_t* store) {
+    if (!store->bulk)
+        return;
+    store->bulk = false;
+    posting_index_insert_all(store->author_index, &(store->books[store->bulk_start]),
+            store->num_books - store->bulk_start);
+    posting_index_insert_all(store->genre_index, &(store->books[store->bulk_start]),
+            store->num_books - store->bulk_start);
+    trigram_index_insert_all(store->title_index, &(store->books[store->bulk_start]),
+            store->num_books - store->bulk_start);
+    skiplist_insert_all(store->price_index, &(store->books[store->bulk_start]),
+            store->num_books - store->bulk_start);
+    skiplist_insert_all(store->stock_index, &(store->books[store->bulk_start]),
+            store->num_books - store->bulk_start);
+}
+
+bookstore_snapshot_t* bookstore_snapshot(bookstore_t* store) {
+    bookstore_snapshot_t* ret = malloc(sizeof(bookstore_snapshot_t));
+    if (ret == NULL) exit(errno);
+    bookstore_t* view = &(ret->view);
+    memset(view, 0, sizeof(bookstore_t));
+    view->num_books = view->capacity = store->num_books;
+    size_t num_rows = (size_t) store->num_books + 1;
+    view->books = malloc(num_rows * sizeof(book_t*));
+    view->columns.stocked_qty = malloc(num_rows * sizeof(unsigned int));
+    view->columns.sold_qty = malloc(num_rows * sizeof(unsigned int));
+    view->columns.price = malloc(num_rows * sizeof(double));
+    if (view->books == NULL || view->columns.stocked_qty == NULL
+            || view->columns.sold_qty == NULL || view->columns.price == NULL)
+        exit(errno);
+    // an empty bookstore may have no arrays to copy from yet
+    if (store->num_books > 0) {
+        memcpy(view->books, store->books, store->num_books * sizeof(book_t*));
+        memcpy(view->columns.stocked_qty, store->columns.stocked_qty,
+                store->num_books * sizeof(unsigned int));
+        memcpy(view->columns.sold_qty, store->columns.sold_qty,
+                store->num_books * sizeof(unsigned int));
+        memcpy(view->columns.price, store->columns.price, store->num_books * sizeof(double));
+    }
+    view->totals = store->totals;
+    view->generation = store->generation;
+    view->next_seq = store->next_seq;
+    view->compressed = store->compressed;
+    ret->store = store;
+
+    // books added or copied from now on have a later epoch than the
+    // snapshot's, so the snapshot can tell it never saw them
+    pthread_mutex_lock(&(store->snapshot_lock));
+    ret->epoch = store->epoch++;
+    ret->next = store->snapshots;
+    store->snapshots = ret;
+    pthread_mutex_unlock(&(store->snapshot_lock));
     return ret;
 }
 
-void bookstore_add_book(bookstore_t* store, book_t* book) {
+void bookstore_snapshot_release(bookstore_snapshot_t* snap) {
+    bookstore_t* store = snap->store;
+    pthread_mutex_lock(&(store->snapshot_lock));
+    bookstore_snapshot_t** link = &(store->snapshots);
+    while (*link != snap)
+        link = &((*link)->next);
+    *link = snap->next;
+    pthread_cond_broadcast(&(store->snapshot_released));
+    pthread_mutex_unlock(&(store->snapshot_lock));
+
+    free(snap->view.books);
+    free(snap->view.columns.stocked_qty);
+    free(snap->view.columns.sold_qty);
+    free(snap->view.columns.price);
+    free(snap);
+}
+
+// whether an open snapshot sees a book, that is whether one was taken
+// since the book was added (or copied)
+static bool bookstore_book_shared(bookstore_t* store, const book_t* book) {
+    // no snapshot was taken since, so there is no need to look
+    if (book->epoch == store->epoch)
+        return false;
+    pthread_mutex_lock(&(store->snapshot_lock));
+    bool ret = store->snapshots != NULL && book->epoch <= store->snapshots->epoch;
+    pthread_mutex_unlock(&(store->snapshot_lock));
+    return ret;
+}
+
+// frees the retired books that no open snapshot sees anymore: the ones
+// retired before the oldest of them was taken are still seen by it
+static void bookstore_reclaim(bookstore_t* store) {
+    if (store->num_retired == 0)
+        return;
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&(store->snapshot_lock));
+    for (const bookstore_snapshot_t* snap = store->snapshots; snap != NULL; snap = snap->next)
+        oldest = snap->epoch;
+    pthread_mutex_unlock(&(store->snapshot_lock));
+
+    unsigned int num_freed = 0;
+    while (num_freed < store->num_retired && store->retired[num_freed].epoch <= oldest) {
+        book_t* book = store->retired[num_freed++].book;
+        book->retired = false;
+        book_free(book);
+    }
+    store->num_retired -= num_freed;
+    memmove(store->retired, &(store->retired[num_freed]),
+            store->num_retired * sizeof(bookstore_retired_t));
+}
+
+// keeps a book out of the bookstore around until the snapshots seeing it
+// are released
+static void bookstore_retire(bookstore_t* store, book_t* book) {
+    book->store = NULL;
+    book->retired = true;
+    if (store->num_retired == store->retired_capacity) {
+        store->retired_capacity = store->retired_capacity ? store->retired_capacity * 2 : 16;
+        store->retired = realloc(store->retired,
+                store->retired_capacity * sizeof(bookstore_retired_t));
+        if (store->retired == NULL) exit(errno);
+    }
+    store->retired[store->num_retired].book = book;
+    store->retired[store->num_retired].epoch = store->epoch;
+    store->num_retired++;
+    bookstore_reclaim(store);
+}
+
+// returns the book to make changes to in place of the given one: the book
+// itself, or if a snapshot sees it, a copy of it that takes its place in
+// the bookstore and all of its indexes
+static book_t* book_unshare(book_t* book) {
+    bookstore_t* store = book->store;
+    if (store == NULL)
+        return book;
+    // a good time to free what the snapshots released since left behind
+    bookstore_reclaim(store);
+    if (!bookstore_book_shared(store, book))
+        return book;
+
+    book_t* ret = book_alloc(store->arena, book->isbn, book->title, NULL, NULL);
+    // the interned strings, as those of a book from book_init() go away
+    // with it once it is reclaimed
+    book_intern(store, ret, book->author_id, book->genre_id);
+    ret->author_pos = book->author_pos;
+    ret->genre_pos = book->genre_pos;
+    ret->stocked_qty = book->stocked_qty;
+    ret->sold_qty = book->sold_qty;
+    ret->price = book->price;
+    ret->store = store;
+    ret->row = book->row;
+    ret->handle = book->handle;
+    ret->seq = book->seq;
+    ret->epoch = store->epoch;
+    ret->dirty_pos = book->dirty_pos;
+    if (ret->dirty_pos != BOOK_CLEAN)
+        store->dirty[ret->dirty_pos] = ret;
+    if (book->arena != store->arena)
+        store->num_heap_books--;
+
+    store->books[ret->row] = ret;
+    isbn_index_replace(store->isbn_index, book, ret);
+    posting_index_replace(store->author_index, book, ret);
+    posting_index_replace(store->genre_index, book, ret);
+    trigram_index_replace(store->title_index, book, ret);
+    skiplist_replace(store->price_index, book, ret);
+    skiplist_replace(store->stock_index, book, ret);
+    bookstore_retire(store, book);
+    return ret;
+}
+
+bool bookstore_add_book(bookstore_t* store, book_t* book) {
     if (book_find(store, book->isbn) != NULL) {
         printf("Book with the same ISBN already exists in the bookstore!\n");
-        return;
+        return false;
     }
 
-    store->books = realloc(store->books, sizeof(book_t*) * (store->num_books + 1));
-    if (store->books == NULL) exit(errno);
-    store->books[store->num_books] = book;
-    store->num_books++;
+    if (store->num_books == store->capacity)
+        bookstore_reserve(store, store->capacity < BOOKSTORE_MIN_CAPACITY
+                ? BOOKSTORE_MIN_CAPACITY : store->capacity * 2);
+    if (book->arena != store->arena) {
+        // books from book_init() keep their own strings, but get ids
+        book->author_id = intern_str(store->strings, book->author);
+        book->genre_id = intern_str(store->strings, book->genre);
+        store->num_heap_books++;
+    }
+    bookstore_append_book(store, book);
+    bookstore_mark_dirty(store, book);
+    if (bookstore_log(store) != NULL)
+        journal_log_add(store->journal, book->isbn, book->title, book->author, book->genre,
+                book->stocked_qty, book->sold_qty, book->price);
+    return true;
 }
 
-void bookstore_remove_book(bookstore_t* store, const book_t* book) {
-    for (unsigned int i=0; i<store->num_books; i++) {
-        if (store->books[i] == book) {
-            memmove(&(store->books[i]), &(store->books[i+1]), store->num_books - i - 1);
-            break;
-        }
+void bookstore_remove_book(bookstore_t* store, book_t* book) {
+    if (book->store != store)
+        return;
+
+    bookstore_unindex_book(store, book);
+    totals_sub(&(store->totals), book);
+    if (book->arena != store->arena)
+        store->num_heap_books--;
+    bool shared = bookstore_book_shared(store, book);
+
+    // the last book takes the row, so no other book moves
+    unsigned int row = book->row;
+    unsigned int last = --store->num_books;
+    if (row != last) {
+        book_t* moved = store->books[last];
+        store->books[row] = moved;
+        store->columns.stocked_qty[row] = store->columns.stocked_qty[last];
+        store->columns.sold_qty[row] = store->columns.sold_qty[last];
+        store->columns.price[row] = store->columns.price[last];
+        moved->row = row;
+        store->slots[(uint32_t) moved->handle].row = row;
     }
-    store->num_books--;
+    if (store->ledger != NULL)
+        ledger_forget(store->ledger, book->handle);
+    bookstore_release_slot(store, book->handle);
+    book->store = NULL;
+    bookstore_mark_removed(store, book);
+    if (bookstore_log(store) != NULL)
+        journal_log_remove(store->journal, book->isbn);
+    // a snapshot still sees the book, book_free() leaves it to the bookstore
+    if (shared)
+        bookstore_retire(store, book);
 }
 
 book_t* book_find(const bookstore_t* store, const char* isbn) {
-    for (unsigned int i=0; i<store->num_books; i++) {
-        if (strcmp(store->books[i]->isbn, isbn) == 0)
-            return store->books[i];
+    return isbn_index_find(store->isbn_index, isbn);
+}
+
+book_t* book_get(const bookstore_t* store, const book_handle_t handle) {
+    uint32_t slot = (uint32_t) handle;
+    if (slot >= store->num_slots || store->slots[slot].generation != handle >> 32)
+        return (book_t*) NULL;
+    return store->books[store->slots[slot].row];
+}
+
+static void posting_list_iter(const posting_list_t* list, book_iter_t* it) {
+    it->books = (list == NULL) ? NULL : list->books;
+    it->num_books = (list == NULL) ? 0 : list->num_books;
+    it->pos = 0;
+    metrics_count(METRICS_BOOKS_SCANNED, (list == NULL) ? 0 : list->num_books - list->num_removed);
+}
+
+void books_by_author_iter(const bookstore_t* store, const char* author, book_iter_t* it) {
+    posting_list_iter(posting_index_find(store->author_index,
+                intern_find(store->strings, author)), it);
+}
+
+void books_by_genre_iter(const bookstore_t* store, const char* genre, book_iter_t* it) {
+    posting_list_iter(posting_index_find(store->genre_index,
+                intern_find(store->strings, genre)), it);
+}
+
+void books_by_price_iter(const bookstore_t* store, const double min, const double max,
+        skiplist_iter_t* it) {
+    skiplist_range(store->price_index, min, max, it);
+}
+
+void books_low_stock_iter(const bookstore_t* store, const unsigned int qty, skiplist_iter_t* it) {
+    skiplist_range(store->stock_index, 0, (double) qty - 1, it);
+}
+
+// orders books by when they were added to their bookstore
+static int book_seq_cmp(const void* a, const void* b) {
+    const book_t* x = *(book_t* const*) a;
+    const book_t* y = *(book_t* const*) b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+book_t** books_by_title(const bookstore_t* store, const char* text, unsigned int* num_found) {
+    book_t** ret = NULL;
+    unsigned int num_candidates = 0;
+    if (strlen(text) >= 3) {
+        ret = trigram_index_search(store->title_index, text, &num_candidates);
+    } else if (store->num_books > 0) {
+        // too short to have a trigram, every title has to be checked
+        num_candidates = store->num_books;
+        ret = malloc(num_candidates * sizeof(book_t*));
+        if (ret == NULL) exit(errno);
+        memcpy(ret, store->books, num_candidates * sizeof(book_t*));
     }
+    metrics_count(METRICS_BOOKS_SCANNED, num_candidates);
 
-    return (book_t*) NULL;
+    *num_found = 0;
+    for (unsigned int i=0; i<num_candidates; i++) {
+        if (trigram_match(ret[i]->title, text))
+            ret[(*num_found)++] = ret[i];
+    }
+    if (*num_found == 0) {
+        free(ret);
+        return (book_t**) NULL;
+    }
+    // rows are out of the order the books were added in once some have
+    // been removed, unlike the trigram lists
+    if (strlen(text) < 3)
+        qsort(ret, *num_found, sizeof(book_t*), book_seq_cmp);
+    return ret;
 }
 
-book_t* books_by_author(const bookstore_t* store, const char* author, const book_t* last) {
-    bool proceed = (last == NULL) ? true : false;
+book_t* book_iter_next(book_iter_t* it) {
+    // skipping the books removed from a posting list
+    while (it->pos < it->num_books && it->books[it->pos] == NULL)
+        it->pos++;
+    if (it->pos >= it->num_books)
+        return (book_t*) NULL;
+    return it->books[it->pos++];
+}
 
-    for (unsigned int i=0; i<store->num_books; i++) {
-        if (proceed && strcmp(store->books[i]->author, author) == 0) {
-            return store->books[i];
-        }
+// returns the book following last in a posting list (or the first one)
+static book_t* posting_list_next(const posting_list_t* list, const book_t* last,
+        const unsigned int last_pos) {
+    if (list == NULL)
+        return (book_t*) NULL;
+    metrics_count(METRICS_BOOKS_SCANNED, 1);
 
-        if (!proceed && store->books[i] == last)
-            proceed = true;
+    unsigned int pos = 0;
+    if (last != NULL) {
+        if (last_pos >= list->num_books || list->books[last_pos] != last)
+            return (book_t*) NULL;
+        pos = last_pos + 1;
     }
 
-    return (book_t*) NULL;
+    while (pos < list->num_books && list->books[pos] == NULL)
+        pos++;
+    return (pos < list->num_books) ? list->books[pos] : (book_t*) NULL;
+}
+
+book_t* books_by_author(const bookstore_t* store, const char* author, const book_t* last) {
+    return posting_list_next(posting_index_find(store->author_index,
+                intern_find(store->strings, author)),
+            last, (last == NULL) ? 0 : last->author_pos);
 }
 
 book_t* books_by_genre(const bookstore_t* store, const char* genre, const book_t* last) {
-    bool proceed = (last == NULL) ? true : false;
+    return posting_list_next(posting_index_find(store->genre_index,
+                intern_find(store->strings, genre)),
+            last, (last == NULL) ? 0 : last->genre_pos);
+}
 
-    for (unsigned int i=0; i<store->num_books; i++) {
-        if (proceed && strcmp(store->books[i]->genre, genre) == 0) {
-            return store->books[i];
-        }
+// adds a book's numbers to a set of running totals
+static void totals_add(bookstore_totals_t* totals, const book_t* book) {
+    totals->units_sold += book->sold_qty;
+    totals->revenue += book->price * book->sold_qty;
+    totals->units_in_stock += book->stocked_qty;
+    totals->stock_value += book->price * book->stocked_qty;
+}
 
-        if (!proceed && store->books[i] == last)
-            proceed = true;
-    }
+// takes a book's numbers back out of a set of running totals
+static void totals_sub(bookstore_totals_t* totals, const book_t* book) {
+    totals->units_sold -= book->sold_qty;
+    totals->revenue -= book->price * book->sold_qty;
+    totals->units_in_stock -= book->stocked_qty;
+    totals->stock_value -= book->price * book->stocked_qty;
+}
 
-    return (book_t*) NULL;
+// the ordered index of a book's bookstore over the given field, or NULL if
+// the book is not in it (yet, during a bulk load)
+static skiplist_t* book_ordered_index(const book_t* book, const book_field_t field) {
+    if (book->store == NULL || (book->store->bulk && book->row >= book->store->bulk_start))
+        return (skiplist_t*) NULL;
+    return (field == BOOK_FIELD_PRICE) ? book->store->price_index : book->store->stock_index;
+}
+
+// to be called before changing a book's numeric fields, of which field is
+// the (only) one the book's bookstore keeps an ordered index over
+static void book_begin_update(const book_t* book, const book_field_t field) {
+    if (book->store == NULL)
+        return;
+    totals_sub(&(book->store->totals), book);
+    skiplist_t* index = book_ordered_index(book, field);
+    if (index != NULL)
+        skiplist_remove(index, book);
+}
+
+// to be called after changing a book's numeric fields, brings its
+// bookstore's totals, columns and the field's ordered index up to date
+static void book_end_update(book_t* book, const book_field_t field) {
+    if (book->store == NULL)
+        return;
+    totals_add(&(book->store->totals), book);
+    skiplist_t* index = book_ordered_index(book, field);
+    if (index != NULL)
+        skiplist_insert(index, book);
+    book->store->columns.stocked_qty[book->row] = book->stocked_qty;
+    book->store->columns.sold_qty[book->row] = book->sold_qty;
+    book->store->columns.price[book->row] = book->price;
+    bookstore_mark_dirty(book->store, book);
+}
+
+// moves a quantity of a book (known to be in stock) from stocked to sold,
+// recording the sale in the ledger unless its time is unknown (0); returns
+// the book as changed
+static book_t* book_take_sold(book_t* book, const unsigned int qty, const int64_t when) {
+    book = book_unshare(book);
+    book_begin_update(book, BOOK_FIELD_STOCKED_QTY);
+    book->sold_qty += qty;
+    book->stocked_qty -= qty;
+    book_end_update(book, BOOK_FIELD_STOCKED_QTY);
+    if (when != 0 && book->store != NULL && book->store->ledger != NULL)
+        ledger_record(book->store->ledger, book->handle, book->seq, qty, when);
+    return book;
 }
 
 bool book_sell(book_t* book, const unsigned int qty) {
+    return book_sell_at(book, qty, (int64_t) time(NULL));
+}
+
+bool book_sell_at(book_t* book, const unsigned int qty, const int64_t when) {
     if (book->stocked_qty < qty) {
         printf("Stocked quantity is less than requested, cannot sell!\n");
         return false;
     } else {
-        book->sold_qty += qty;
-        book->stocked_qty -= qty;
+        book = book_take_sold(book, qty, when);
+        if (bookstore_log(book->store) != NULL)
+            journal_log_sale(book->store->journal, book->isbn, qty, when);
         return true;
     }
 }
 
+// one sale of a batch, looked up
+typedef struct book_sale_entry_struct {
+    book_t* book;
+    unsigned int qty;
+    unsigned int pos; // of the sale in the batch
+} book_sale_entry_t;
+
+// orders the sales of a batch by book, then by position
+static int book_sale_entry_cmp(const void* a, const void* b) {
+    const book_sale_entry_t* x = a;
+    const book_sale_entry_t* y = b;
+    if (x->book != y->book)
+        return ((uintptr_t) x->book > (uintptr_t) y->book) ? 1 : -1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+// syncs a basket about to be sold to the journal of a bookstore tracking its
+// changes, once any checkpoint under way has finished writing to it; the
+// books in it changed since the last checkpoint are logged as they are first,
+// as the journal does not have them yet, and their next checkpoint
+// supersedes all of it
+static void bookstore_log_basket(bookstore_t* store, const book_sale_entry_t* entries,
+        const unsigned int num_books, const book_sale_t* sales, const unsigned int num_sales,
+        const int64_t when) {
+    bookstore_wait_save(store);
+    journal_t* journal = store->journal;
+    for (unsigned int i=0; i<num_books; i++) {
+        const book_t* book = entries[i].book;
+        if (book->dirty_pos != BOOK_CLEAN)
+            journal_log_book(journal, book->isbn, book->title, book->author, book->genre,
+                    book->stocked_qty, book->sold_qty, book->price);
+    }
+    journal_log_sales(journal, sales, num_sales, when);
+    journal_commit(journal);
+}
+
+bool bookstore_sell_batch(bookstore_t* store, const book_sale_t* sales, const unsigned int num_sales,
+        unsigned int* failed) {
+    return bookstore_sell_batch_at(store, sales, num_sales, (int64_t) time(NULL), failed);
+}
+
+bool bookstore_sell_batch_at(bookstore_t* store, const book_sale_t* sales, const unsigned int num_sales,
+        const int64_t when, unsigned int* failed) {
+    book_sale_entry_t* entries = malloc(((size_t) num_sales + 1) * sizeof(book_sale_entry_t));
+    if (entries == NULL) exit(errno);
+    *failed = num_sales;
+    for (unsigned int i=0; i<num_sales; i++) {
+        entries[i].book = book_find(store, sales[i].isbn);
+        entries[i].qty = sales[i].qty;
+        entries[i].pos = i;
+        if (entries[i].book == NULL) {
+            *failed = i;
+            free(entries);
+            return false;
+        }
+    }
+
+    // the sales of the same book are next to each other once sorted, so
+    // they can be added up against its stock, and it is changed only once
+    qsort(entries, num_sales, sizeof(book_sale_entry_t), book_sale_entry_cmp);
+    unsigned int num_books = 0;
+    for (unsigned int i=0; i<num_sales;) {
+        book_t* book = entries[i].book;
+        uint64_t qty = 0;
+        for (; i<num_sales && entries[i].book == book; i++) {
+            qty += entries[i].qty;
+            if (qty > book->stocked_qty && entries[i].pos < *failed)
+                *failed = entries[i].pos;
+        }
+        entries[num_books].book = book;
+        entries[num_books++].qty = (unsigned int) qty;
+    }
+    if (*failed < num_sales) {
+        free(entries);
+        return false;
+    }
+
+    if (bookstore_tracks_changes(store))
+        bookstore_log_basket(store, entries, num_books, sales, num_sales, when);
+    for (unsigned int i=0; i<num_books; i++)
+        book_take_sold(entries[i].book, entries[i].qty, when);
+    free(entries);
+    if (bookstore_log(store) != NULL) {
+        journal_log_sales(store->journal, sales, num_sales, when);
+        journal_commit(store->journal);
+    }
+    return true;
+}
+
 void book_stock(book_t* book, const unsigned int qty) {
+    book = book_unshare(book);
+    book_begin_update(book, BOOK_FIELD_STOCKED_QTY);
     book->stocked_qty += qty;
+    book_end_update(book, BOOK_FIELD_STOCKED_QTY);
+    if (bookstore_log(book->store) != NULL)
+        journal_log_qty(book->store->journal, JOURNAL_STOCK, book->isbn, qty);
 }
 
 void book_change_price(book_t* book, const double price) {
+    book = book_unshare(book);
+    book_begin_update(book, BOOK_FIELD_PRICE);
     book->price = price;
+    book_end_update(book, BOOK_FIELD_PRICE);
+    if (bookstore_log(book->store) != NULL)
+        journal_log_price(book->store->journal, book->isbn, price);
+}
+
+void book_restore(book_t* book, const unsigned int stocked_qty, const unsigned int sold_qty,
+        const double price) {
+    book = book_unshare(book);
+    book_begin_update(book, BOOK_FIELD_PRICE);
+    skiplist_t* stock_index = book_ordered_index(book, BOOK_FIELD_STOCKED_QTY);
+    if (stock_index != NULL)
+        skiplist_remove(stock_index, book);
+    book->stocked_qty = stocked_qty;
+    book->sold_qty = sold_qty;
+    book->price = price;
+    if (stock_index != NULL)
+        skiplist_insert(stock_index, book);
+    book_end_update(book, BOOK_FIELD_PRICE);
 }
 
 void book_print(const book_t* book) {
-    printf("(%s) `%s` by %s [genre=%s, stocked_qty=%u, sold_qty=%u, price=%.2f]\n",
+    book_fprint(book, stdout);
+}
+
+void book_fprint(const book_t* book, FILE* fd) {
+    fprintf(fd, "(%s) `%s` by %s [genre=%s, stocked_qty=%u, sold_qty=%u, price=%.2f]\n",
             book->isbn, book->title, book->author, book->genre,
             book->stocked_qty, book->sold_qty, book->price);
 }
@@ -215,42 +1761,235 @@ void books_sort_by_sold_qty(book_t** books, const unsigned int num_books) {
     books_sort_by_sold_qty(&books[i], num_books - i);
 }
 
-void bookstore_get_bestsellers(bookstore_t* store, unsigned int howmany) {
+// whether the book in row a sells worse than the one in row b, ties
+// going to the book added later (rows being out of order once books
+// have been removed)
+static bool row_sells_worse(const bookstore_t* store, const unsigned int a, const unsigned int b) {
+    const unsigned int* sold_qty = store->columns.sold_qty;
+    return sold_qty[a] < sold_qty[b]
+        || (sold_qty[a] == sold_qty[b] && store->books[a]->seq > store->books[b]->seq);
+}
+
+// restores the min-heap property (worst seller on top) below position i
+static void top_heap_sift_down(unsigned int* heap, const unsigned int size,
+        const bookstore_t* store, unsigned int i) {
+    while (true) {
+        unsigned int worst = i;
+        unsigned int left = 2 * i + 1;
+        unsigned int right = left + 1;
+        if (left < size && row_sells_worse(store, heap[left], heap[worst]))
+            worst = left;
+        if (right < size && row_sells_worse(store, heap[right], heap[worst]))
+            worst = right;
+        if (worst == i)
+            return;
+        unsigned int t = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = t;
+        i = worst;
+    }
+}
+
+unsigned int bookstore_top_sellers(const bookstore_t* store, unsigned int howmany, book_t** out) {
+    if (howmany > store->num_books)
+        howmany = store->num_books;
+    if (howmany == 0)
+        return 0;
+    metrics_count(METRICS_BOOKS_SCANNED, store->num_books);
+
+    // bounded min-heap of the best rows seen so far, so every other
+    // row costs a single comparison against the worst of them
+    const unsigned int* sold_qty = store->columns.sold_qty;
+    unsigned int* heap = malloc(howmany * sizeof(unsigned int));
+    if (heap == NULL) exit(errno);
+    for (unsigned int i=0; i<howmany; i++)
+        heap[i] = i;
+    for (unsigned int i=howmany/2; i>0; i--)
+        top_heap_sift_down(heap, howmany, store, i - 1);
+    for (unsigned int i=howmany; i<store->num_books; i++) {
+        if (sold_qty[i] >= sold_qty[heap[0]] && row_sells_worse(store, heap[0], i)) {
+            heap[0] = i;
+            top_heap_sift_down(heap, howmany, store, 0);
+        }
+    }
+
+    // popping the worst one off repeatedly fills the result from its end
+    for (unsigned int size=howmany; size>0; size--) {
+        out[size - 1] = store->books[heap[0]];
+        heap[0] = heap[size - 1];
+        top_heap_sift_down(heap, size - 1, store, 0);
+    }
+
+    free(heap);
+    return howmany;
+}
+
+unsigned int bookstore_window_top_sellers(const bookstore_t* store, const ledger_window_t window,
+        unsigned int howmany, book_t** out, unsigned int* qty) {
+    if (store->ledger == NULL || howmany == 0)
+        return 0;
+    uint64_t* handles = malloc(howmany * sizeof(uint64_t));
+    if (handles == NULL) exit(errno);
+    unsigned int ret = ledger_top(store->ledger, window, (int64_t) time(NULL), howmany, handles, qty);
+    // the ledger forgets the books removed, so all of them are still there
+    for (unsigned int i=0; i<ret; i++)
+        out[i] = book_get(store, handles[i]);
+    free(handles);
+    return ret;
+}
+
+void bookstore_get_bestsellers(const bookstore_t* store, unsigned int howmany) {
     if (howmany > store->num_books) {
         printf("Warning: you requested more bestsellers than there are books!\n");
         howmany = store->num_books;
     }
-    books_sort_by_sold_qty(store->books, store->num_books);
-    for (unsigned int i=0; i<howmany; i++) {
-        book_print(store->books[store->num_books - i - 1]);
-    }
+    if (howmany == 0)
+        return;
+
+    book_t** top = malloc(howmany * sizeof(book_t*));
+    if (top == NULL) exit(errno);
+    howmany = bookstore_top_sellers(store, howmany, top);
+    for (unsigned int i=0; i<howmany; i++)
+        book_print(top[i]);
+    free(top);
 }
 
 void bookstore_get_sold_out(const bookstore_t* store) {
+    const unsigned int* stocked_qty = store->columns.stocked_qty;
+    metrics_count(METRICS_BOOKS_SCANNED, store->num_books);
     for (unsigned int i=0; i<store->num_books; i++) {
-        if (store->books[i]->stocked_qty == 0) {
+        if (stocked_qty[i] == 0) {
             book_print(store->books[i]);
         }
     }
 }
 
+// the column scans below keep four independent partial sums, so that the
+// compiler can keep the loop in vector registers instead of serializing
+// every addition on a single accumulator
+
+void bookstore_sales_totals(const bookstore_t* store, uint64_t* units_sold, double* revenue) {
+    const unsigned int* restrict sold_qty = store->columns.sold_qty;
+    const double* restrict price = store->columns.price;
+    metrics_count(METRICS_BOOKS_SCANNED, store->num_books);
+    uint64_t n[4] = {0, 0, 0, 0};
+    double sum[4] = {0, 0, 0, 0};
+    unsigned int i = 0;
+    for (; i + 4 <= store->num_books; i += 4) {
+        for (unsigned int j=0; j<4; j++) {
+            n[j] += sold_qty[i + j];
+            sum[j] += price[i + j] * sold_qty[i + j];
+        }
+    }
+    for (; i<store->num_books; i++) {
+        n[0] += sold_qty[i];
+        sum[0] += price[i] * sold_qty[i];
+    }
+    *units_sold = n[0] + n[1] + n[2] + n[3];
+    *revenue = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+void bookstore_stock_totals(const bookstore_t* store, uint64_t* units_in_stock, double* value) {
+    const unsigned int* restrict stocked_qty = store->columns.stocked_qty;
+    const double* restrict price = store->columns.price;
+    metrics_count(METRICS_BOOKS_SCANNED, store->num_books);
+    uint64_t n[4] = {0, 0, 0, 0};
+    double sum[4] = {0, 0, 0, 0};
+    unsigned int i = 0;
+    for (; i + 4 <= store->num_books; i += 4) {
+        for (unsigned int j=0; j<4; j++) {
+            n[j] += stocked_qty[i + j];
+            sum[j] += price[i + j] * stocked_qty[i + j];
+        }
+    }
+    for (; i<store->num_books; i++) {
+        n[0] += stocked_qty[i];
+        sum[0] += price[i] * stocked_qty[i];
+    }
+    *units_in_stock = n[0] + n[1] + n[2] + n[3];
+    *value = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+bool bookstore_check_totals(const bookstore_t* store) {
+    bookstore_totals_t actual;
+    bookstore_sales_totals(store, &(actual.units_sold), &(actual.revenue));
+    bookstore_stock_totals(store, &(actual.units_in_stock), &(actual.stock_value));
+
+    // the running sums of money pick up rounding errors along the way,
+    // so those only have to match to within a relative tolerance
+    return actual.units_sold == store->totals.units_sold
+        && actual.units_in_stock == store->totals.units_in_stock
+        && fabs(actual.revenue - store->totals.revenue) <= 1e-9 * (1 + fabs(actual.revenue))
+        && fabs(actual.stock_value - store->totals.stock_value) <= 1e-9 * (1 + fabs(actual.stock_value));
+}
+
 void book_free(book_t* book) {
-    free(book->isbn);
+    if (book->retired)
+        return;
     book->isbn = NULL;
-    free(book->title);
     book->title = NULL;
-    free(book->author);
     book->author = NULL;
-    free(book->genre);
     book->genre = NULL;
-    free(book);
+    arena_release(book->arena, book, book->alloc_size);
     book = NULL;
 }
 
 void bookstore_free(bookstore_t* store) {
-    for (unsigned int i=0; i<store->num_books; i++) book_free(store->books[i]);
+    bookstore_wait_save(store);
+    pthread_mutex_lock(&(store->snapshot_lock));
+    while (store->snapshots != NULL)
+        pthread_cond_wait(&(store->snapshot_released), &(store->snapshot_lock));
+    pthread_mutex_unlock(&(store->snapshot_lock));
+    bookstore_reclaim(store);
+    free(store->retired);
+    store->retired = NULL;
+    pthread_mutex_destroy(&(store->snapshot_lock));
+    pthread_cond_destroy(&(store->snapshot_released));
+    free(store->dirty);
+    store->dirty = NULL;
+    if (store->removed != NULL)
+        buf_free(store->removed);
+    store->removed = NULL;
+
+    // books allocated from the arena go away with it, only the ones
+    // created by book_init() have to be released one by one
+    for (unsigned int i=0; store->num_heap_books > 0 && i<store->num_books; i++) {
+        if (store->books[i]->arena != store->arena) {
+            book_free(store->books[i]);
+            store->num_heap_books--;
+        }
+    }
     free(store->books);
     store->books = NULL;
+    free(store->slots);
+    store->slots = NULL;
+    free(store->columns.stocked_qty);
+    free(store->columns.sold_qty);
+    free(store->columns.price);
+    isbn_index_free(store->isbn_index);
+    store->isbn_index = NULL;
+    posting_index_free(store->author_index);
+    store->author_index = NULL;
+    posting_index_free(store->genre_index);
+    store->genre_index = NULL;
+    trigram_index_free(store->title_index);
+    store->title_index = NULL;
+    skiplist_free(store->price_index);
+    store->price_index = NULL;
+    skiplist_free(store->stock_index);
+    store->stock_index = NULL;
+    ledger_free(store->ledger);
+    store->ledger = NULL;
+    if (store->journal != NULL)
+        journal_close(store->journal);
+    store->journal = NULL;
+    intern_free(store->strings);
+    store->strings = NULL;
+    arena_free(store->arena);
+    store->arena = NULL;
+    if (store->map != NULL)
+        munmap(store->map, store->map_size);
+    store->map = NULL;
     free(store);
     store = NULL;
 }
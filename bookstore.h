@@ -1,12 +1,78 @@
 #ifndef __BOOKSTORE_H__
 #define __BOOKSTORE_H__
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "buffer.h"
+#include "index.h"
+#include "arena.h"
+#include "intern.h"
+#include "journal.h"
+#include "trigram.h"
+#include "skiplist.h"
+#include "ledger.h"
+
+// on-disk format identification
+#define BOOKSTORE_MAGIC "BDSM"
+#define BOOKSTORE_VERSION 2
+
+// header flag of compressed files: the header is followed by compressed
+// blocks (see buf_init_compressed_sink()) of the dictionary strings and then
+// every book's ISBN, title, author and genre dictionary ids, stocked and
+// sold quantities (all of them varints) and price
+#define BOOKSTORE_FLAG_COMPRESSED 1
+
+// amount of data compressed into each block of a compressed file
+#define BOOKSTORE_BLOCK_SIZE (256 * 1024)
+
+// dirty_pos of a book that has not changed since the last checkpoint
+#define BOOK_CLEAN ((unsigned int) -1)
+
+// free_slot of a bookstore with no free slots
+#define BOOKSTORE_NO_SLOT ((unsigned int) -1)
+
+// handle of no book at all, as slot generations start at 1
+#define BOOK_NO_HANDLE ((book_handle_t) 0)
+
 
 /*
  * structs
  */
 
+// stable reference to a book in a bookstore: the index of the slot it took
+// in the low bits, the slot's generation in the high ones; it stays valid
+// while books come and go and rows move, and never refers to another book
+// once the book is removed
+typedef uint64_t book_handle_t;
+
+// a saved bookstore consists of this header, a dictionary of the author and
+// genre strings (as heap offsets) starting at dict_offset, a table of
+// fixed-width book records starting at records_offset and a heap of
+// null-terminated strings starting at heap_offset and spanning to the end
+// of the file
+typedef struct bookstore_header_struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_books;
+    uint32_t num_strings; // number of dictionary entries
+    uint32_t generation; // bumped on every save, 0 if never saved
+    uint64_t dict_offset;
+    uint64_t records_offset;
+    uint64_t heap_offset;
+} bookstore_header_t;
+
+typedef struct book_record_struct {
+    uint64_t isbn; // string offsets, relative to the start of the heap
+    uint64_t title;
+    uint32_t author; // dictionary ids
+    uint32_t genre;
+    uint32_t stocked_qty;
+    uint32_t sold_qty;
+    double price;
+} book_record_t;
+
 typedef struct book_struct {
     char* isbn;
     char* title;
@@ -15,13 +81,177 @@ typedef struct book_struct {
     unsigned int stocked_qty;
     unsigned int sold_qty;
     double price;
+    unsigned int author_id; // interned string ids, valid in a bookstore
+    unsigned int genre_id;
+    unsigned int author_pos; // position in the author posting list
+    unsigned int genre_pos; // position in the genre posting list
+    arena_t* arena; // where the book was allocated from, NULL for the heap
+    size_t alloc_size;
+    struct bookstore_struct* store; // the bookstore the book is in, if any
+    unsigned int row; // position in the bookstore and its columns
+    book_handle_t handle; // in the bookstore it is in
+    uint64_t seq; // order the book was added to the bookstore in
+    uint64_t epoch; // of the bookstore when this copy of the book was made
+    bool retired; // out of its bookstore, but freed only once no snapshot sees it
+    unsigned int dirty_pos; // position among the bookstore's dirty books, or BOOK_CLEAN
 } book_t;
 
+// copies of the books' numeric fields, one array per field, with a row per
+// book in bookstore order, so that aggregates scan contiguous memory
+typedef struct book_columns_struct {
+    unsigned int* stocked_qty;
+    unsigned int* sold_qty;
+    double* price;
+} book_columns_t;
+
+// sales and inventory figures kept up to date as the bookstore changes
+typedef struct bookstore_totals_struct {
+    uint64_t units_sold;
+    double revenue; // of the units sold, at current prices
+    uint64_t units_in_stock;
+    double stock_value; // of the units in stock, at current prices
+} bookstore_totals_t;
+
+// a book taken out of a bookstore (or replaced by a copy of it) while a
+// snapshot could still see it
+typedef struct bookstore_retired_struct {
+    book_t* book;
+    uint64_t epoch; // of the bookstore when the book was retired
+} bookstore_retired_t;
+
+// how the checkpoints of a bookstore went
+typedef struct bookstore_checkpoint_stats_struct {
+    uint64_t count; // finished ones
+    uint64_t failed;
+    uint64_t last_duration; // in nanoseconds, from starting to write to synced
+    uint64_t last_lag; // in nanoseconds, from the oldest change it saved to synced
+    unsigned int last_books; // it saved, all of them if it was a new snapshot
+} bookstore_checkpoint_stats_t;
+
+// slot of a bookstore's slot map, either taken by a book or free
+typedef struct bookstore_slot_struct {
+    uint32_t generation; // bumped whenever the book in the slot is removed
+    unsigned int row; // of the book in the slot, or the next free slot
+} bookstore_slot_t;
+
+struct bookstore_snapshot_struct;
+struct bookstore_save_job_struct;
+
 typedef struct bookstore_struct {
     unsigned int num_books;
-    book_t** books;
+    unsigned int capacity; // number of slots allocated in books
+    book_t** books; // dense, a book removed has the last one moved into its row
+    bookstore_slot_t* slots; // the slot map of the books' handles
+    unsigned int num_slots; // ever taken
+    unsigned int slots_capacity;
+    unsigned int free_slot; // first of the free ones, or BOOKSTORE_NO_SLOT
+    book_columns_t columns;
+    bookstore_totals_t totals;
+    unsigned int num_heap_books; // books not allocated from the arena
+    arena_t* arena; // backing memory of the books created by the bookstore
+    intern_table_t* strings; // interned authors and genres
+    char* map; // the file the bookstore was loaded from, if any
+    size_t map_size;
+    isbn_index_t* isbn_index;
+    posting_index_t* author_index;
+    posting_index_t* genre_index;
+    trigram_index_t* title_index;
+    skiplist_t* price_index;
+    skiplist_t* stock_index;
+    ledger_t* ledger; // the sales made, by time
+    bool bulk; // a bulk load is in progress
+    unsigned int bulk_start; // first row added by the bulk load
+    uint32_t generation; // of the snapshot the bookstore was loaded from or saved to
+    journal_t* journal; // where changes are logged, if journaled
+    uint64_t next_seq; // seq of the next book added
+    bool compressed; // saved in the compressed format
+    uint64_t epoch; // bumped by every snapshot taken
+    struct bookstore_snapshot_struct* snapshots; // the open ones, newest first
+    pthread_mutex_t snapshot_lock; // guards snapshots and epoch
+    pthread_cond_t snapshot_released;
+    bookstore_retired_t* retired; // oldest first
+    unsigned int num_retired;
+    unsigned int retired_capacity;
+    struct bookstore_save_job_struct* save_job; // the save running in the background, if any
+    book_t** dirty; // books changed since the last checkpoint, if the journal is deferred
+    unsigned int num_dirty;
+    unsigned int dirty_capacity;
+    buffer_t* removed; // ISBNs of the books removed since then
+    unsigned int num_removed;
+    uint64_t num_changes; // made since then
+    uint64_t dirty_since; // when the first of them was made (see metrics_now()), 0 if none
+    uint64_t checkpoint_seq; // next_seq at the last checkpoint
+    bookstore_checkpoint_stats_t checkpoints;
 } bookstore_t;
 
+// a bookstore as it was at some point in time: the books it had, with their
+// numbers at that time (books changed since then are copied on write, so
+// the bookstore's books may no longer be the ones seen here), along with its
+// columns and totals; view has no indexes or interned strings of its own,
+// so only the functions going through the books, columns and totals can be
+// used on it
+typedef struct bookstore_snapshot_struct {
+    bookstore_t view;
+    bookstore_t* store;
+    uint64_t epoch; // of the bookstore when the snapshot was taken
+    struct bookstore_snapshot_struct* next; // the next older open snapshot
+} bookstore_snapshot_t;
+
+// a save running on a thread of its own, writing out a snapshot, or a
+// checkpoint writing out records to the bookstore's journal
+typedef struct bookstore_save_job_struct {
+    bookstore_snapshot_t* snap; // NULL for records
+    char* filename;
+    buffer_t* records;
+    journal_t* journal; // of a checkpoint, reset after writing a new snapshot
+    uint32_t generation; // of the new snapshot
+    bool checkpoint;
+    unsigned int num_books; // saved
+    uint64_t oldest_change; // saved, see metrics_now()
+    uint64_t duration;
+    uint64_t finished;
+    bool ok;
+    atomic_bool done; // the thread is about to finish
+    pthread_t thread;
+} bookstore_save_job_t;
+
+// a serialized bookstore being read
+typedef struct bookstore_image_struct {
+    char* heap;
+    size_t heap_size;
+    unsigned int num_strings;
+    unsigned int* string_ids; // intern id of each dictionary string
+    bool borrow; // point the books into the heap instead of copying strings
+} bookstore_image_t;
+
+// a range of book records decoded by one thread while loading a bookstore
+typedef struct bookstore_load_slice_struct {
+    bookstore_t* store;
+    const bookstore_image_t* img;
+    const char* records; // the whole record table
+    book_t* books; // where to put the books, one per record
+    size_t* hashes; // where to put the hashes of their ISBNs
+    unsigned int first;
+    unsigned int last; // one past the last record of the slice
+    bookstore_totals_t totals; // of the books in the slice
+    bool ok;
+    unsigned int bad_record; // the corrupted record, unless ok
+    pthread_t thread;
+} bookstore_load_slice_t;
+
+// a quantity of a book to be sold, as one line of a sale
+typedef struct book_sale_struct {
+    const char* isbn;
+    unsigned int qty;
+} book_sale_t;
+
+// iterator over the books matching a search, valid until the bookstore changes
+typedef struct book_iter_struct {
+    book_t** books;
+    unsigned int num_books;
+    unsigned int pos;
+} book_iter_t;
+
 
 /*
  * function prototypes
@@ -32,14 +262,27 @@ book_t* book_init(const char* isbn, const char* title, const char* author,
         const char* genre, const unsigned int stocked_qty,
         const unsigned int sold_qty, const double price);
 
+// creates a new book in the memory arena of a bookstore (the book still has
+// to be added to it and must not outlive it)
+book_t* bookstore_new_book(bookstore_t* store, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price);
+
 // creates a new, empty bookstore
 bookstore_t* bookstore_init(void);
 
-// serializes book into a buffer
-void serialize_book(const book_t* book, buffer_t* buf);
+// serializes the fixed-width record of a book into a buffer, assigning its
+// own strings consecutive offsets in the string heap starting at *heap_offset
+// and translating its interned strings to dictionary ids
+void serialize_book(const book_t* book, buffer_t* buf, uint64_t* heap_offset,
+        const uint32_t* dict_ids);
 
-// unserializes a book from a buffer
-book_t* unserialize_book(buffer_t* buf);
+// serializes the book's own strings into the string heap in a buffer
+void serialize_book_strings(const book_t* book, buffer_t* buf);
+
+// unserializes a book from its record in a buffer into the arena of a
+// bookstore, looking its strings up in the image being read
+book_t* unserialize_book(buffer_t* buf, bookstore_t* store, const bookstore_image_t* img);
 
 // serializes bookstore into a buffer
 void serialize_bookstore(const bookstore_t* store, buffer_t* buf);
@@ -47,55 +290,203 @@ void serialize_bookstore(const bookstore_t* store, buffer_t* buf);
 // unserializes a bookstore from a buffer
 bookstore_t* unserialize_bookstore(buffer_t* buf);
 
-// writes bookstore into a file
-void bookstore_save(const bookstore_t* store, const char* filename);
+// serializes the contents of a compressed file (all but its header) into
+// a buffer, before compression
+void serialize_bookstore_compressed(const bookstore_t* store, buffer_t* buf);
+
+// writes bookstore into a file (compressed, if store->compressed is set),
+// superseding the file's journal
+void bookstore_save(bookstore_t* store, const char* filename);
+
+// starts writing bookstore into a file on a background thread, from a
+// snapshot of it, so that the bookstore can keep changing in the meantime
+// (waits for the previous background save to finish first); saving to the
+// snapshot file of a journaled bookstore is done right away instead
+void bookstore_save_background(bookstore_t* store, const char* filename);
 
-// reads bookstore from a file
+// waits for the background save of a bookstore to finish, if there is one,
+// returns false if it failed
+bool bookstore_wait_save(bookstore_t* store);
+
+// whether the background save of a bookstore is still running
+bool bookstore_save_running(const bookstore_t* store);
+
+// switches a journaled bookstore from logging every change as it is made to
+// keeping track of the books changed, which get logged at checkpoints
+void bookstore_track_changes(bookstore_t* store);
+
+// starts logging the states of the books changed since the last checkpoint
+// of a bookstore tracking changes into its journal on a background thread,
+// or writing a new snapshot instead once the journal has grown too large
+// (waits for the previous background save to finish first); returns false
+// if there is nothing to checkpoint
+bool bookstore_checkpoint(bookstore_t* store);
+
+// takes a snapshot of a bookstore, which stays valid (and keeps the books it
+// sees from being freed) until released, while the bookstore goes on changing;
+// it takes copying the bookstore's array of books and columns, but none of
+// the books, until they change
+bookstore_snapshot_t* bookstore_snapshot(bookstore_t* store);
+
+// releases a snapshot (from any thread), the books it kept around get freed
+// as the bookstore changes next
+void bookstore_snapshot_release(bookstore_snapshot_t* snap);
+
+// reads bookstore from a file, mapping it into memory instead of copying it,
+// and replays the file's journal on top of it (the sales replayed that were
+// made within the last week going into the ledger too)
+// (returns NULL if the file cannot be read or is not a valid bookstore)
 bookstore_t* bookstore_load(const char* filename);
 
-// adds book into a bookstore
-void bookstore_add_book(bookstore_t* store, book_t* book);
+// starts logging every change to the bookstore into the journal of the
+// given snapshot file
+void bookstore_journal(bookstore_t* store, const char* filename);
+
+// makes the changes to a journaled bookstore durable by appending them to
+// the journal, or by compacting it once it has grown too large
+void bookstore_commit(bookstore_t* store);
+
+// folds the journal of a journaled bookstore into a new snapshot
+void bookstore_compact(bookstore_t* store);
 
-// removes book from a bookstore
-void bookstore_remove_book(bookstore_t* store, const book_t* book);
+// makes room for at least num_books books without reallocating
+void bookstore_reserve(bookstore_t* store, const unsigned int num_books);
+
+// releases memory allocated for books beyond those currently in the bookstore
+void bookstore_shrink(bookstore_t* store);
+
+// starts adding many books at once, making room for num_books more of them;
+// until the bulk load ends, the new books are only indexed by their ISBN
+// and no books may be removed
+void bookstore_begin_bulk(bookstore_t* store, const unsigned int num_books);
+
+// ends a bulk load, putting the books it added into the remaining indexes
+void bookstore_end_bulk(bookstore_t* store);
+
+// adds book into a bookstore, fails if there already is one with its ISBN
+bool bookstore_add_book(bookstore_t* store, book_t* book);
+
+// removes book from a bookstore, in constant time apart from unindexing
+// it, moving the last book into its row
+void bookstore_remove_book(bookstore_t* store, book_t* book);
 
 // finds a book by its ISBN
 book_t* book_find(const bookstore_t* store, const char* isbn);
 
+// finds a book by its handle, returns NULL if it has been removed
+book_t* book_get(const bookstore_t* store, const book_handle_t handle);
+
+// sets up an iterator over books written by the given author
+void books_by_author_iter(const bookstore_t* store, const char* author, book_iter_t* it);
+
+// sets up an iterator over books having the given genre
+void books_by_genre_iter(const bookstore_t* store, const char* genre, book_iter_t* it);
+
+// finds the books whose titles contain the given text, ignoring (ASCII)
+// case, in the order they were added; returns a newly allocated array of
+// them, or NULL if there are none
+book_t** books_by_title(const bookstore_t* store, const char* text, unsigned int* num_found);
+
+// returns the next book from an iterator, or NULL when there are no more
+book_t* book_iter_next(book_iter_t* it);
+
+// sets up an iterator over books priced between min and max (inclusive),
+// cheapest first (use skiplist_iter_next() to get the books)
+void books_by_price_iter(const bookstore_t* store, const double min, const double max,
+        skiplist_iter_t* it);
+
+// sets up an iterator over books with fewer than qty pieces in stock,
+// lowest stock first (use skiplist_iter_next() to get the books)
+void books_low_stock_iter(const bookstore_t* store, const unsigned int qty, skiplist_iter_t* it);
+
 // iterates through a bookstore, returning books written by the given author
 book_t* books_by_author(const bookstore_t* store, const char* author, const book_t* last);
 
 // iterates through a bookstore, returning books having the given genre
 book_t* books_by_genre(const bookstore_t* store, const char* genre, const book_t* last);
 
+// changes to a book that an open snapshot of its bookstore sees are made
+// to a copy of the book, which takes its place in the bookstore, so the
+// book has to be looked up again afterwards to see them
+
 // sells a given quantity of a book
 bool book_sell(book_t* book, const unsigned int qty);
 
+// sells a given quantity of a book at the given time (in seconds since the
+// epoch, 0 if not known, which keeps the sale out of the ledger)
+bool book_sell_at(book_t* book, const unsigned int qty, const int64_t when);
+
+// sells the given quantities of books all at once, or none of them if any
+// of the books cannot be found or has fewer pieces in stock than the sales
+// take of it in total, setting *failed to the first sale that cannot be
+// made; the whole sale goes into the journal as a single record, which
+// gets committed right away (a bookstore tracking its changes waits for a
+// checkpoint under way to finish writing its journal first, and its next
+// checkpoint saves the books sold once more)
+bool bookstore_sell_batch(bookstore_t* store, const book_sale_t* sales, const unsigned int num_sales,
+        unsigned int* failed);
+
+// same as bookstore_sell_batch(), the books being sold at the given time
+// (as in book_sell_at())
+bool bookstore_sell_batch_at(bookstore_t* store, const book_sale_t* sales, const unsigned int num_sales,
+        const int64_t when, unsigned int* failed);
+
 // adds a given quantity of a book to stock
 void book_stock(book_t* book, const unsigned int qty);
 
 // changes the price of a book
 void book_change_price(book_t* book, const double price);
 
+// sets all the numbers of a book at once, as replaying a journal does
+void book_restore(book_t* book, const unsigned int stocked_qty, const unsigned int sold_qty,
+        const double price);
+
 // prints the book's details
 void book_print(const book_t* book);
 
+// prints the book's details into an open file
+void book_fprint(const book_t* book, FILE* fd);
+
 // prints the number of books in store, plus details of all the books
 void bookstore_print(const bookstore_t* store);
 
 // sorts an awway of books by their sold quantity, ascending
 void books_sort_by_sold_qty(book_t** books, const unsigned int num_books);
 
+// stores (at most) the top N bestsellers into out, best first, with ties
+// going to the book added earlier; returns the number of books stored
+// and leaves the bookstore as it was
+unsigned int bookstore_top_sellers(const bookstore_t* store, unsigned int howmany, book_t** out);
+
+// stores (at most) the top N books sold within a window of the bookstore's
+// ledger into out, best first, with ties going to the book added earlier,
+// and the units of them sold within it into qty; goes through the books
+// sold within the last week only, and returns the number of books stored
+unsigned int bookstore_window_top_sellers(const bookstore_t* store, const ledger_window_t window,
+        unsigned int howmany, book_t** out, unsigned int* qty);
+
 // prints top N bestsellers from the bookstore
-void bookstore_get_bestsellers(bookstore_t* store, unsigned int howmany);
+void bookstore_get_bestsellers(const bookstore_t* store, unsigned int howmany);
 
 // prints sold-out books in the bookstore
 void bookstore_get_sold_out(const bookstore_t* store);
 
-// releases the memory allocated to a book
+// sums up the sold quantities and revenue of all books in the bookstore
+void bookstore_sales_totals(const bookstore_t* store, uint64_t* units_sold, double* revenue);
+
+// sums up the stocked quantities and their value for all books in the bookstore
+void bookstore_stock_totals(const bookstore_t* store, uint64_t* units_in_stock, double* value);
+
+// recomputes the bookstore totals from scratch and checks they match the
+// running ones
+bool bookstore_check_totals(const bookstore_t* store);
+
+// releases the memory allocated to a book (once no snapshot sees it anymore,
+// if it was removed from a bookstore while one could)
 void book_free(book_t* book);
 
-// releases the memory allocated to a bookstore and all the books in it
+// releases the memory allocated to a bookstore and all the books in it,
+// after waiting for its background save and snapshots to be done
 void bookstore_free(bookstore_t* store);
 
 #endif
@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <ctype.h>
 #include "buffer.h"
+#include "lz.h"
+
+#define BUF_MIN_CAPACITY 64
 
 
 buffer_t* buf_init(void) {
@@ -12,12 +15,60 @@ buffer_t* buf_init(void) {
 
     buf->pivot = 0;
     buf->size = 0;
-    buf->bytes = malloc(0);
+    buf->capacity = 0;
+    buf->bytes = NULL;
+    buf->sink = NULL;
+    buf->sink_failed = false;
+    buf->sink_compressed = false;
+
+    return buf;
+}
+
+buffer_t* buf_init_sink(FILE* fd, const size_t chunk_size) {
+    buffer_t* buf = buf_init();
+    buf->bytes = malloc(chunk_size);
     if (buf->bytes == NULL) exit(errno);
+    buf->capacity = chunk_size;
+    buf->sink = fd;
+    return buf;
+}
 
+buffer_t* buf_init_compressed_sink(FILE* fd, const size_t chunk_size) {
+    buffer_t* buf = buf_init_sink(fd, chunk_size);
+    buf->sink_compressed = true;
     return buf;
 }
 
+// writes bytes straight into the sink of a buffer
+static void buf_sink_write(buffer_t* buf, const void* bytes, const size_t length) {
+    if (length > 0 && fwrite(bytes, 1, length, buf->sink) != length)
+        buf->sink_failed = true;
+}
+
+// compresses a chunk and writes it out as a block
+static void buf_sink_write_block(buffer_t* buf, const void* bytes, const size_t length) {
+    char* compressed = malloc(LZ_BOUND(length));
+    if (compressed == NULL) exit(errno);
+    size_t stored = lz_compress(bytes, length, compressed);
+    uint32_t sizes[2] = {(uint32_t) length, (uint32_t) length};
+    if (stored < length)
+        sizes[1] = (uint32_t) stored;
+    buf_sink_write(buf, sizes, sizeof(sizes));
+    buf_sink_write(buf, (stored < length) ? compressed : bytes, sizes[1]);
+    free(compressed);
+}
+
+bool buf_flush(buffer_t* buf) {
+    if (buf->sink == NULL)
+        return true;
+    if (buf->sink_compressed && buf->pivot > 0)
+        buf_sink_write_block(buf, buf->bytes, buf->pivot);
+    else if (!buf->sink_compressed)
+        buf_sink_write(buf, buf->bytes, buf->pivot);
+    buf->pivot = buf->size = 0;
+    return !buf->sink_failed;
+}
+
 buffer_t* buf_init_from_fd(FILE* fd) {
     fseek(fd, 0, SEEK_END);
     size_t len = (size_t) ftell(fd);
@@ -28,6 +79,10 @@ buffer_t* buf_init_from_fd(FILE* fd) {
 
     buf->pivot = 0;
     buf->size = len;
+    buf->capacity = len;
+    buf->sink = NULL;
+    buf->sink_failed = false;
+    buf->sink_compressed = false;
     buf->bytes = malloc(len);
     if (buf->bytes == NULL) exit(errno);
 
@@ -86,17 +141,76 @@ void buf_rewind(buffer_t* buf) {
 
 void buf_extend(buffer_t* buf, const size_t size) {
     buf->size += size;
+    if (buf->size <= buf->capacity)
+        return;
+
+    size_t capacity = buf->capacity < BUF_MIN_CAPACITY ? BUF_MIN_CAPACITY : buf->capacity;
+    while (capacity < buf->size)
+        capacity *= 2;
+    buf_reserve(buf, capacity);
+}
+
+void buf_reserve(buffer_t* buf, const size_t capacity) {
+    if (capacity <= buf->capacity || buf->sink != NULL)
+        return;
+    buf->bytes = realloc(buf->bytes, capacity);
+    if (buf->bytes == NULL) exit(errno);
+    buf->capacity = capacity;
+}
+
+void buf_shrink(buffer_t* buf) {
+    if (buf->size == buf->capacity || buf->size == 0)
+        return;
     buf->bytes = realloc(buf->bytes, buf->size);
     if (buf->bytes == NULL) exit(errno);
+    buf->capacity = buf->size;
 }
 
 void buf_write(buffer_t* buf, const void* bytes, const size_t length) {
+    if (buf->sink != NULL && buf->pivot + length > buf->capacity) {
+        buf_flush(buf);
+        // anything that would not fit even into an empty chunk goes out as
+        // is, or as a series of full blocks when compressing
+        if (length > buf->capacity && !buf->sink_compressed) {
+            buf_sink_write(buf, bytes, length);
+            return;
+        }
+        if (length > buf->capacity) {
+            size_t done = 0;
+            for (; length - done > buf->capacity; done += buf->capacity)
+                buf_sink_write_block(buf, (const char*) bytes + done, buf->capacity);
+            buf_write(buf, (const char*) bytes + done, length - done);
+            return;
+        }
+    }
     if (buf->size - buf->pivot < length)
         buf_extend(buf, length - (buf->size - buf->pivot));
     memcpy((char*) buf->bytes + buf->pivot, bytes, length);
     buf->pivot += length;
 }
 
+void buf_write_varint(buffer_t* buf, uint64_t value) {
+    unsigned char bytes[10];
+    size_t len = 0;
+    while (value >= 0x80) {
+        bytes[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    bytes[len++] = (unsigned char) value;
+    buf_write(buf, bytes, len);
+}
+
+bool buf_read_varint(buffer_t* buf, uint64_t* value) {
+    *value = 0;
+    for (unsigned int shift=0; shift<64 && buf->pivot < buf->size; shift += 7) {
+        unsigned char byte = ((unsigned char*) buf->bytes)[buf->pivot++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
 void buf_readbytes(buffer_t* buf, void* dest, const size_t length) {
     memcpy(dest, (char*) buf->bytes + buf->pivot, length);
     buf->pivot += length;
@@ -112,6 +226,12 @@ char* buf_readstr(buffer_t* buf) {
     return ret;
 }
 
+const char* buf_skipstr(buffer_t* buf) {
+    const char* ret = (char*) buf->bytes + buf->pivot;
+    buf->pivot += strlen(ret) + 1;
+    return ret;
+}
+
 void buf_free(buffer_t* buf) {
     free(buf->bytes);
     buf->bytes = NULL;
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 
 /*
@@ -12,7 +14,11 @@
 typedef struct buffer_struct {
     size_t pivot;
     size_t size;
+    size_t capacity; // number of bytes allocated, always >= size
     void* bytes;
+    FILE* sink; // if set, the buffer holds one chunk and writes it out when full
+    bool sink_failed; // whether writing to the sink has failed
+    bool sink_compressed; // whether chunks are written out as compressed blocks
 } buffer_t;
 
 
@@ -23,6 +29,19 @@ typedef struct buffer_struct {
 // allocates a new empty buffer
 buffer_t* buf_init(void);
 
+// allocates a new empty buffer which writes its contents to an open file
+// whenever chunk_size bytes of it fill up, so it never grows past that
+buffer_t* buf_init_sink(FILE* fd, const size_t chunk_size);
+
+// same as buf_init_sink(), but every chunk gets compressed and written out
+// as a block: its size, the size of the stored data (equal to the former
+// if the chunk did not compress) and the stored data
+buffer_t* buf_init_compressed_sink(FILE* fd, const size_t chunk_size);
+
+// writes out whatever a sink buffer still holds,
+// returns false if any of the writes to its file failed
+bool buf_flush(buffer_t* buf);
+
 // creates a new buffer and reads data from an open file into it
 buffer_t* buf_init_from_fd(FILE* fd);
 
@@ -32,13 +51,28 @@ void buf_print(buffer_t* buf);
 // resets the buffer pivot back to the beginning
 void buf_rewind(buffer_t* buf);
 
-// increases buffer length by specified size
+// increases buffer length by specified size,
+// growing the allocation geometrically when it runs out
 void buf_extend(buffer_t* buf, const size_t size);
 
+// makes sure the buffer can hold at least capacity bytes without reallocating
+// (sink buffers never grow, so it does nothing for them)
+void buf_reserve(buffer_t* buf, const size_t capacity);
+
+// releases allocated memory beyond the buffer length
+void buf_shrink(buffer_t* buf);
+
 // writes length bytes into the buffer,
 // starting from buf->bytes[buf->pivot]
 void buf_write(buffer_t* buf, const void* bytes, const size_t length);
 
+// writes an unsigned integer in as few bytes as it takes, seven bits per byte
+void buf_write_varint(buffer_t* buf, uint64_t value);
+
+// reads an integer written by buf_write_varint(),
+// returns false if the buffer ends before it does
+bool buf_read_varint(buffer_t* buf, uint64_t* value);
+
 // reads length bytes from the buffer into dest,
 // starting from buf->bytes[buf->pivot]
 void buf_readbytes(buffer_t* buf, void* dest, const size_t length);
@@ -47,6 +81,10 @@ void buf_readbytes(buffer_t* buf, void* dest, const size_t length);
 // from the buffer, starting from buf->bytes[buf->pivot]
 char* buf_readstr(buffer_t* buf);
 
+// returns the null-terminated string starting at buf->bytes[buf->pivot]
+// without copying it and moves the pivot past it
+const char* buf_skipstr(buffer_t* buf);
+
 // deallocates the buffer
 void buf_free(buffer_t* buf);
 
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "import.h"
+
+
+// uses tabs if the first line has any, commas otherwise
+static char import_delimiter(const char* pos, const char* end) {
+    const char* eol = memchr(pos, '\n', (size_t) (end - pos));
+    if (eol == NULL)
+        eol = end;
+    return memchr(pos, '\t', (size_t) (eol - pos)) != NULL ? '\t' : ',';
+}
+
+// upper bound of the number of rows, used to presize the bookstore
+static unsigned int import_count_lines(const char* pos, const char* end) {
+    unsigned int ret = 1;
+    while ((pos = memchr(pos, '\n', (size_t) (end - pos))) != NULL) {
+        ret++;
+        pos++;
+    }
+    return ret;
+}
+
+// copies the field starting at *pos into the scratch buffer as a
+// null-terminated string and moves past it; returns the delimiter that
+// ended the field, or '\n' at the end of a row (or of the input)
+static char import_field(const char** pos, const char* end, const char delim, buffer_t* scratch) {
+    const char* c = *pos;
+    char ret = '\n';
+
+    if (c < end && *c == '"') {
+        // quoted: runs up to a lone quote, "" stands for a quote
+        c++;
+        while (c < end) {
+            const char* quote = memchr(c, '"', (size_t) (end - c));
+            if (quote == NULL)
+                quote = end;
+            buf_write(scratch, c, (size_t) (quote - c));
+            c = quote + 1;
+            if (c < end && *c == '"') {
+                buf_write(scratch, "\"", 1);
+                c++;
+            } else {
+                break;
+            }
+        }
+    }
+
+    // unquoted (or whatever follows the closing quote)
+    const char* start = c;
+    while (c < end && *c != delim && *c != '\n')
+        c++;
+    const char* stop = c;
+    if (stop > start && stop[-1] == '\r')
+        stop--;
+    buf_write(scratch, start, (size_t) (stop - start));
+    buf_write(scratch, "", 1);
+
+    if (c < end) {
+        ret = *c;
+        c++;
+    }
+    *pos = (c > end) ? end : c;
+    return ret;
+}
+
+// reads one row into the scratch buffer, storing the offset of each of its
+// first IMPORT_NUM_FIELDS fields; returns the number of fields in the row
+static unsigned int import_row(const char** pos, const char* end, const char delim,
+        buffer_t* scratch, size_t* offsets) {
+    unsigned int ret = 0;
+    scratch->pivot = scratch->size = 0;
+    char term;
+    do {
+        size_t start = scratch->pivot;
+        term = import_field(pos, end, delim, scratch);
+        if (ret < IMPORT_NUM_FIELDS)
+            offsets[ret] = start;
+        ret++;
+    } while (term == delim);
+    return ret;
+}
+
+static bool parse_qty(const char* str, unsigned int* qty) {
+    char* end;
+    if (*str < '0' || *str > '9')
+        return false;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (*end != '\0' || errno != 0 || value > UINT_MAX)
+        return false;
+    *qty = (unsigned int) value;
+    return true;
+}
+
+bool import_parse_price(const char* str, double* price) {
+    char* end;
+    if (*str == '\0')
+        return false;
+    *price = strtod(str, &end);
+    return *end == '\0' && isfinite(*price) && *price >= 0;
+}
+
+static void import_error(import_stats_t* stats, const unsigned int row, const char* reason) {
+    if (stats->num_skipped < IMPORT_MAX_ERRORS)
+        printf("Row %u: %s, skipping!\n", row, reason);
+    else if (stats->num_skipped == IMPORT_MAX_ERRORS)
+        printf("Too many malformed rows, not reporting any more of them.\n");
+    stats->num_skipped++;
+}
+
+bool bookstore_import(bookstore_t* store, const char* filename, import_stats_t* stats) {
+    memset(stats, 0, sizeof(import_stats_t));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char* pos = map;
+    const char* end = map + size;
+    char delim = import_delimiter(pos, end);
+    buffer_t* scratch = buf_init();
+    buf_reserve(scratch, 256);
+    size_t offsets[IMPORT_NUM_FIELDS];
+    unsigned int row = 0;
+
+    bookstore_begin_bulk(store, import_count_lines(pos, end));
+    while (pos < end) {
+        unsigned int num_fields = import_row(&pos, end, delim, scratch, offsets);
+        const char* bytes = scratch->bytes;
+        row++;
+        if (num_fields == 1 && bytes[0] == '\0')
+            continue;
+
+        const char* fields[IMPORT_NUM_FIELDS];
+        unsigned int stocked_qty, sold_qty;
+        double price;
+        for (unsigned int i=0; i<IMPORT_NUM_FIELDS && i<num_fields; i++)
+            fields[i] = bytes + offsets[i];
+        if (num_fields == IMPORT_NUM_FIELDS && row == 1 && !parse_qty(fields[4], &stocked_qty))
+            continue; // header
+
+        stats->num_rows++;
+        if (num_fields != IMPORT_NUM_FIELDS) {
+            import_error(stats, row, "wrong number of fields");
+        } else if (fields[0][0] == '\0') {
+            import_error(stats, row, "missing ISBN");
+        } else if (!parse_qty(fields[4], &stocked_qty) || !parse_qty(fields[5], &sold_qty)
+                || !import_parse_price(fields[6], &price)) {
+            import_error(stats, row, "malformed quantity or price");
+        } else if (book_find(store, fields[0]) != NULL) {
+            import_error(stats, row, "duplicate ISBN");
+        } else {
+            bookstore_add_book(store, bookstore_new_book(store, fields[0], fields[1],
+                        fields[2], fields[3], stocked_qty, sold_qty, price));
+            stats->num_imported++;
+        }
+    }
+    bookstore_end_bulk(store);
+
+    buf_free(scratch);
+    munmap(map, size);
+    return true;
+}
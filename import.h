@@ -0,0 +1,38 @@
+#ifndef __IMPORT_H__
+#define __IMPORT_H__
+#include <stdbool.h>
+#include "bookstore.h"
+
+// number of fields in an imported row, in the order "bookadd" takes them
+#define IMPORT_NUM_FIELDS 7
+
+// only this many malformed rows get reported, the rest are skipped silently
+#define IMPORT_MAX_ERRORS 10
+
+
+/*
+ * structs
+ */
+
+typedef struct import_stats_struct {
+    unsigned int num_rows; // data rows read, not counting a header or blank lines
+    unsigned int num_imported;
+    unsigned int num_skipped; // malformed rows and duplicate ISBNs
+} import_stats_t;
+
+
+/*
+ * function prototypes
+ */
+
+// imports books from a comma- or tab-separated file with one book per row
+// (isbn, title, author, genre, stocked_qty, sold_qty, price), optionally
+// preceded by a header row; fields may be quoted, with "" standing for a
+// quote inside them; returns false if the file cannot be read
+bool bookstore_import(bookstore_t* store, const char* filename, import_stats_t* stats);
+
+// parses a price, which has to be a finite non-negative number, the way
+// both imported rows and the commands taking one read it
+bool import_parse_price(const char* str, double* price);
+
+#endif
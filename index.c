@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "index.h"
+#include "bookstore.h"
+
+#define ISBN_INDEX_MIN_SLOTS 16
+
+// the table is grown once it gets more than 70% full
+#define ISBN_INDEX_FULL(used, slots) ((used) * 10 >= (slots) * 7)
+
+
+static void isbn_index_rehash(isbn_index_t* idx, const size_t num_slots);
+
+
+size_t str_hash(const char* str) {
+    size_t hash = (size_t) 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*) str; *c; c++) {
+        hash ^= *c;
+        hash *= (size_t) 1099511628211ULL;
+    }
+    return hash;
+}
+
+isbn_index_t* isbn_index_init(void) {
+    isbn_index_t* ret = malloc(sizeof(isbn_index_t));
+    if (ret == NULL) exit(errno);
+    ret->num_slots = 0;
+    ret->num_used = 0;
+    ret->slots = NULL;
+    return ret;
+}
+
+static void isbn_index_rehash(isbn_index_t* idx, const size_t num_slots) {
+    isbn_slot_t* old_slots = idx->slots;
+    size_t old_num_slots = idx->num_slots;
+
+    idx->slots = calloc(num_slots, sizeof(isbn_slot_t));
+    if (idx->slots == NULL) exit(errno);
+    idx->num_slots = num_slots;
+
+    size_t mask = num_slots - 1;
+    for (size_t i=0; i<old_num_slots; i++) {
+        if (old_slots[i].book == NULL)
+            continue;
+        size_t j = old_slots[i].hash & mask;
+        while (idx->slots[j].book != NULL)
+            j = (j + 1) & mask;
+        idx->slots[j] = old_slots[i];
+    }
+
+    free(old_slots);
+}
+
+void isbn_index_reserve(isbn_index_t* idx, const size_t num_books) {
+    size_t num_slots = idx->num_slots ? idx->num_slots : ISBN_INDEX_MIN_SLOTS;
+    while (ISBN_INDEX_FULL(num_books + 1, num_slots))
+        num_slots *= 2;
+    if (num_slots != idx->num_slots)
+        isbn_index_rehash(idx, num_slots);
+}
+
+void isbn_index_insert(isbn_index_t* idx, book_t* book) {
+    isbn_index_insert_hashed(idx, book, str_hash(book->isbn));
+}
+
+void isbn_index_insert_hashed(isbn_index_t* idx, book_t* book, const size_t hash) {
+    isbn_index_reserve(idx, idx->num_used + 1);
+
+    size_t mask = idx->num_slots - 1;
+    size_t i = hash & mask;
+    while (idx->slots[i].book != NULL)
+        i = (i + 1) & mask;
+    idx->slots[i].hash = hash;
+    idx->slots[i].book = book;
+    idx->num_used++;
+}
+
+void isbn_index_remove(isbn_index_t* idx, const book_t* book) {
+    if (idx->num_slots == 0)
+        return;
+
+    size_t mask = idx->num_slots - 1;
+    size_t i = str_hash(book->isbn) & mask;
+    while (idx->slots[i].book != book) {
+        if (idx->slots[i].book == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // backward-shift deletion: pull up every following entry of the
+    // probe run that is allowed to live in the freed slot, so that
+    // lookups never need tombstones
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (idx->slots[j].book == NULL)
+            break;
+        size_t home = idx->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            idx->slots[i] = idx->slots[j];
+            i = j;
+        }
+    }
+    idx->slots[i].book = NULL;
+    idx->num_used--;
+}
+
+void isbn_index_replace(isbn_index_t* idx, const book_t* book, book_t* copy) {
+    if (idx->num_slots == 0)
+        return;
+
+    size_t mask = idx->num_slots - 1;
+    size_t i = str_hash(book->isbn) & mask;
+    while (idx->slots[i].book != book) {
+        if (idx->slots[i].book == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    idx->slots[i].book = copy;
+}
+
+book_t* isbn_index_find(const isbn_index_t* idx, const char* isbn) {
+    if (idx->num_slots == 0)
+        return (book_t*) NULL;
+
+    size_t hash = str_hash(isbn);
+    size_t mask = idx->num_slots - 1;
+    for (size_t i = hash & mask; idx->slots[i].book != NULL; i = (i + 1) & mask) {
+        if (idx->slots[i].hash == hash && strcmp(idx->slots[i].book->isbn, isbn) == 0)
+            return idx->slots[i].book;
+    }
+
+    return (book_t*) NULL;
+}
+
+void isbn_index_free(isbn_index_t* idx) {
+    free(idx->slots);
+    idx->slots = NULL;
+    free(idx);
+    idx = NULL;
+}
+
+static unsigned int posting_key(const posting_index_t* idx, const book_t* book) {
+    switch (idx->field) {
+        case BOOK_FIELD_AUTHOR:
+            return book->author_id;
+        case BOOK_FIELD_GENRE:
+            return book->genre_id;
+        case BOOK_FIELD_PRICE:
+        case BOOK_FIELD_STOCKED_QTY:
+        default:
+            exit(EINVAL);
+    }
+}
+
+static unsigned int posting_pos(const posting_index_t* idx, const book_t* book) {
+    switch (idx->field) {
+        case BOOK_FIELD_AUTHOR:
+            return book->author_pos;
+        case BOOK_FIELD_GENRE:
+            return book->genre_pos;
+        case BOOK_FIELD_PRICE:
+        case BOOK_FIELD_STOCKED_QTY:
+        default:
+            exit(EINVAL);
+    }
+}
+
+static void posting_set_pos(const posting_index_t* idx, book_t* book, const unsigned int pos) {
+    switch (idx->field) {
+        case BOOK_FIELD_AUTHOR:
+            book->author_pos = pos;
+            break;
+        case BOOK_FIELD_GENRE:
+            book->genre_pos = pos;
+            break;
+        case BOOK_FIELD_PRICE:
+        case BOOK_FIELD_STOCKED_QTY:
+        default:
+            exit(EINVAL);
+    }
+}
+
+posting_index_t* posting_index_init(const book_field_t field) {
+    posting_index_t* ret = malloc(sizeof(posting_index_t));
+    if (ret == NULL) exit(errno);
+    ret->field = field;
+    ret->num_lists = 0;
+    ret->lists = NULL;
+    return ret;
+}
+
+// makes sure there is a posting list for the given key
+static void posting_index_grow(posting_index_t* idx, const unsigned int key) {
+    if (key < idx->num_lists)
+        return;
+    unsigned int num_lists = idx->num_lists ? idx->num_lists : 64;
+    while (num_lists <= key)
+        num_lists *= 2;
+    idx->lists = realloc(idx->lists, num_lists * sizeof(posting_list_t));
+    if (idx->lists == NULL) exit(errno);
+    memset(&(idx->lists[idx->num_lists]), 0,
+            (num_lists - idx->num_lists) * sizeof(posting_list_t));
+    idx->num_lists = num_lists;
+}
+
+void posting_index_insert(posting_index_t* idx, book_t* book) {
+    unsigned int key = posting_key(idx, book);
+    posting_index_grow(idx, key);
+
+    posting_list_t* list = &(idx->lists[key]);
+    if (list->num_books == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->books = realloc(list->books, list->capacity * sizeof(book_t*));
+        if (list->books == NULL) exit(errno);
+    }
+    posting_set_pos(idx, book, list->num_books);
+    list->books[list->num_books++] = book;
+}
+
+void posting_index_insert_all(posting_index_t* idx, book_t** books, const unsigned int num_books) {
+    // count the books per key first, so that every posting list gets
+    // allocated once and at its final size
+    unsigned int max_key = 0;
+    for (unsigned int i=0; i<num_books; i++) {
+        unsigned int key = posting_key(idx, books[i]);
+        if (key > max_key)
+            max_key = key;
+    }
+    if (num_books > 0)
+        posting_index_grow(idx, max_key);
+
+    unsigned int* counts = calloc((size_t) max_key + 1, sizeof(unsigned int));
+    if (counts == NULL) exit(errno);
+    for (unsigned int i=0; i<num_books; i++)
+        counts[posting_key(idx, books[i])]++;
+    for (unsigned int key=0; num_books > 0 && key<=max_key; key++) {
+        posting_list_t* list = &(idx->lists[key]);
+        if (counts[key] == 0 || list->num_books + counts[key] <= list->capacity)
+            continue;
+        list->capacity = list->num_books + counts[key];
+        list->books = realloc(list->books, list->capacity * sizeof(book_t*));
+        if (list->books == NULL) exit(errno);
+    }
+    free(counts);
+
+    for (unsigned int i=0; i<num_books; i++)
+        posting_index_insert(idx, books[i]);
+}
+
+void posting_index_remove(posting_index_t* idx, const book_t* book) {
+    unsigned int key = posting_key(idx, book);
+    if (key >= idx->num_lists)
+        return;
+
+    posting_list_t* list = &(idx->lists[key]);
+    unsigned int pos = posting_pos(idx, book);
+    if (pos >= list->num_books || list->books[pos] != book)
+        return;
+
+    list->books[pos] = NULL;
+    list->num_removed++;
+    // the NULLs at the end are dropped right away, the rest once they
+    // would otherwise take up half of the list
+    while (list->num_books > 0 && list->books[list->num_books - 1] == NULL) {
+        list->num_books--;
+        list->num_removed--;
+    }
+    if (list->num_removed * 2 >= list->num_books && list->num_removed > 0) {
+        unsigned int kept = 0;
+        for (unsigned int i=0; i<list->num_books; i++) {
+            if (list->books[i] == NULL)
+                continue;
+            posting_set_pos(idx, list->books[i], kept);
+            list->books[kept++] = list->books[i];
+        }
+        list->num_books = kept;
+        list->num_removed = 0;
+    }
+
+    if (list->num_books == 0) {
+        free(list->books);
+        list->books = NULL;
+        list->capacity = 0;
+    }
+}
+
+void posting_index_replace(posting_index_t* idx, const book_t* book, book_t* copy) {
+    unsigned int key = posting_key(idx, book);
+    if (key >= idx->num_lists)
+        return;
+
+    posting_list_t* list = &(idx->lists[key]);
+    unsigned int pos = posting_pos(idx, book);
+    if (pos < list->num_books && list->books[pos] == book)
+        list->books[pos] = copy;
+}
+
+posting_list_t* posting_index_find(const posting_index_t* idx, const unsigned int key_id) {
+    if (key_id >= idx->num_lists || idx->lists[key_id].num_books == idx->lists[key_id].num_removed)
+        return (posting_list_t*) NULL;
+    return &(idx->lists[key_id]);
+}
+
+void posting_index_free(posting_index_t* idx) {
+    for (unsigned int i=0; i<idx->num_lists; i++)
+        free(idx->lists[i].books);
+    free(idx->lists);
+    idx->lists = NULL;
+    free(idx);
+    idx = NULL;
+}
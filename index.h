@@ -0,0 +1,108 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+#include <stddef.h>
+
+struct book_struct;
+
+
+/*
+ * structs
+ */
+
+typedef struct isbn_slot_struct {
+    size_t hash;
+    struct book_struct* book;
+} isbn_slot_t;
+
+// open-addressing (linear probing) hash table of books keyed by ISBN
+typedef struct isbn_index_struct {
+    size_t num_slots; // always a power of two
+    size_t num_used;
+    isbn_slot_t* slots;
+} isbn_index_t;
+
+// book attribute an index is keyed by, the first ones being interned
+// strings (for posting indexes), the rest numbers (for ordered indexes)
+typedef enum book_field_enum {
+    BOOK_FIELD_AUTHOR,
+    BOOK_FIELD_GENRE,
+    BOOK_FIELD_PRICE,
+    BOOK_FIELD_STOCKED_QTY
+} book_field_t;
+
+// all books sharing one key, in the order they were added; a book removed
+// leaves a NULL behind, which gets squeezed out with the others once they
+// make up half of the list
+typedef struct posting_list_struct {
+    unsigned int num_books; // including the NULLs
+    unsigned int num_removed; // NULLs among the books
+    unsigned int capacity;
+    struct book_struct** books;
+} posting_list_t;
+
+// inverted index for one (interned) book attribute: one posting list per
+// interned string id; every indexed book remembers its position within
+// its posting list
+typedef struct posting_index_struct {
+    book_field_t field;
+    unsigned int num_lists;
+    posting_list_t* lists; // indexed by the intern id of the key
+} posting_index_t;
+
+/*
+ * function prototypes
+ */
+
+// hashes a null-terminated string (FNV-1a)
+size_t str_hash(const char* str);
+
+// allocates a new empty ISBN index
+isbn_index_t* isbn_index_init(void);
+
+// makes room for at least num_books entries without further rehashing
+void isbn_index_reserve(isbn_index_t* idx, const size_t num_books);
+
+// inserts a book into the index
+void isbn_index_insert(isbn_index_t* idx, struct book_struct* book);
+
+// inserts a book whose ISBN has already been hashed with str_hash()
+void isbn_index_insert_hashed(isbn_index_t* idx, struct book_struct* book, const size_t hash);
+
+// removes a book (compared by identity, not by ISBN) from the index
+void isbn_index_remove(isbn_index_t* idx, const struct book_struct* book);
+
+// puts a copy of a book (with the same ISBN) where the book was
+void isbn_index_replace(isbn_index_t* idx, const struct book_struct* book, struct book_struct* copy);
+
+// finds a book by its ISBN, returns NULL if there is none
+struct book_struct* isbn_index_find(const isbn_index_t* idx, const char* isbn);
+
+// deallocates the index (but not the books in it)
+void isbn_index_free(isbn_index_t* idx);
+
+// allocates a new empty posting index over the given book attribute
+posting_index_t* posting_index_init(const book_field_t field);
+
+// appends a book to the posting list of its key
+void posting_index_insert(posting_index_t* idx, struct book_struct* book);
+
+// appends many books to the posting lists of their keys, sizing each list
+// just once
+void posting_index_insert_all(posting_index_t* idx, struct book_struct** books,
+        const unsigned int num_books);
+
+// removes a book from the posting list of its key, keeping the order
+// of the remaining books (in amortized constant time)
+void posting_index_remove(posting_index_t* idx, const struct book_struct* book);
+
+// puts a copy of a book (with the same key and position) where the book was
+void posting_index_replace(posting_index_t* idx, const struct book_struct* book,
+        struct book_struct* copy);
+
+// finds the posting list of an interned key, returns NULL if no book has it
+posting_list_t* posting_index_find(const posting_index_t* idx, const unsigned int key_id);
+
+// deallocates the index (but not the books in it)
+void posting_index_free(posting_index_t* idx);
+
+#endif
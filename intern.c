@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "intern.h"
+#include "index.h"
+
+#define INTERN_MIN_SLOTS 64
+
+
+intern_table_t* intern_init(arena_t* arena) {
+    intern_table_t* ret = malloc(sizeof(intern_table_t));
+    if (ret == NULL) exit(errno);
+    ret->num_entries = 0;
+    ret->capacity = 0;
+    ret->entries = NULL;
+    ret->num_slots = 0;
+    ret->slots = NULL;
+    ret->arena = arena;
+    return ret;
+}
+
+static void intern_rehash(intern_table_t* table, const size_t num_slots) {
+    free(table->slots);
+    table->slots = calloc(num_slots, sizeof(unsigned int));
+    if (table->slots == NULL) exit(errno);
+    table->num_slots = num_slots;
+
+    size_t mask = num_slots - 1;
+    for (unsigned int id=0; id<table->num_entries; id++) {
+        size_t i = table->entries[id].hash & mask;
+        while (table->slots[i] != 0)
+            i = (i + 1) & mask;
+        table->slots[i] = id + 1;
+    }
+}
+
+// returns the slot holding str, or the empty slot it would be inserted into
+static size_t intern_probe(const intern_table_t* table, const char* str, const size_t hash) {
+    size_t mask = table->num_slots - 1;
+    size_t i = hash & mask;
+    while (table->slots[i] != 0) {
+        const intern_entry_t* entry = &(table->entries[table->slots[i] - 1]);
+        if (entry->hash == hash && strcmp(entry->str, str) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// looks str up, inserting either a copy of it or the borrowed string
+static unsigned int intern_insert(intern_table_t* table, const char* str, char* borrowed) {
+    // keep the table at most half full
+    if (table->num_slots == 0)
+        intern_rehash(table, INTERN_MIN_SLOTS);
+    else if ((size_t) table->num_entries * 2 >= table->num_slots)
+        intern_rehash(table, table->num_slots * 2);
+
+    size_t hash = str_hash(str);
+    size_t i = intern_probe(table, str, hash);
+    if (table->slots[i] != 0)
+        return table->slots[i] - 1;
+
+    if (table->num_entries == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 64;
+        table->entries = realloc(table->entries, table->capacity * sizeof(intern_entry_t));
+        if (table->entries == NULL) exit(errno);
+    }
+
+    intern_entry_t* entry = &(table->entries[table->num_entries]);
+    if (borrowed == NULL) {
+        size_t len = strlen(str) + 1;
+        entry->str = memcpy(arena_alloc(table->arena, len), str, len);
+    } else {
+        entry->str = borrowed;
+    }
+    entry->hash = hash;
+    table->slots[i] = ++table->num_entries;
+    return table->num_entries - 1;
+}
+
+unsigned int intern_str(intern_table_t* table, const char* str) {
+    return intern_insert(table, str, NULL);
+}
+
+unsigned int intern_borrow(intern_table_t* table, char* str) {
+    return intern_insert(table, str, str);
+}
+
+unsigned int intern_find(const intern_table_t* table, const char* str) {
+    if (table->num_slots == 0)
+        return INTERN_NONE;
+    size_t i = intern_probe(table, str, str_hash(str));
+    return table->slots[i] ? table->slots[i] - 1 : INTERN_NONE;
+}
+
+char* intern_get(const intern_table_t* table, const unsigned int id) {
+    return table->entries[id].str;
+}
+
+void intern_free(intern_table_t* table) {
+    free(table->entries);
+    table->entries = NULL;
+    free(table->slots);
+    table->slots = NULL;
+    free(table);
+    table = NULL;
+}
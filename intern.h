@@ -0,0 +1,56 @@
+#ifndef __INTERN_H__
+#define __INTERN_H__
+#include <stddef.h>
+#include "arena.h"
+
+// id returned by intern_find() for strings that are not in the table
+#define INTERN_NONE ((unsigned int) -1)
+
+
+/*
+ * structs
+ */
+
+typedef struct intern_entry_struct {
+    char* str;
+    size_t hash;
+} intern_entry_t;
+
+// set of canonical string copies, each identified by a dense integer id;
+// equal strings interned into the same table share one copy, so they can
+// be compared by pointer (or id) instead of strcmp()
+typedef struct intern_table_struct {
+    unsigned int num_entries;
+    unsigned int capacity;
+    intern_entry_t* entries; // indexed by id, entries are never removed
+    size_t num_slots; // always a power of two
+    unsigned int* slots; // entry id + 1, zero marks an empty slot
+    arena_t* arena; // where the canonical copies are allocated
+} intern_table_t;
+
+
+/*
+ * function prototypes
+ */
+
+// allocates a new empty intern table, copying strings into the given arena
+intern_table_t* intern_init(arena_t* arena);
+
+// returns the id of the canonical copy of str, copying it into the table
+// if it is not there yet
+unsigned int intern_str(intern_table_t* table, const char* str);
+
+// like intern_str(), but a new string becomes the canonical copy itself
+// instead of being copied, so it has to outlive the table
+unsigned int intern_borrow(intern_table_t* table, char* str);
+
+// returns the id of str, or INTERN_NONE if it has not been interned
+unsigned int intern_find(const intern_table_t* table, const char* str);
+
+// returns the canonical copy of an interned string
+char* intern_get(const intern_table_t* table, const unsigned int id);
+
+// deallocates the table (the canonical copies go away with its arena)
+void intern_free(intern_table_t* table);
+
+#endif
@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "bookstore.h"
+#include "metrics.h"
+
+// op byte plus payload length
+#define JOURNAL_RECORD_HEADER (1 + sizeof(uint32_t))
+
+
+static uint32_t journal_checksum(const char* bytes, const size_t length) {
+    uint32_t hash = 2166136261U;
+    for (size_t i=0; i<length; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint64_t file_size(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        return 0;
+    return (uint64_t) st.st_size;
+}
+
+char* journal_path(const char* snapshot) {
+    char* ret = malloc(strlen(snapshot) + sizeof(".journal"));
+    if (ret == NULL) exit(errno);
+    strcpy(ret, snapshot);
+    strcat(ret, ".journal");
+    return ret;
+}
+
+// reads a journal file, returns NULL if it is missing or belongs to another
+// generation of the snapshot; the pivot is left past the header
+static buffer_t* journal_read(const char* filename, const uint32_t generation) {
+    FILE* fd = fopen(filename, "rb");
+    if (fd == NULL)
+        return (buffer_t*) NULL;
+    buffer_t* buf = buf_init_from_fd(fd);
+    fclose(fd);
+
+    journal_header_t hdr;
+    if (buf->size < sizeof(journal_header_t)) {
+        buf_free(buf);
+        return (buffer_t*) NULL;
+    }
+    buf_readbytes(buf, &hdr, sizeof(journal_header_t));
+    if (memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != JOURNAL_VERSION || hdr.generation != generation) {
+        buf_free(buf);
+        return (buffer_t*) NULL;
+    }
+    return buf;
+}
+
+// checks the record at the buffer pivot and moves past it, pointing payload
+// at its contents; returns false once there are no more complete records
+static bool journal_next_record(buffer_t* buf, unsigned char* op, buffer_t* payload) {
+    size_t left = buf->size - buf->pivot;
+    if (left < JOURNAL_RECORD_HEADER + sizeof(uint32_t))
+        return false;
+
+    const char* rec = (char*) buf->bytes + buf->pivot;
+    uint32_t length, checksum;
+    memcpy(&length, rec + 1, sizeof(uint32_t));
+    if (length > left - JOURNAL_RECORD_HEADER - sizeof(uint32_t))
+        return false;
+    memcpy(&checksum, rec + JOURNAL_RECORD_HEADER + length, sizeof(uint32_t));
+    if (checksum != journal_checksum(rec, JOURNAL_RECORD_HEADER + length))
+        return false;
+
+    *op = (unsigned char) rec[0];
+    payload->pivot = 0;
+    payload->size = payload->capacity = length;
+    payload->bytes = (char*) buf->bytes + buf->pivot + JOURNAL_RECORD_HEADER;
+    payload->sink = NULL;
+    buf->pivot += JOURNAL_RECORD_HEADER + length + sizeof(uint32_t);
+    return true;
+}
+
+// reads a string from a record payload, NULL if it is not terminated
+static const char* payload_str(buffer_t* payload) {
+    if (memchr((char*) payload->bytes + payload->pivot, '\0', payload->size - payload->pivot) == NULL)
+        return (char*) NULL;
+    return buf_skipstr(payload);
+}
+
+static bool payload_bytes(buffer_t* payload, void* dest, const size_t length) {
+    if (payload->size - payload->pivot < length)
+        return false;
+    buf_readbytes(payload, dest, length);
+    return true;
+}
+
+// sells the books of a batch record at the given time, the first ISBN (and
+// the time) having been read already
+static bool journal_apply_sales(bookstore_t* store, const char* isbn, buffer_t* payload,
+        const int64_t when) {
+    unsigned int num_sales = 0;
+    unsigned int capacity = 16;
+    book_sale_t* sales = malloc(capacity * sizeof(book_sale_t));
+    if (sales == NULL) exit(errno);
+    bool ret = true;
+    while (isbn != NULL) {
+        uint32_t qty;
+        if (!payload_bytes(payload, &qty, sizeof(uint32_t))) {
+            ret = false;
+            break;
+        }
+        if (num_sales == capacity) {
+            capacity *= 2;
+            sales = realloc(sales, capacity * sizeof(book_sale_t));
+            if (sales == NULL) exit(errno);
+        }
+        sales[num_sales].isbn = isbn;
+        sales[num_sales++].qty = qty;
+        isbn = (payload->pivot < payload->size) ? payload_str(payload) : NULL;
+        if (isbn == NULL && payload->pivot < payload->size)
+            ret = false;
+    }
+
+    unsigned int failed;
+    ret = ret && bookstore_sell_batch_at(store, sales, num_sales, when, &failed);
+    free(sales);
+    return ret;
+}
+
+// applies one record to the bookstore, the sales made before the given
+// time being kept out of its ledger
+static bool journal_apply(bookstore_t* store, const unsigned char op, buffer_t* payload,
+        const int64_t since) {
+    const char* isbn = payload_str(payload);
+    if (isbn == NULL)
+        return false;
+    book_t* book = book_find(store, isbn);
+    uint32_t qty;
+    double price;
+    int64_t when;
+
+    switch ((journal_op_t) op) {
+        case JOURNAL_ADD: {
+            const char* title = payload_str(payload);
+            const char* author = (title == NULL) ? NULL : payload_str(payload);
+            const char* genre = (author == NULL) ? NULL : payload_str(payload);
+            uint32_t sold_qty;
+            if (book != NULL || genre == NULL || !payload_bytes(payload, &qty, sizeof(uint32_t))
+                    || !payload_bytes(payload, &sold_qty, sizeof(uint32_t))
+                    || !payload_bytes(payload, &price, sizeof(double)))
+                return false;
+            return bookstore_add_book(store, bookstore_new_book(store, isbn, title,
+                        author, genre, qty, sold_qty, price));
+        }
+        case JOURNAL_REMOVE:
+            if (book == NULL)
+                return false;
+            bookstore_remove_book(store, book);
+            book_free(book);
+            return true;
+        case JOURNAL_SELL:
+            if (book == NULL || !payload_bytes(payload, &qty, sizeof(uint32_t)))
+                return false;
+            return book_sell_at(book, qty, 0);
+        case JOURNAL_SELL_AT:
+            if (book == NULL || !payload_bytes(payload, &qty, sizeof(uint32_t))
+                    || !payload_bytes(payload, &when, sizeof(int64_t)))
+                return false;
+            return book_sell_at(book, qty, (when >= since) ? when : 0);
+        case JOURNAL_STOCK:
+            if (book == NULL || !payload_bytes(payload, &qty, sizeof(uint32_t)))
+                return false;
+            book_stock(book, qty);
+            return true;
+        case JOURNAL_PRICE:
+            if (book == NULL || !payload_bytes(payload, &price, sizeof(double)))
+                return false;
+            book_change_price(book, price);
+            return true;
+        case JOURNAL_PUT: {
+            const char* title = payload_str(payload);
+            const char* author = (title == NULL) ? NULL : payload_str(payload);
+            const char* genre = (author == NULL) ? NULL : payload_str(payload);
+            uint32_t sold_qty;
+            if (genre == NULL || !payload_bytes(payload, &qty, sizeof(uint32_t))
+                    || !payload_bytes(payload, &sold_qty, sizeof(uint32_t))
+                    || !payload_bytes(payload, &price, sizeof(double)))
+                return false;
+            if (book != NULL) {
+                book_restore(book, qty, sold_qty, price);
+                return true;
+            }
+            return bookstore_add_book(store, bookstore_new_book(store, isbn, title,
+                        author, genre, qty, sold_qty, price));
+        }
+        case JOURNAL_SELL_BATCH:
+            return journal_apply_sales(store, isbn, payload, 0);
+        case JOURNAL_SELL_BATCH_AT:
+            if (!payload_bytes(payload, &when, sizeof(int64_t)))
+                return false;
+            return journal_apply_sales(store, isbn, payload, (when >= since) ? when : 0);
+        default:
+            return false;
+    }
+}
+
+unsigned int journal_replay(bookstore_t* store, const char* snapshot) {
+    char* filename = journal_path(snapshot);
+    buffer_t* buf = journal_read(filename, store->generation);
+    free(filename);
+    if (buf == NULL)
+        return 0;
+
+    unsigned int ret = 0;
+    unsigned char op;
+    buffer_t payload;
+    int64_t since = (int64_t) time(NULL) - LEDGER_MAX_AGE;
+    while (journal_next_record(buf, &op, &payload)) {
+        if (!journal_apply(store, op, &payload, since))
+            printf("Skipping journal record #%u, it does not apply to the bookstore!\n", ret);
+        ret++;
+    }
+    if (buf->pivot < buf->size)
+        printf("Ignoring %zu bytes of incomplete journal records.\n", buf->size - buf->pivot);
+
+    buf_free(buf);
+    return ret;
+}
+
+// writes bytes at the end of the journal file and syncs it, returns false
+// if that fails
+static bool journal_write(journal_t* journal, const void* bytes, const size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(journal->fd, (const char*) bytes + written, length - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            printf("Error writing journal %s!\n", journal->filename);
+            return false;
+        }
+        written += (size_t) n;
+    }
+    if (fdatasync(journal->fd) == -1) {
+        printf("Error syncing journal %s!\n", journal->filename);
+        return false;
+    }
+    return true;
+}
+
+// truncates the journal file down to a fresh header, returns false if
+// that fails
+static bool journal_write_header(journal_t* journal) {
+    journal_header_t hdr;
+    memset(&hdr, 0, sizeof(journal_header_t));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.generation = journal->generation;
+
+    if (ftruncate(journal->fd, 0) == -1 || lseek(journal->fd, 0, SEEK_SET) == -1) {
+        printf("Error truncating journal %s!\n", journal->filename);
+        return false;
+    }
+    if (!journal_write(journal, &hdr, sizeof(journal_header_t)))
+        return false;
+    journal->size = sizeof(journal_header_t);
+    return true;
+}
+
+static void journal_open_file(journal_t* journal) {
+    journal->fd = open(journal->filename, O_WRONLY | O_CREAT, 0644);
+    if (journal->fd == -1) {
+        printf("Cannot open journal %s!\n", journal->filename);
+        exit(errno);
+    }
+}
+
+journal_t* journal_open(const char* snapshot, const uint32_t generation, const bool stale) {
+    journal_t* ret = malloc(sizeof(journal_t));
+    if (ret == NULL) exit(errno);
+    ret->snapshot = malloc(strlen(snapshot) + 1);
+    if (ret->snapshot == NULL) exit(errno);
+    strcpy(ret->snapshot, snapshot);
+    ret->filename = journal_path(snapshot);
+    ret->fd = -1;
+    ret->generation = generation;
+    ret->size = 0;
+    ret->snapshot_size = file_size(snapshot);
+    ret->pending = buf_init();
+    ret->num_pending = 0;
+    ret->stale = stale;
+    ret->deferred = false;
+    if (stale)
+        return ret;
+
+    buffer_t* buf = journal_read(ret->filename, generation);
+    journal_open_file(ret);
+    if (buf == NULL) {
+        if (!journal_write_header(ret))
+            exit(1);
+        return ret;
+    }
+
+    // keep the complete records, appending right after them
+    unsigned char op;
+    buffer_t payload;
+    while (journal_next_record(buf, &op, &payload))
+        ;
+    ret->size = buf->pivot;
+    if (ftruncate(ret->fd, (off_t) ret->size) == -1
+            || lseek(ret->fd, (off_t) ret->size, SEEK_SET) == -1) {
+        printf("Error truncating journal %s!\n", ret->filename);
+        exit(1);
+    }
+    buf_free(buf);
+    return ret;
+}
+
+// starts a new pending record, returns where it begins
+static size_t journal_begin(journal_t* journal, const journal_op_t op, const char* isbn) {
+    size_t ret = journal->pending->pivot;
+    unsigned char code = (unsigned char) op;
+    uint32_t length = 0;
+    buf_write(journal->pending, &code, 1);
+    buf_write(journal->pending, &length, sizeof(uint32_t));
+    buf_write(journal->pending, isbn, strlen(isbn) + 1);
+    return ret;
+}
+
+// fills in the length and checksum of a pending record, committing the
+// pending records once there are enough of them (unless they are all
+// written at once at checkpoints)
+static void journal_end(journal_t* journal, const size_t start) {
+    char* rec = (char*) journal->pending->bytes + start;
+    uint32_t length = (uint32_t) (journal->pending->pivot - start - JOURNAL_RECORD_HEADER);
+    memcpy(rec + 1, &length, sizeof(uint32_t));
+    uint32_t checksum = journal_checksum(rec, JOURNAL_RECORD_HEADER + length);
+    buf_write(journal->pending, &checksum, sizeof(uint32_t));
+
+    if (++journal->num_pending >= JOURNAL_GROUP_SIZE && !journal->deferred)
+        journal_commit(journal);
+}
+
+// records a book with all of its fields
+static void journal_log_full(journal_t* journal, const journal_op_t op, const char* isbn,
+        const char* title, const char* author, const char* genre,
+        const unsigned int stocked_qty, const unsigned int sold_qty, const double price) {
+    if (journal->stale)
+        return;
+    size_t start = journal_begin(journal, op, isbn);
+    uint32_t qty;
+    buf_write(journal->pending, title, strlen(title) + 1);
+    buf_write(journal->pending, author, strlen(author) + 1);
+    buf_write(journal->pending, genre, strlen(genre) + 1);
+    qty = stocked_qty;
+    buf_write(journal->pending, &qty, sizeof(uint32_t));
+    qty = sold_qty;
+    buf_write(journal->pending, &qty, sizeof(uint32_t));
+    buf_write(journal->pending, &price, sizeof(double));
+    journal_end(journal, start);
+}
+
+void journal_log_add(journal_t* journal, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price) {
+    journal_log_full(journal, JOURNAL_ADD, isbn, title, author, genre, stocked_qty, sold_qty, price);
+}
+
+void journal_log_remove(journal_t* journal, const char* isbn) {
+    if (journal->stale)
+        return;
+    journal_end(journal, journal_begin(journal, JOURNAL_REMOVE, isbn));
+}
+
+void journal_log_qty(journal_t* journal, const journal_op_t op, const char* isbn,
+        const unsigned int qty) {
+    if (journal->stale)
+        return;
+    size_t start = journal_begin(journal, op, isbn);
+    uint32_t value = qty;
+    buf_write(journal->pending, &value, sizeof(uint32_t));
+    journal_end(journal, start);
+}
+
+void journal_log_sale(journal_t* journal, const char* isbn, const unsigned int qty,
+        const int64_t when) {
+    if (journal->stale)
+        return;
+    size_t start = journal_begin(journal, JOURNAL_SELL_AT, isbn);
+    uint32_t value = qty;
+    buf_write(journal->pending, &value, sizeof(uint32_t));
+    buf_write(journal->pending, &when, sizeof(int64_t));
+    journal_end(journal, start);
+}
+
+void journal_log_sales(journal_t* journal, const book_sale_t* sales, const unsigned int num_sales,
+        const int64_t when) {
+    if (journal->stale || num_sales == 0)
+        return;
+    size_t start = journal_begin(journal, JOURNAL_SELL_BATCH_AT, sales[0].isbn);
+    buf_write(journal->pending, &when, sizeof(int64_t));
+    for (unsigned int i=0; i<num_sales; i++) {
+        if (i > 0)
+            buf_write(journal->pending, sales[i].isbn, strlen(sales[i].isbn) + 1);
+        uint32_t qty = sales[i].qty;
+        buf_write(journal->pending, &qty, sizeof(uint32_t));
+    }
+    journal_end(journal, start);
+}
+
+void journal_log_price(journal_t* journal, const char* isbn, const double price) {
+    if (journal->stale)
+        return;
+    size_t start = journal_begin(journal, JOURNAL_PRICE, isbn);
+    buf_write(journal->pending, &price, sizeof(double));
+    journal_end(journal, start);
+}
+
+void journal_log_book(journal_t* journal, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price) {
+    journal_log_full(journal, JOURNAL_PUT, isbn, title, author, genre, stocked_qty, sold_qty, price);
+}
+
+void journal_suspend(journal_t* journal) {
+    journal->stale = true;
+}
+
+void journal_commit(journal_t* journal) {
+    if (journal->fd == -1 || journal->pending->pivot == 0)
+        return;
+    if (!journal_write(journal, journal->pending->bytes, journal->pending->pivot))
+        exit(1);
+    journal->size += journal->pending->pivot;
+    metrics_count(METRICS_BYTES_JOURNALED, journal->pending->pivot);
+    journal->pending->pivot = journal->pending->size = 0;
+    journal->num_pending = 0;
+}
+
+buffer_t* journal_detach(journal_t* journal) {
+    buffer_t* ret = journal->pending;
+    journal->pending = buf_init();
+    journal->num_pending = 0;
+    return ret;
+}
+
+bool journal_append(journal_t* journal, buffer_t* records) {
+    bool ret = true;
+    if (journal->fd != -1 && records->pivot > 0) {
+        ret = journal_write(journal, records->bytes, records->pivot);
+        if (ret) {
+            journal->size += records->pivot;
+            metrics_count(METRICS_BYTES_JOURNALED, records->pivot);
+        } else if (ftruncate(journal->fd, (off_t) journal->size) == -1
+                || lseek(journal->fd, (off_t) journal->size, SEEK_SET) == -1) {
+            // the part written is left behind, a snapshot has to supersede it
+            journal->stale = true;
+        }
+    }
+    buf_free(records);
+    return ret;
+}
+
+bool journal_reset(journal_t* journal, const uint32_t generation) {
+    journal->pending->pivot = journal->pending->size = 0;
+    journal->num_pending = 0;
+    journal->generation = generation;
+    journal->snapshot_size = file_size(journal->snapshot);
+    journal->stale = false;
+    if (journal->fd == -1)
+        journal_open_file(journal);
+    return journal_write_header(journal);
+}
+
+bool journal_needs_compaction(const journal_t* journal) {
+    uint64_t size = journal->size + journal->pending->pivot;
+    return journal->stale
+        || (size > JOURNAL_MIN_COMPACT_SIZE && size > journal->snapshot_size);
+}
+
+void journal_close(journal_t* journal) {
+    if (journal->fd != -1)
+        close(journal->fd);
+    buf_free(journal->pending);
+    free(journal->filename);
+    free(journal->snapshot);
+    free(journal);
+    journal = NULL;
+}
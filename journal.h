@@ -0,0 +1,139 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+#include <stdbool.h>
+#include <stdint.h>
+#include "buffer.h"
+
+// on-disk format identification
+#define JOURNAL_MAGIC "BDSMJRNL"
+#define JOURNAL_VERSION 1
+
+// pending records are written out and synced once this many have piled up
+#define JOURNAL_GROUP_SIZE 64
+
+// a journal is folded into a new snapshot once it outgrows both this many
+// bytes and the snapshot itself
+#define JOURNAL_MIN_COMPACT_SIZE (4 * 1024 * 1024)
+
+struct bookstore_struct;
+struct book_sale_struct;
+
+
+/*
+ * structs
+ */
+
+// kinds of changes recorded in a journal
+typedef enum journal_op_enum {
+    JOURNAL_ADD = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_SELL, // as written before sales were timed, replayed without going into the ledger
+    JOURNAL_STOCK,
+    JOURNAL_PRICE,
+    JOURNAL_PUT, // the whole state of a book, added if it is not there yet
+    JOURNAL_SELL_BATCH, // several books sold at once, each ISBN followed by its quantity
+    JOURNAL_SELL_AT, // a book sold, its quantity followed by the time of the sale
+    JOURNAL_SELL_BATCH_AT // as JOURNAL_SELL_BATCH, the first ISBN followed by the time of the sale
+} journal_op_t;
+
+// a journal file consists of this header followed by records, each made of
+// an op byte, a 32-bit payload length, the payload and a 32-bit checksum of
+// all of the preceding; the payload always starts with the book's ISBN
+typedef struct journal_header_struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation; // of the snapshot the journal applies to
+} journal_header_t;
+
+// append-only log of the changes made to a bookstore since its snapshot
+// file was last written
+typedef struct journal_struct {
+    char* snapshot; // path of the snapshot file
+    char* filename; // path of the journal file
+    int fd; // -1 while the journal is stale
+    uint32_t generation;
+    uint64_t size; // bytes written to the journal file
+    uint64_t snapshot_size;
+    buffer_t* pending; // records not written out yet
+    unsigned int num_pending;
+    bool stale; // the bookstore does not match the snapshot any more,
+                // so it has to be compacted before anything gets logged
+    bool deferred; // changes are not logged as they are made, the states of
+                   // the books they touched are logged at checkpoints instead
+} journal_t;
+
+
+/*
+ * function prototypes
+ */
+
+// returns the (newly allocated) path of the journal belonging to a snapshot
+char* journal_path(const char* snapshot);
+
+// opens (or creates) the journal of a snapshot of the given generation,
+// dropping any incomplete records at its end
+journal_t* journal_open(const char* snapshot, const uint32_t generation, const bool stale);
+
+// applies the journal of a snapshot to the bookstore loaded from it, the
+// sales made within the longest window of its ledger going into it too;
+// returns the number of records replayed
+unsigned int journal_replay(struct bookstore_struct* store, const char* snapshot);
+
+// records a book being added
+void journal_log_add(journal_t* journal, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price);
+
+// records a book being removed
+void journal_log_remove(journal_t* journal, const char* isbn);
+
+// records a quantity of a book being stocked
+void journal_log_qty(journal_t* journal, const journal_op_t op, const char* isbn,
+        const unsigned int qty);
+
+// records a quantity of a book being sold at the given time (in seconds
+// since the epoch)
+void journal_log_sale(journal_t* journal, const char* isbn, const unsigned int qty,
+        const int64_t when);
+
+// records several books being sold at once (to be applied all or none) at
+// the given time
+void journal_log_sales(journal_t* journal, const struct book_sale_struct* sales,
+        const unsigned int num_sales, const int64_t when);
+
+// records the price of a book being changed
+void journal_log_price(journal_t* journal, const char* isbn, const double price);
+
+// records the whole state of a book
+void journal_log_book(journal_t* journal, const char* isbn, const char* title,
+        const char* author, const char* genre, const unsigned int stocked_qty,
+        const unsigned int sold_qty, const double price);
+
+// stops logging until the next compaction, for changes too large to be
+// worth logging one by one
+void journal_suspend(journal_t* journal);
+
+// writes all pending records to the journal file and syncs it
+void journal_commit(journal_t* journal);
+
+// takes the pending records out of the journal, to be written by
+// journal_append() (from any thread, as long as nothing else touches
+// the journal meanwhile)
+buffer_t* journal_detach(journal_t* journal);
+
+// writes records taken out of the journal to the journal file and syncs it,
+// then frees them; returns false if they could not be written, leaving the
+// journal as it was
+bool journal_append(journal_t* journal, buffer_t* records);
+
+// empties the journal after its snapshot was rewritten with a new generation,
+// returns false if it could not be rewritten
+bool journal_reset(journal_t* journal, const uint32_t generation);
+
+// checks whether the journal should be folded into a new snapshot
+bool journal_needs_compaction(const journal_t* journal);
+
+// closes the journal, discarding the pending records
+void journal_close(journal_t* journal);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ledger.h"
+
+#define LEDGER_MIN_PARTITIONS 64
+#define LEDGER_MIN_EVENTS 16
+
+static const char* ledger_window_names[LEDGER_NUM_WINDOWS] = {"hour", "day", "week"};
+static const int64_t ledger_window_seconds[LEDGER_NUM_WINDOWS] = {3600, 86400, LEDGER_MAX_AGE};
+
+
+ledger_t* ledger_init(void) {
+    ledger_t* ret = malloc(sizeof(ledger_t));
+    if (ret == NULL) exit(errno);
+    ret->partitions = NULL;
+    ret->capacity = 0;
+    ret->first = 0;
+    ret->end = 0;
+    memset(ret->window_first, 0, sizeof(ret->window_first));
+    ret->now = 0;
+    ret->num_events = 0;
+    ret->counts = NULL;
+    ret->num_counts = 0;
+    ret->active = NULL;
+    ret->num_active = 0;
+    ret->active_capacity = 0;
+    if (pthread_mutex_init(&(ret->lock), NULL) != 0)
+        exit(errno);
+    return ret;
+}
+
+bool ledger_parse_window(const char* name, ledger_window_t* window) {
+    for (unsigned int i=0; i<LEDGER_NUM_WINDOWS; i++) {
+        if (strcmp(name, ledger_window_names[i]) == 0) {
+            *window = (ledger_window_t) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static ledger_partition_t* ledger_partition(const ledger_t* ledger, const uint64_t n) {
+    return &(ledger->partitions[n & (ledger->capacity - 1)]);
+}
+
+// doubles the ring, putting the partitions kept where their numbers take them
+static void ledger_grow(ledger_t* ledger) {
+    unsigned int capacity = ledger->capacity ? ledger->capacity * 2 : LEDGER_MIN_PARTITIONS;
+    ledger_partition_t* partitions = calloc(capacity, sizeof(ledger_partition_t));
+    if (partitions == NULL) exit(errno);
+    for (uint64_t n=ledger->first; n<ledger->end; n++)
+        partitions[n & (capacity - 1)] = *ledger_partition(ledger, n);
+    free(ledger->partitions);
+    ledger->partitions = partitions;
+    ledger->capacity = capacity;
+}
+
+static void ledger_activate(ledger_t* ledger, const uint32_t slot) {
+    if (ledger->num_active == ledger->active_capacity) {
+        ledger->active_capacity = ledger->active_capacity ? ledger->active_capacity * 2 : 64;
+        ledger->active = realloc(ledger->active, ledger->active_capacity * sizeof(uint32_t));
+        if (ledger->active == NULL) exit(errno);
+    }
+    ledger->counts[slot].active_pos = ledger->num_active;
+    ledger->active[ledger->num_active++] = slot;
+}
+
+// takes a book out of the ones sold within the longest window, moving the
+// last one into its position
+static void ledger_deactivate(ledger_t* ledger, const uint32_t slot) {
+    unsigned int pos = ledger->counts[slot].active_pos;
+    uint32_t last = ledger->active[--ledger->num_active];
+    ledger->active[pos] = last;
+    ledger->counts[last].active_pos = pos;
+}
+
+// subtracts the sales of a partition falling out of a window from its counts
+static void ledger_subtract(ledger_t* ledger, const ledger_partition_t* part,
+        const ledger_window_t window) {
+    for (unsigned int i=0; i<part->num_events; i++) {
+        const ledger_event_t* event = &(part->events[i]);
+        uint32_t slot = (uint32_t) event->handle;
+        ledger_counts_t* counts = &(ledger->counts[slot]);
+        // the book was removed since, and maybe another one took its slot
+        if (counts->handle != event->handle)
+            continue;
+        counts->qty[window] -= event->qty;
+        if (window == LEDGER_WEEK && counts->qty[window] == 0)
+            ledger_deactivate(ledger, slot);
+    }
+}
+
+// brings the windows up to the given time, expiring the partitions that
+// have fallen out of all of them (the ledger being locked)
+static void ledger_advance(ledger_t* ledger, const int64_t now) {
+    if (now > ledger->now)
+        ledger->now = now;
+    int64_t current = ledger->now - ledger->now % LEDGER_PARTITION_SECONDS;
+
+    for (unsigned int w=0; w<LEDGER_NUM_WINDOWS; w++) {
+        int64_t start = current + LEDGER_PARTITION_SECONDS - ledger_window_seconds[w];
+        while (ledger->window_first[w] < ledger->end) {
+            const ledger_partition_t* part = ledger_partition(ledger, ledger->window_first[w]);
+            if (part->start >= start)
+                break;
+            ledger_subtract(ledger, part, (ledger_window_t) w);
+            ledger->window_first[w]++;
+        }
+    }
+
+    while (ledger->first < ledger->window_first[LEDGER_WEEK]) {
+        ledger_partition_t* part = ledger_partition(ledger, ledger->first++);
+        ledger->num_events -= part->num_events;
+        free(part->events);
+        part->events = NULL;
+        part->num_events = 0;
+        part->capacity = 0;
+    }
+}
+
+void ledger_record(ledger_t* ledger, const uint64_t handle, const uint64_t seq,
+        const unsigned int qty, const int64_t now) {
+    if (qty == 0)
+        return;
+    pthread_mutex_lock(&(ledger->lock));
+    ledger_advance(ledger, now);
+
+    int64_t start = ledger->now - ledger->now % LEDGER_PARTITION_SECONDS;
+    if (ledger->end == ledger->first || ledger_partition(ledger, ledger->end - 1)->start != start) {
+        if (ledger->end - ledger->first == ledger->capacity)
+            ledger_grow(ledger);
+        ledger_partition(ledger, ledger->end++)->start = start;
+    }
+    ledger_partition_t* part = ledger_partition(ledger, ledger->end - 1);
+    if (part->num_events == part->capacity) {
+        part->capacity = part->capacity ? part->capacity * 2 : LEDGER_MIN_EVENTS;
+        part->events = realloc(part->events, part->capacity * sizeof(ledger_event_t));
+        if (part->events == NULL) exit(errno);
+    }
+    ledger_event_t* event = &(part->events[part->num_events++]);
+    event->handle = handle;
+    event->offset = (uint32_t) (ledger->now - start);
+    event->qty = qty;
+    ledger->num_events++;
+
+    uint32_t slot = (uint32_t) handle;
+    if (slot >= ledger->num_counts) {
+        unsigned int num_counts = ledger->num_counts ? ledger->num_counts * 2 : 64;
+        if (num_counts <= slot)
+            num_counts = slot + 1;
+        ledger->counts = realloc(ledger->counts, num_counts * sizeof(ledger_counts_t));
+        if (ledger->counts == NULL) exit(errno);
+        memset(&(ledger->counts[ledger->num_counts]), 0,
+                (num_counts - ledger->num_counts) * sizeof(ledger_counts_t));
+        ledger->num_counts = num_counts;
+    }
+    ledger_counts_t* counts = &(ledger->counts[slot]);
+    if (counts->handle != handle) {
+        if (counts->qty[LEDGER_WEEK] > 0)
+            ledger_deactivate(ledger, slot);
+        memset(counts, 0, sizeof(ledger_counts_t));
+        counts->handle = handle;
+        counts->seq = seq;
+    }
+    if (counts->qty[LEDGER_WEEK] == 0)
+        ledger_activate(ledger, slot);
+    for (unsigned int w=0; w<LEDGER_NUM_WINDOWS; w++)
+        counts->qty[w] += qty;
+    pthread_mutex_unlock(&(ledger->lock));
+}
+
+void ledger_forget(ledger_t* ledger, const uint64_t handle) {
+    uint32_t slot = (uint32_t) handle;
+    pthread_mutex_lock(&(ledger->lock));
+    if (slot < ledger->num_counts && ledger->counts[slot].handle == handle) {
+        if (ledger->counts[slot].qty[LEDGER_WEEK] > 0)
+            ledger_deactivate(ledger, slot);
+        memset(&(ledger->counts[slot]), 0, sizeof(ledger_counts_t));
+    }
+    pthread_mutex_unlock(&(ledger->lock));
+}
+
+// whether the book in slot a sold worse than the one in slot b within a
+// window, ties going to the book with the higher seq
+static bool ledger_sells_worse(const ledger_t* ledger, const ledger_window_t window,
+        const uint32_t a, const uint32_t b) {
+    const ledger_counts_t* x = &(ledger->counts[a]);
+    const ledger_counts_t* y = &(ledger->counts[b]);
+    return x->qty[window] < y->qty[window]
+        || (x->qty[window] == y->qty[window] && x->seq > y->seq);
+}
+
+// restores the min-heap property (worst seller on top) below position i
+static void ledger_heap_sift_down(uint32_t* heap, const unsigned int size, const ledger_t* ledger,
+        const ledger_window_t window, unsigned int i) {
+    while (true) {
+        unsigned int worst = i;
+        unsigned int left = 2 * i + 1;
+        unsigned int right = left + 1;
+        if (left < size && ledger_sells_worse(ledger, window, heap[left], heap[worst]))
+            worst = left;
+        if (right < size && ledger_sells_worse(ledger, window, heap[right], heap[worst]))
+            worst = right;
+        if (worst == i)
+            return;
+        uint32_t t = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = t;
+        i = worst;
+    }
+}
+
+unsigned int ledger_top(ledger_t* ledger, const ledger_window_t window, const int64_t now,
+        unsigned int howmany, uint64_t* handles, unsigned int* qty) {
+    pthread_mutex_lock(&(ledger->lock));
+    ledger_advance(ledger, now);
+    if (howmany > ledger->num_active)
+        howmany = ledger->num_active;
+    if (howmany == 0) {
+        pthread_mutex_unlock(&(ledger->lock));
+        return 0;
+    }
+
+    // bounded min-heap of the best books seen so far, built once it is full
+    uint32_t* heap = malloc(howmany * sizeof(uint32_t));
+    if (heap == NULL) exit(errno);
+    unsigned int size = 0;
+    for (unsigned int i=0; i<ledger->num_active; i++) {
+        uint32_t slot = ledger->active[i];
+        if (ledger->counts[slot].qty[window] == 0)
+            continue;
+        if (size < howmany) {
+            heap[size++] = slot;
+            if (size == howmany) {
+                for (unsigned int j=size/2; j>0; j--)
+                    ledger_heap_sift_down(heap, size, ledger, window, j - 1);
+            }
+        } else if (ledger_sells_worse(ledger, window, heap[0], slot)) {
+            heap[0] = slot;
+            ledger_heap_sift_down(heap, size, ledger, window, 0);
+        }
+    }
+    if (size < howmany) {
+        for (unsigned int j=size/2; j>0; j--)
+            ledger_heap_sift_down(heap, size, ledger, window, j - 1);
+    }
+
+    // popping the worst one off repeatedly fills the result from its end
+    unsigned int ret = size;
+    for (; size>0; size--) {
+        handles[size - 1] = ledger->counts[heap[0]].handle;
+        qty[size - 1] = ledger->counts[heap[0]].qty[window];
+        heap[0] = heap[size - 1];
+        ledger_heap_sift_down(heap, size - 1, ledger, window, 0);
+    }
+
+    free(heap);
+    pthread_mutex_unlock(&(ledger->lock));
+    return ret;
+}
+
+void ledger_free(ledger_t* ledger) {
+    for (uint64_t n=ledger->first; n<ledger->end; n++)
+        free(ledger_partition(ledger, n)->events);
+    free(ledger->partitions);
+    ledger->partitions = NULL;
+    free(ledger->counts);
+    ledger->counts = NULL;
+    free(ledger->active);
+    ledger->active = NULL;
+    pthread_mutex_destroy(&(ledger->lock));
+    free(ledger);
+    ledger = NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef __LEDGER_H__
+#define __LEDGER_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// length of time the sales of a partition were made within, which is also
+// how precisely the windows roll
+#define LEDGER_PARTITION_SECONDS 60
+
+// length of the longest window, older sales not being counted in any
+#define LEDGER_MAX_AGE (7 * 86400)
+
+
+/*
+ * structs
+ */
+
+// the rolling windows sales are counted over, each made up of the partitions
+// within its length up to the current one
+typedef enum ledger_window_enum {
+    LEDGER_HOUR,
+    LEDGER_DAY,
+    LEDGER_WEEK, // the longest, the partitions older than it are expired
+    LEDGER_NUM_WINDOWS
+} ledger_window_t;
+
+// a sale of a book, as recorded
+typedef struct ledger_event_struct {
+    uint64_t handle; // of the book sold (see book_handle_t)
+    uint32_t offset; // seconds into its partition the sale was made at
+    uint32_t qty;
+} ledger_event_t;
+
+// the sales made within one partition's time, in the order they were made
+typedef struct ledger_partition_struct {
+    int64_t start; // time (in seconds since the epoch) the partition starts at
+    unsigned int num_events;
+    unsigned int capacity;
+    ledger_event_t* events;
+} ledger_partition_t;
+
+// units of a book sold within every window
+typedef struct ledger_counts_struct {
+    uint64_t handle; // of the book counted, 0 for none
+    uint64_t seq; // of the book, breaking ties between bestsellers
+    unsigned int qty[LEDGER_NUM_WINDOWS];
+    unsigned int active_pos; // position among the books sold within the longest window
+} ledger_counts_t;
+
+// append-only ledger of the sales of a bookstore's books, partitioned by
+// time: the partitions of the longest window are kept in a ring, oldest
+// first, and every window keeps running counts of the units of each book
+// sold within it, so that a partition gets subtracted from a window's
+// counts once, as it falls out of it, and is freed whole once it falls out
+// of the longest one
+typedef struct ledger_struct {
+    ledger_partition_t* partitions; // ring of them, partition n being at n % capacity
+    unsigned int capacity; // always a power of two
+    uint64_t first; // number of the oldest partition kept, partitions being numbered as they are started
+    uint64_t end; // one past the number of the newest one
+    uint64_t window_first[LEDGER_NUM_WINDOWS]; // oldest partition still counted in each window
+    int64_t now; // latest time seen, as time never goes backwards in the ledger
+    uint64_t num_events; // in the partitions kept
+    ledger_counts_t* counts; // indexed by the slot of a book's handle
+    unsigned int num_counts;
+    uint32_t* active; // slots of the books sold within the longest window
+    unsigned int num_active;
+    unsigned int active_capacity;
+    pthread_mutex_t lock; // as the windows get brought up to date while the bookstore is only read
+} ledger_t;
+
+
+/*
+ * function prototypes
+ */
+
+// allocates a new empty ledger
+ledger_t* ledger_init(void);
+
+// looks a window up by its name ("hour", "day" or "week")
+bool ledger_parse_window(const char* name, ledger_window_t* window);
+
+// records a sale of a book (with the given handle and seq) made at the given
+// time (in seconds since the epoch), expiring the partitions that have
+// fallen out of the longest window by then
+void ledger_record(ledger_t* ledger, const uint64_t handle, const uint64_t seq,
+        const unsigned int qty, const int64_t now);
+
+// stops counting the sales of a book, as it is removed from its bookstore
+void ledger_forget(ledger_t* ledger, const uint64_t handle);
+
+// stores the handles of (at most) the top N books sold within a window as
+// of the given time into handles, best first, with ties going to the book
+// with the lower seq, and the units of them sold into qty; goes through
+// the books sold within the longest window only, and returns the number
+// of books stored
+unsigned int ledger_top(ledger_t* ledger, const ledger_window_t window, const int64_t now,
+        unsigned int howmany, uint64_t* handles, unsigned int* qty);
+
+// deallocates the ledger
+void ledger_free(ledger_t* ledger);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_WRITE_PERCENT 5
+#define DEFAULT_BOOKS 100000
+#define NUM_AUTHORS 1000
+
+// one simulated client: a connection and the latencies it saw
+typedef struct client_struct {
+    pthread_t thread;
+    unsigned int id;
+    double* latencies;
+} client_t;
+
+static const char* socket_path;
+static unsigned int num_requests = DEFAULT_REQUESTS;
+static unsigned int write_percent = DEFAULT_WRITE_PERCENT;
+static unsigned int num_books = DEFAULT_BOOKS;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        printf("Cannot connect to %s!\n", socket_path);
+        exit(1);
+    }
+    return fd;
+}
+
+// sends a command and reads its whole (NUL-terminated) response
+static void request(const int fd, const char* cmd) {
+    char buf[65536];
+    size_t len = strlen(cmd);
+    if (write(fd, cmd, len) != (ssize_t) len) {
+        printf("Error sending a request!\n");
+        exit(1);
+    }
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            printf("Server closed the connection!\n");
+            exit(1);
+        }
+        if (buf[n - 1] == '\0')
+            return;
+    }
+}
+
+static void* client_run(void* arg) {
+    client_t* client = arg;
+    unsigned int seed = client->id * 2654435761U + 1;
+    char cmd[128];
+    int fd = connect_server();
+    request(fd, "format tsv\n");
+
+    for (unsigned int i=0; i<num_requests; i++) {
+        unsigned int book = (unsigned int) rand_r(&seed) % num_books;
+        unsigned int kind = (unsigned int) rand_r(&seed) % 100;
+        if (kind < write_percent)
+            snprintf(cmd, sizeof(cmd), "sell 978%010u 1\n", book);
+        else if (kind < write_percent + (100 - write_percent) * 70 / 100)
+            snprintf(cmd, sizeof(cmd), "info 978%010u\n", book);
+        else if (kind < write_percent + (100 - write_percent) * 85 / 100)
+            snprintf(cmd, sizeof(cmd), "top 10\n");
+        else
+            snprintf(cmd, sizeof(cmd), "byauthor Author%u\n", book % NUM_AUTHORS);
+
+        double start = now();
+        request(fd, cmd);
+        client->latencies[i] = now() - start;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage:\n");
+        printf("\t%s <socket> [clients] [requests per client] [write percent] [books]\n", argv[0]);
+        return 1;
+    }
+    socket_path = argv[1];
+    unsigned int num_clients = (argc > 2) ? (unsigned int) atoi(argv[2]) : DEFAULT_CLIENTS;
+    if (argc > 3)
+        num_requests = (unsigned int) atoi(argv[3]);
+    if (argc > 4)
+        write_percent = (unsigned int) atoi(argv[4]);
+    if (argc > 5)
+        num_books = (unsigned int) atoi(argv[5]);
+    if (num_clients == 0 || num_requests == 0 || num_books == 0 || write_percent > 100) {
+        printf("Invalid arguments!\n");
+        return 1;
+    }
+
+    // make sure the books the clients ask for exist
+    char cmd[160];
+    int fd = connect_server();
+    for (unsigned int i=0; i<num_books; i++) {
+        snprintf(cmd, sizeof(cmd), "bookadd 978%010u Title%u Author%u Genre%u 1000000 0 9.99\n",
+                i, i, i % NUM_AUTHORS, i % 100);
+        request(fd, cmd);
+    }
+    close(fd);
+
+    client_t* clients = malloc(num_clients * sizeof(client_t));
+    if (clients == NULL) exit(errno);
+    double start = now();
+    for (unsigned int i=0; i<num_clients; i++) {
+        clients[i].id = i;
+        clients[i].latencies = malloc(num_requests * sizeof(double));
+        if (clients[i].latencies == NULL) exit(errno);
+        if (pthread_create(&(clients[i].thread), NULL, client_run, &clients[i]) != 0)
+            exit(errno);
+    }
+    for (unsigned int i=0; i<num_clients; i++)
+        pthread_join(clients[i].thread, NULL);
+    double elapsed = now() - start;
+
+    size_t total = (size_t) num_clients * num_requests;
+    double* latencies = malloc(total * sizeof(double));
+    if (latencies == NULL) exit(errno);
+    for (unsigned int i=0; i<num_clients; i++) {
+        memcpy(&latencies[(size_t) i * num_requests], clients[i].latencies, num_requests * sizeof(double));
+        free(clients[i].latencies);
+    }
+    free(clients);
+    qsort(latencies, total, sizeof(double), compare_doubles);
+
+    printf("clients\trequests\tseconds\trequests_per_second\tp50_us\tp99_us\tmax_us\n");
+    printf("%u\t%zu\t%.3f\t%.0f\t%.1f\t%.1f\t%.1f\n", num_clients, total, elapsed,
+            (double) total / elapsed, latencies[total / 2] * 1e6,
+            latencies[total * 99 / 100] * 1e6, latencies[total - 1] * 1e6);
+    free(latencies);
+    return 0;
+}
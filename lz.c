@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+// every sequence starts with a token: the number of literals in its upper
+// and the match length (minus LZ_MIN_MATCH) in its lower four bits, where
+// 15 means more length bytes follow, each adding up to 255
+#define LZ_TOKEN_MAX 15
+
+
+static uint32_t lz_read32(const char* p) {
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(uint32_t));
+    return ret;
+}
+
+static unsigned int lz_hash(const uint32_t value) {
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static char* lz_put_length(char* out, size_t len) {
+    while (len >= 255) {
+        *out++ = (char) 255;
+        len -= 255;
+    }
+    *out++ = (char) len;
+    return out;
+}
+
+// writes literals followed by a match, or just the literals if match_len is 0
+static char* lz_put_sequence(char* out, const char* literals, const size_t num_literals,
+        const size_t offset, const size_t match_len) {
+    char* token = out++;
+    unsigned int value = (num_literals >= LZ_TOKEN_MAX ? LZ_TOKEN_MAX : (unsigned int) num_literals) << 4;
+    if (num_literals >= LZ_TOKEN_MAX)
+        out = lz_put_length(out, num_literals - LZ_TOKEN_MAX);
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+
+    if (match_len > 0) {
+        *out++ = (char) (offset & 0xff);
+        *out++ = (char) (offset >> 8);
+        size_t len = match_len - LZ_MIN_MATCH;
+        value |= len >= LZ_TOKEN_MAX ? LZ_TOKEN_MAX : (unsigned int) len;
+        if (len >= LZ_TOKEN_MAX)
+            out = lz_put_length(out, len - LZ_TOKEN_MAX);
+    }
+    *token = (char) value;
+    return out;
+}
+
+size_t lz_compress(const char* src, const size_t size, char* dst) {
+    // positions plus one, so that zero means none
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    char* out = dst;
+    size_t anchor = 0;
+    size_t pos = 0;
+    unsigned int misses = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t value = lz_read32(src + pos);
+        unsigned int hash = lz_hash(value);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t) pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > LZ_WINDOW || lz_read32(src + candidate - 1) != value) {
+            // step through incompressible data faster and faster
+            pos += 1 + (misses++ >> 5);
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t len = LZ_MIN_MATCH;
+        while (pos + len < size && src[match + len] == src[pos + len])
+            len++;
+        out = lz_put_sequence(out, src + anchor, pos - anchor, pos - match, len);
+        pos += len;
+        anchor = pos;
+        misses = 0;
+    }
+    return (size_t) (lz_put_sequence(out, src + anchor, size - anchor, 0, 0) - dst);
+}
+
+static bool lz_get_length(const unsigned char** in, const unsigned char* end, size_t* len) {
+    unsigned char byte;
+    do {
+        if (*in >= end)
+            return false;
+        byte = *(*in)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz_decompress(const char* src, const size_t size, char* dst, const size_t raw_size) {
+    const unsigned char* in = (const unsigned char*) src;
+    const unsigned char* end = in + size;
+    size_t out = 0;
+
+    while (in < end) {
+        unsigned int token = *in++;
+        size_t num_literals = token >> 4;
+        if (num_literals == LZ_TOKEN_MAX && !lz_get_length(&in, end, &num_literals))
+            return false;
+        if (num_literals > (size_t) (end - in) || num_literals > raw_size - out)
+            return false;
+        memcpy(dst + out, in, num_literals);
+        in += num_literals;
+        out += num_literals;
+
+        // only the last sequence has no match
+        if (in == end)
+            break;
+        if (end - in < 2)
+            return false;
+        size_t offset = (size_t) in[0] | ((size_t) in[1] << 8);
+        in += 2;
+        size_t len = token & LZ_TOKEN_MAX;
+        if (len == LZ_TOKEN_MAX && !lz_get_length(&in, end, &len))
+            return false;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || len > raw_size - out)
+            return false;
+
+        // a match may overlap the bytes it produces, repeating them
+        if (offset >= len) {
+            memcpy(dst + out, dst + out - offset, len);
+        } else {
+            for (size_t i=0; i<len; i++)
+                dst[out + i] = dst[out - offset + i];
+        }
+        out += len;
+    }
+    return out == raw_size;
+}
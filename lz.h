@@ -0,0 +1,33 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+#include <stddef.h>
+#include <stdbool.h>
+
+// matches are looked for at most this many bytes back
+#define LZ_WINDOW 65535
+
+// shortest match worth encoding
+#define LZ_MIN_MATCH 4
+
+// the compressor remembers the last position of 2^LZ_HASH_BITS hashes
+#define LZ_HASH_BITS 13
+
+// worst-case size of size bytes of incompressible data, once compressed
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+
+/*
+ * function prototypes
+ */
+
+// compresses size bytes from src into dst (which must have room for
+// LZ_BOUND(size) bytes), returns the compressed size; the format is a
+// series of sequences of literal bytes each followed by a match, as in LZ4
+size_t lz_compress(const char* src, const size_t size, char* dst);
+
+// decompresses size bytes from src into raw_size bytes in dst,
+// returns false if the data is corrupted (or does not decompress to
+// exactly raw_size bytes)
+bool lz_decompress(const char* src, const size_t size, char* dst, const size_t raw_size);
+
+#endif
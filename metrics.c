@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "metrics.h"
+
+// a thread writing the metrics into a file every so often
+typedef struct metrics_dumper_struct {
+    pthread_t thread;
+    char* filename;
+    char* tmpname;
+    unsigned int interval;
+    void (*write)(FILE* fd);
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+} metrics_dumper_t;
+
+static atomic_uint_fast64_t counters[METRICS_NUM_COUNTERS];
+static metrics_command_t* commands = NULL;
+static unsigned int num_commands = 0;
+static metrics_dumper_t* dumper = NULL;
+
+static const char* counter_names[METRICS_NUM_COUNTERS] = {
+    "allocations", "allocated_bytes", "bytes_serialized", "bytes_journaled", "books_scanned"
+};
+
+
+void metrics_init(const char** names, const unsigned int num_names) {
+    commands = calloc(num_names, sizeof(metrics_command_t));
+    if (commands == NULL) exit(errno);
+    for (unsigned int i=0; i<num_names; i++)
+        commands[i].name = names[i];
+    num_commands = num_names;
+}
+
+unsigned int metrics_num_commands(void) {
+    return num_commands;
+}
+
+metrics_command_t* metrics_command(const char* name) {
+    if (num_commands == 0)
+        return (metrics_command_t*) NULL;
+    for (unsigned int i=0; i<num_commands - 1; i++) {
+        if (strcmp(commands[i].name, name) == 0)
+            return &commands[i];
+    }
+    return &commands[num_commands - 1];
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void metrics_record(metrics_command_t* command, const uint64_t ns) {
+    if (command != NULL)
+        metrics_histogram_add(&(command->latency), ns);
+}
+
+void metrics_count(const metrics_counter_t counter, const uint64_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+uint64_t metrics_counter(const metrics_counter_t counter) {
+    return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+const char* metrics_counter_name(const metrics_counter_t counter) {
+    return counter_names[counter];
+}
+
+// small values get a bucket each, larger ones share a bucket with the
+// values having the same METRICS_SUB_BUCKET_BITS + 1 leading bits
+static unsigned int bucket_of(uint64_t value) {
+    if (value >> METRICS_MAX_VALUE_BITS)
+        return METRICS_NUM_BUCKETS - 1;
+    if (value < (2U << METRICS_SUB_BUCKET_BITS))
+        return (unsigned int) value;
+    unsigned int shift = (unsigned int) (63 - __builtin_clzll(value)) - METRICS_SUB_BUCKET_BITS;
+    return (shift << METRICS_SUB_BUCKET_BITS) + (unsigned int) (value >> shift);
+}
+
+// the highest value going into a bucket
+static uint64_t bucket_value(const unsigned int bucket) {
+    if (bucket < (2U << METRICS_SUB_BUCKET_BITS))
+        return bucket;
+    unsigned int shift = (bucket >> METRICS_SUB_BUCKET_BITS) - 1;
+    uint64_t lowest = (uint64_t) (bucket - (shift << METRICS_SUB_BUCKET_BITS)) << shift;
+    return lowest + (1ULL << shift) - 1;
+}
+
+void metrics_histogram_add(metrics_histogram_t* hist, const uint64_t value) {
+    atomic_fetch_add_explicit(&(hist->buckets[bucket_of(value)]), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(hist->count), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(hist->sum), value, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&(hist->max), memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&(hist->max), &max, value,
+                memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+uint64_t metrics_histogram_percentile(const metrics_histogram_t* hist, const double fraction) {
+    uint64_t count = atomic_load_explicit(&(hist->count), memory_order_relaxed);
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t) ((double) count * fraction);
+    if (rank >= count)
+        rank = count - 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i=0; i<METRICS_NUM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&(hist->buckets[i]), memory_order_relaxed);
+        if (seen > rank) {
+            // never more than the largest value actually seen, which is
+            // also all that is known about the values in the last bucket
+            uint64_t max = atomic_load_explicit(&(hist->max), memory_order_relaxed);
+            uint64_t value = bucket_value(i);
+            return (value > max || i == METRICS_NUM_BUCKETS - 1) ? max : value;
+        }
+    }
+    return atomic_load_explicit(&(hist->max), memory_order_relaxed);
+}
+
+void metrics_summarize(const unsigned int i, metrics_summary_t* summary) {
+    const metrics_histogram_t* hist = &(commands[i].latency);
+    summary->name = commands[i].name;
+    summary->calls = atomic_load_explicit(&(hist->count), memory_order_relaxed);
+    summary->mean = summary->calls ? atomic_load_explicit(&(hist->sum), memory_order_relaxed) / summary->calls : 0;
+    summary->p50 = metrics_histogram_percentile(hist, 0.5);
+    summary->p90 = metrics_histogram_percentile(hist, 0.9);
+    summary->p99 = metrics_histogram_percentile(hist, 0.99);
+    summary->max = atomic_load_explicit(&(hist->max), memory_order_relaxed);
+}
+
+// writes a new file and renames it over the old one, so that readers
+// never see half of a dump
+static void metrics_dump(const metrics_dumper_t* d) {
+    FILE* fd = fopen(d->tmpname, "w");
+    if (fd == NULL)
+        return;
+    d->write(fd);
+    if (fclose(fd) != 0 || rename(d->tmpname, d->filename) != 0)
+        unlink(d->tmpname);
+}
+
+static void* metrics_dumper(void* arg) {
+    metrics_dumper_t* d = arg;
+    pthread_mutex_lock(&(d->lock));
+    while (!d->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += d->interval;
+        while (!d->stopping && pthread_cond_timedwait(&(d->cond), &(d->lock), &deadline) != ETIMEDOUT)
+            ;
+        metrics_dump(d);
+    }
+    pthread_mutex_unlock(&(d->lock));
+    return NULL;
+}
+
+void metrics_dump_start(const char* filename, const unsigned int interval, void (*write)(FILE* fd)) {
+    if (dumper != NULL)
+        metrics_dump_stop();
+
+    dumper = malloc(sizeof(metrics_dumper_t));
+    if (dumper == NULL) exit(errno);
+    dumper->filename = malloc(strlen(filename) + 1);
+    dumper->tmpname = malloc(strlen(filename) + sizeof(".tmp"));
+    if (dumper->filename == NULL || dumper->tmpname == NULL) exit(errno);
+    strcpy(dumper->filename, filename);
+    strcpy(dumper->tmpname, filename);
+    strcat(dumper->tmpname, ".tmp");
+    dumper->interval = interval ? interval : 1;
+    dumper->write = write;
+    dumper->stopping = false;
+    pthread_mutex_init(&(dumper->lock), NULL);
+    pthread_cond_init(&(dumper->cond), NULL);
+    if (pthread_create(&(dumper->thread), NULL, metrics_dumper, dumper) != 0)
+        exit(errno);
+}
+
+void metrics_dump_stop(void) {
+    if (dumper == NULL)
+        return;
+    pthread_mutex_lock(&(dumper->lock));
+    dumper->stopping = true;
+    pthread_cond_signal(&(dumper->cond));
+    pthread_mutex_unlock(&(dumper->lock));
+    pthread_join(dumper->thread, NULL);
+
+    pthread_mutex_destroy(&(dumper->lock));
+    pthread_cond_destroy(&(dumper->cond));
+    free(dumper->filename);
+    free(dumper->tmpname);
+    free(dumper);
+    dumper = NULL;
+}
+
+void metrics_free(void) {
+    metrics_dump_stop();
+    free(commands);
+    commands = NULL;
+    num_commands = 0;
+    for (unsigned int i=0; i<METRICS_NUM_COUNTERS; i++)
+        atomic_store_explicit(&counters[i], 0, memory_order_relaxed);
+}
@@ -0,0 +1,109 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// latencies are kept with this many bits of precision, that is in buckets
+// at most 1/16 of their lower bound wide
+#define METRICS_SUB_BUCKET_BITS 4
+
+// latencies of 2^40 ns (about 18 minutes) or more all go into the last bucket
+#define METRICS_MAX_VALUE_BITS 40
+
+#define METRICS_NUM_BUCKETS ((METRICS_MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS)
+
+// seconds between dumps of the metrics into a file, unless told otherwise
+#define METRICS_DEFAULT_DUMP_INTERVAL 10
+
+
+/*
+ * structs
+ */
+
+typedef enum metrics_counter_enum {
+    METRICS_ALLOCATIONS, // blocks allocated for books (and their strings)
+    METRICS_ALLOCATED_BYTES,
+    METRICS_BYTES_SERIALIZED, // written into snapshots
+    METRICS_BYTES_JOURNALED, // written into journals
+    METRICS_BOOKS_SCANNED, // gone through by searches and aggregates
+    METRICS_NUM_COUNTERS
+} metrics_counter_t;
+
+// HDR-style histogram: exact up to 2^(METRICS_SUB_BUCKET_BITS + 1),
+// then every power of two split into 2^METRICS_SUB_BUCKET_BITS buckets
+typedef struct metrics_histogram_struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[METRICS_NUM_BUCKETS];
+} metrics_histogram_t;
+
+// calls of a command and how long they took (in nanoseconds)
+typedef struct metrics_command_struct {
+    const char* name;
+    metrics_histogram_t latency;
+} metrics_command_t;
+
+// what gets reported about a command
+typedef struct metrics_summary_struct {
+    const char* name;
+    uint64_t calls;
+    uint64_t mean; // all of the latencies in nanoseconds
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+} metrics_summary_t;
+
+
+/*
+ * function prototypes
+ */
+
+// sets up the commands to record, the last one of which stands for any
+// command not in the list; the names are not copied
+void metrics_init(const char** names, const unsigned int num_names);
+
+// the number of commands set up by metrics_init()
+unsigned int metrics_num_commands(void);
+
+// looks a command up by its name, returns the last one if there is no such
+metrics_command_t* metrics_command(const char* name);
+
+// current time of a monotonic clock in nanoseconds
+uint64_t metrics_now(void);
+
+// records a call of a command that took so many nanoseconds
+void metrics_record(metrics_command_t* command, const uint64_t ns);
+
+// adds to a counter, cheap enough to do from any thread at any time
+void metrics_count(const metrics_counter_t counter, const uint64_t n);
+
+// current value of a counter
+uint64_t metrics_counter(const metrics_counter_t counter);
+
+// name of a counter as shown by the stats command
+const char* metrics_counter_name(const metrics_counter_t counter);
+
+// adds a value to a histogram
+void metrics_histogram_add(metrics_histogram_t* hist, const uint64_t value);
+
+// the value below which (roughly) the given fraction of the values are
+uint64_t metrics_histogram_percentile(const metrics_histogram_t* hist, const double fraction);
+
+// summarizes the calls of the i-th command
+void metrics_summarize(const unsigned int i, metrics_summary_t* summary);
+
+// starts a thread writing the metrics out into a file every so many
+// seconds, through the given function
+void metrics_dump_start(const char* filename, const unsigned int interval, void (*write)(FILE* fd));
+
+// stops the dumping thread, after one last dump
+void metrics_dump_stop(void);
+
+// forgets the commands and zeroes all the counters
+void metrics_free(void);
+
+#endif
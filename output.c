@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <inttypes.h>
+#include "output.h"
+
+
+output_t* output_init(FILE* fd, const output_format_t format, const bool interactive) {
+    output_t* ret = malloc(sizeof(output_t));
+    if (ret == NULL) exit(errno);
+    ret->fd = fd;
+    ret->format = format;
+    ret->interactive = interactive;
+    ret->line = buf_init();
+    buf_reserve(ret->line, 256);
+    return ret;
+}
+
+bool output_parse_format(const char* name, output_format_t* format) {
+    if (strcmp(name, "text") == 0)
+        *format = OUTPUT_TEXT;
+    else if (strcmp(name, "tsv") == 0)
+        *format = OUTPUT_TSV;
+    else if (strcmp(name, "jsonl") == 0)
+        *format = OUTPUT_JSONL;
+    else
+        return false;
+    return true;
+}
+
+static void line_write(buffer_t* line, const char* str) {
+    buf_write(line, str, strlen(str));
+}
+
+static void line_uint(buffer_t* line, uint64_t value) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    buf_write(line, &digits[i], sizeof(digits) - i);
+}
+
+// same as printf("%.2f"), without going through printf for every book
+static void line_price(buffer_t* line, const double price) {
+    if (!isfinite(price) || fabs(price) >= 1e15) {
+        char str[400];
+        int len = snprintf(str, sizeof(str), "%.2f", price);
+        buf_write(line, str, (size_t) len);
+        return;
+    }
+    double cents = rint(fabs(price) * 100);
+    if (price < 0 && cents > 0)
+        buf_write(line, "-", 1);
+    uint64_t value = (uint64_t) cents;
+    line_uint(line, value / 100);
+    char decimals[3] = {'.', (char) ('0' + value / 10 % 10), (char) ('0' + value % 10)};
+    buf_write(line, decimals, sizeof(decimals));
+}
+
+// JSON has no numbers for infinities and NaNs, which can only be there in
+// databases written before prices were checked
+static void line_json_price(buffer_t* line, const double price) {
+    if (isfinite(price))
+        line_price(line, price);
+    else
+        line_write(line, "null");
+}
+
+// quotes a field if it could not be read back by import otherwise
+static void line_tsv_str(buffer_t* line, const char* str) {
+    if (strpbrk(str, "\t\n\r\"") == NULL) {
+        line_write(line, str);
+        return;
+    }
+    buf_write(line, "\"", 1);
+    for (const char* c = str; *c; c++) {
+        if (*c == '"')
+            buf_write(line, "\"", 1);
+        buf_write(line, c, 1);
+    }
+    buf_write(line, "\"", 1);
+}
+
+static void line_json_str(buffer_t* line, const char* str) {
+    buf_write(line, "\"", 1);
+    for (const char* c = str; *c; c++) {
+        const char* run = c;
+        while (*c && *c != '"' && *c != '\\' && (unsigned char) *c >= 0x20)
+            c++;
+        buf_write(line, run, (size_t) (c - run));
+        if (*c == '\0')
+            break;
+        switch (*c) {
+            case '"':
+                line_write(line, "\\\"");
+                break;
+            case '\\':
+                line_write(line, "\\\\");
+                break;
+            case '\n':
+                line_write(line, "\\n");
+                break;
+            case '\t':
+                line_write(line, "\\t");
+                break;
+            case '\r':
+                line_write(line, "\\r");
+                break;
+            default: {
+                char escape[7];
+                snprintf(escape, sizeof(escape), "\\u%04x", (unsigned int) (unsigned char) *c);
+                buf_write(line, escape, 6);
+            }
+        }
+    }
+    buf_write(line, "\"", 1);
+}
+
+// writes out the formatted line and empties it
+static void line_flush(output_t* out) {
+    fwrite(out->line->bytes, 1, out->line->pivot, out->fd);
+    out->line->pivot = out->line->size = 0;
+}
+
+// formats a book into the line, in either TSV or JSONL format
+static void line_book(output_t* out, const book_t* book) {
+    buffer_t* line = out->line;
+    switch (out->format) {
+        case OUTPUT_TSV:
+            line_tsv_str(line, book->isbn);
+            buf_write(line, "\t", 1);
+            line_tsv_str(line, book->title);
+            buf_write(line, "\t", 1);
+            line_tsv_str(line, book->author);
+            buf_write(line, "\t", 1);
+            line_tsv_str(line, book->genre);
+            buf_write(line, "\t", 1);
+            line_uint(line, book->stocked_qty);
+            buf_write(line, "\t", 1);
+            line_uint(line, book->sold_qty);
+            buf_write(line, "\t", 1);
+            line_price(line, book->price);
+            break;
+        case OUTPUT_JSONL:
+            line_write(line, "{\"isbn\":");
+            line_json_str(line, book->isbn);
+            line_write(line, ",\"title\":");
+            line_json_str(line, book->title);
+            line_write(line, ",\"author\":");
+            line_json_str(line, book->author);
+            line_write(line, ",\"genre\":");
+            line_json_str(line, book->genre);
+            line_write(line, ",\"stocked_qty\":");
+            line_uint(line, book->stocked_qty);
+            line_write(line, ",\"sold_qty\":");
+            line_uint(line, book->sold_qty);
+            line_write(line, ",\"price\":");
+            line_json_price(line, book->price);
+            buf_write(line, "}", 1);
+            break;
+        case OUTPUT_TEXT:
+        default:
+            exit(EINVAL);
+    }
+}
+
+void output_book(output_t* out, const book_t* book) {
+    if (out->format == OUTPUT_TEXT) {
+        book_fprint(book, out->fd);
+        return;
+    }
+    line_book(out, book);
+    buf_write(out->line, "\n", 1);
+    line_flush(out);
+}
+
+void output_bookstore(output_t* out, const bookstore_t* store) {
+    if (out->format == OUTPUT_TEXT)
+        fprintf(out->fd, "Number of books: %u\n", store->num_books);
+    for (unsigned int i=0; i<store->num_books; i++)
+        output_book(out, store->books[i]);
+}
+
+void output_bestsellers(output_t* out, const bookstore_t* store, unsigned int howmany) {
+    if (howmany > store->num_books) {
+        if (out->format == OUTPUT_TEXT)
+            fprintf(out->fd, "Warning: you requested more bestsellers than there are books!\n");
+        howmany = store->num_books;
+    }
+    if (howmany == 0)
+        return;
+
+    book_t** top = malloc(howmany * sizeof(book_t*));
+    if (top == NULL) exit(errno);
+    howmany = bookstore_top_sellers(store, howmany, top);
+    for (unsigned int i=0; i<howmany; i++)
+        output_book(out, top[i]);
+    free(top);
+}
+
+void output_window_bestsellers(output_t* out, const bookstore_t* store, unsigned int howmany,
+        const ledger_window_t window) {
+    if (howmany > store->num_books)
+        howmany = store->num_books;
+    if (howmany == 0)
+        return;
+
+    book_t** top = malloc(howmany * sizeof(book_t*));
+    unsigned int* qty = malloc(howmany * sizeof(unsigned int));
+    if (top == NULL || qty == NULL) exit(errno);
+    unsigned int num_top = bookstore_window_top_sellers(store, window, howmany, top, qty);
+    buffer_t* line = out->line;
+    for (unsigned int i=0; i<num_top; i++) {
+        switch (out->format) {
+            case OUTPUT_TEXT:
+                fprintf(out->fd, "%u sold: ", qty[i]);
+                book_fprint(top[i], out->fd);
+                continue;
+            case OUTPUT_TSV:
+                line_uint(line, qty[i]);
+                buf_write(line, "\t", 1);
+                line_book(out, top[i]);
+                break;
+            case OUTPUT_JSONL:
+                line_write(line, "{\"window_sold_qty\":");
+                line_uint(line, qty[i]);
+                line_write(line, ",\"book\":");
+                line_book(out, top[i]);
+                buf_write(line, "}", 1);
+                break;
+            default:
+                exit(EINVAL);
+        }
+        buf_write(line, "\n", 1);
+        line_flush(out);
+    }
+    free(top);
+    free(qty);
+}
+
+void output_sold_out(output_t* out, const bookstore_t* store) {
+    const unsigned int* stocked_qty = store->columns.stocked_qty;
+    metrics_count(METRICS_BOOKS_SCANNED, store->num_books);
+    for (unsigned int i=0; i<store->num_books; i++) {
+        if (stocked_qty[i] == 0)
+            output_book(out, store->books[i]);
+    }
+}
+
+void output_totals(output_t* out, const bookstore_t* store) {
+    buffer_t* line = out->line;
+    switch (out->format) {
+        case OUTPUT_TEXT:
+            return;
+        case OUTPUT_TSV:
+            line_uint(line, store->num_books);
+            buf_write(line, "\t", 1);
+            line_uint(line, store->totals.units_sold);
+            buf_write(line, "\t", 1);
+            line_price(line, store->totals.revenue);
+            buf_write(line, "\t", 1);
+            line_uint(line, store->totals.units_in_stock);
+            buf_write(line, "\t", 1);
+            line_price(line, store->totals.stock_value);
+            break;
+        case OUTPUT_JSONL:
+            line_write(line, "{\"books\":");
+            line_uint(line, store->num_books);
+            line_write(line, ",\"units_sold\":");
+            line_uint(line, store->totals.units_sold);
+            line_write(line, ",\"revenue\":");
+            line_json_price(line, store->totals.revenue);
+            line_write(line, ",\"units_in_stock\":");
+            line_uint(line, store->totals.units_in_stock);
+            line_write(line, ",\"stock_value\":");
+            line_json_price(line, store->totals.stock_value);
+            buf_write(line, "}", 1);
+            break;
+        default:
+            exit(EINVAL);
+    }
+    buf_write(line, "\n", 1);
+    line_flush(out);
+}
+
+// latencies are recorded in nanoseconds, but shown in microseconds
+static double micros(const uint64_t ns) {
+    return (double) ns / 1000;
+}
+
+static void output_command_metrics(output_t* out, const metrics_summary_t* s) {
+    buffer_t* line = out->line;
+    switch (out->format) {
+        case OUTPUT_TEXT:
+            fprintf(out->fd, "%-10s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", s->name, s->calls,
+                    micros(s->mean), micros(s->p50), micros(s->p90), micros(s->p99), micros(s->max));
+            return;
+        case OUTPUT_TSV:
+            line_write(line, "command\t");
+            line_tsv_str(line, s->name);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->calls);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->mean);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->p50);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->p90);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->p99);
+            buf_write(line, "\t", 1);
+            line_uint(line, s->max);
+            break;
+        case OUTPUT_JSONL:
+            line_write(line, "{\"command\":");
+            line_json_str(line, s->name);
+            line_write(line, ",\"calls\":");
+            line_uint(line, s->calls);
+            line_write(line, ",\"mean_ns\":");
+            line_uint(line, s->mean);
+            line_write(line, ",\"p50_ns\":");
+            line_uint(line, s->p50);
+            line_write(line, ",\"p90_ns\":");
+            line_uint(line, s->p90);
+            line_write(line, ",\"p99_ns\":");
+            line_uint(line, s->p99);
+            line_write(line, ",\"max_ns\":");
+            line_uint(line, s->max);
+            buf_write(line, "}", 1);
+            break;
+        default:
+            exit(EINVAL);
+    }
+    buf_write(line, "\n", 1);
+    line_flush(out);
+}
+
+static void output_counter(output_t* out, const metrics_counter_t counter) {
+    buffer_t* line = out->line;
+    switch (out->format) {
+        case OUTPUT_TEXT:
+            fprintf(out->fd, "%s: %" PRIu64 "\n", metrics_counter_name(counter), metrics_counter(counter));
+            return;
+        case OUTPUT_TSV:
+            line_write(line, "counter\t");
+            line_write(line, metrics_counter_name(counter));
+            buf_write(line, "\t", 1);
+            line_uint(line, metrics_counter(counter));
+            break;
+        case OUTPUT_JSONL:
+            line_write(line, "{\"counter\":\"");
+            line_write(line, metrics_counter_name(counter));
+            line_write(line, "\",\"value\":");
+            line_uint(line, metrics_counter(counter));
+            buf_write(line, "}", 1);
+            break;
+        default:
+            exit(EINVAL);
+    }
+    buf_write(line, "\n", 1);
+    line_flush(out);
+}
+
+void output_metrics(output_t* out) {
+    if (out->format == OUTPUT_TEXT)
+        fprintf(out->fd, "%-10s %10s %10s %10s %10s %10s %10s\n", "Command", "Calls",
+                "Mean (us)", "p50", "p90", "p99", "Max");
+    for (unsigned int i=0; i<metrics_num_commands(); i++) {
+        metrics_summary_t summary;
+        metrics_summarize(i, &summary);
+        if (summary.calls > 0)
+            output_command_metrics(out, &summary);
+    }
+    for (unsigned int i=0; i<METRICS_NUM_COUNTERS; i++)
+        output_counter(out, (metrics_counter_t) i);
+}
+
+void output_free(output_t* out) {
+    buf_free(out->line);
+    free(out);
+    out = NULL;
+}
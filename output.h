@@ -0,0 +1,71 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+#include <stdio.h>
+#include <stdbool.h>
+#include "buffer.h"
+#include "bookstore.h"
+#include "metrics.h"
+
+// size of the stdio buffer used for non-interactive output
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+
+/*
+ * structs
+ */
+
+typedef enum output_format_enum {
+    OUTPUT_TEXT, // human-readable, as printed by book_print()
+    OUTPUT_TSV, // one tab-separated line per book, in the order "bookadd" and "import" take the fields
+    OUTPUT_JSONL // one JSON object per line
+} output_format_t;
+
+// where and how command results are written
+typedef struct output_struct {
+    FILE* fd;
+    output_format_t format;
+    bool interactive; // print prompts and ask for confirmations
+    buffer_t* line; // scratch space a record is formatted in
+} output_t;
+
+
+/*
+ * function prototypes
+ */
+
+// sets up an output writing into an open file
+output_t* output_init(FILE* fd, const output_format_t format, const bool interactive);
+
+// looks a format up by its name ("text", "tsv" or "jsonl")
+bool output_parse_format(const char* name, output_format_t* format);
+
+// writes a book
+void output_book(output_t* out, const book_t* book);
+
+// writes all the books in a bookstore (preceded by their count in text format)
+void output_bookstore(output_t* out, const bookstore_t* store);
+
+// writes top N bestsellers from the bookstore
+void output_bestsellers(output_t* out, const bookstore_t* store, unsigned int howmany);
+
+// writes top N books sold within a window of the bookstore's ledger, each
+// along with the units of it sold within the window (as the first field in
+// TSV format, or wrapping the book in JSONL format)
+void output_window_bestsellers(output_t* out, const bookstore_t* store, unsigned int howmany,
+        const ledger_window_t window);
+
+// writes sold-out books in the bookstore
+void output_sold_out(output_t* out, const bookstore_t* store);
+
+// writes the bookstore's sales and inventory totals as a single record
+// (not used in text format, where commands print their own summaries)
+void output_totals(output_t* out, const bookstore_t* store);
+
+// writes the calls and latencies of every command called so far
+// and the values of all the counters
+void output_metrics(output_t* out);
+
+// deallocates the output (but does not close its file)
+void output_free(output_t* out);
+
+#endif
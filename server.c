@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "server.h"
+
+static volatile sig_atomic_t server_stop = 0;
+
+
+static void server_on_signal(int sig) {
+    (void) sig;
+    server_stop = 1;
+}
+
+// whether a command line asks to close the connection
+static bool server_is_exit(const char* line) {
+    line += strspn(line, " \t");
+    size_t len = strcspn(line, " \t");
+    return (len == 4 && strncmp(line, "exit", 4) == 0)
+        || (len == 4 && strncmp(line, "quit", 4) == 0);
+}
+
+// whether a line read by fgets() was cut short by the size of its buffer,
+// in which case the rest of it gets read and thrown away
+static bool server_skip_long_line(FILE* in, const char* line) {
+    if (strchr(line, '\n') != NULL || feof(in))
+        return false;
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n')
+        ;
+    return true;
+}
+
+// runs a command line against the bookstore, under the lock it needs
+static void server_dispatch(server_t* server, output_t* out, char* line) {
+    if (server->commands->report(line)) {
+        pthread_rwlock_rdlock(&(server->store_lock));
+        bookstore_snapshot_t* snap = bookstore_snapshot(server->store);
+        pthread_rwlock_unlock(&(server->store_lock));
+        server->commands->run(&(snap->view), out, line);
+        bookstore_snapshot_release(snap);
+    } else if (server->commands->read_only(line)) {
+        pthread_rwlock_rdlock(&(server->store_lock));
+        server->commands->run(server->store, out, line);
+        pthread_rwlock_unlock(&(server->store_lock));
+    } else {
+        pthread_rwlock_wrlock(&(server->store_lock));
+        server->store = server->commands->run(server->store, out, line);
+        pthread_rwlock_unlock(&(server->store_lock));
+    }
+}
+
+static void server_serve(server_t* server, const int fd) {
+    int out_fd = dup(fd);
+    FILE* in = fdopen(fd, "r");
+    FILE* out_file = (out_fd == -1) ? NULL : fdopen(out_fd, "w");
+    if (in == NULL || out_file == NULL) {
+        if (in != NULL)
+            fclose(in);
+        else
+            close(fd);
+        if (out_fd != -1)
+            close(out_fd);
+        return;
+    }
+
+    output_t* out = output_init(out_file, server->format, false);
+    char line[SERVER_MAX_LINE];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (server_skip_long_line(in, line)) {
+            fprintf(out_file, "Command too long (over %d bytes), ignoring it!\n", SERVER_MAX_LINE - 1);
+        } else {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (server_is_exit(line))
+                break;
+            server_dispatch(server, out, line);
+        }
+
+        fputc('\0', out_file);
+        if (fflush(out_file) != 0)
+            break;
+    }
+
+    output_free(out);
+    fclose(out_file);
+    fclose(in);
+}
+
+static void* server_worker(void* arg) {
+    server_worker_t* worker = arg;
+    server_t* server = worker->server;
+
+    while (true) {
+        pthread_mutex_lock(&(server->pending_lock));
+        while (server->num_pending == 0 && !server->stopping)
+            pthread_cond_wait(&(server->pending_cond), &(server->pending_lock));
+        if (server->stopping) {
+            pthread_mutex_unlock(&(server->pending_lock));
+            return NULL;
+        }
+        int fd = server->pending[server->first_pending];
+        server->first_pending = (server->first_pending + 1) % SERVER_MAX_PENDING;
+        server->num_pending--;
+        worker->fd = fd;
+        pthread_mutex_unlock(&(server->pending_lock));
+
+        server_serve(server, fd);
+
+        pthread_mutex_lock(&(server->pending_lock));
+        worker->fd = -1;
+        pthread_mutex_unlock(&(server->pending_lock));
+    }
+}
+
+server_t* server_init(bookstore_t* store, const char* path, const unsigned int num_threads,
+        const server_commands_t* commands, const output_format_t format) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long!\n", path);
+        exit(1);
+    }
+
+    server_t* ret = malloc(sizeof(server_t));
+    if (ret == NULL) exit(errno);
+    ret->store = store;
+    ret->commands = commands;
+    ret->format = format;
+    ret->path = malloc(strlen(path) + 1);
+    if (ret->path == NULL) exit(errno);
+    strcpy(ret->path, path);
+    ret->pending = malloc(SERVER_MAX_PENDING * sizeof(int));
+    if (ret->pending == NULL) exit(errno);
+    ret->num_pending = 0;
+    ret->first_pending = 0;
+    ret->stopping = false;
+    pthread_mutex_init(&(ret->pending_lock), NULL);
+    pthread_cond_init(&(ret->pending_cond), NULL);
+
+    // writers are preferred, so that a steady stream of readers cannot
+    // hold off changes indefinitely
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(ret->store_lock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    ret->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ret->listen_fd == -1) exit(errno);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // a socket left behind by an earlier run is replaced, anything else
+    // at the path is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("Cannot listen on %s, something other than a socket is there!\n", path);
+            exit(EEXIST);
+        }
+        unlink(path);
+    }
+    if (bind(ret->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+            || listen(ret->listen_fd, SOMAXCONN) == -1) {
+        printf("Cannot listen on %s!\n", path);
+        exit(errno);
+    }
+
+    ret->num_workers = num_threads ? num_threads : 1;
+    ret->workers = malloc(ret->num_workers * sizeof(server_worker_t));
+    if (ret->workers == NULL) exit(errno);
+    for (unsigned int i=0; i<ret->num_workers; i++) {
+        ret->workers[i].server = ret;
+        ret->workers[i].fd = -1;
+        if (pthread_create(&(ret->workers[i].thread), NULL, server_worker, &(ret->workers[i])) != 0)
+            exit(errno);
+    }
+    return ret;
+}
+
+bookstore_t* server_run(server_t* server) {
+    // no SA_RESTART, so that the signals interrupt accept()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_on_signal;
+    sigemptyset(&(sa.sa_mask));
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!server_stop) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        pthread_mutex_lock(&(server->pending_lock));
+        if (server->num_pending == SERVER_MAX_PENDING) {
+            close(fd);
+        } else {
+            server->pending[(server->first_pending + server->num_pending) % SERVER_MAX_PENDING] = fd;
+            server->num_pending++;
+            pthread_cond_signal(&(server->pending_cond));
+        }
+        pthread_mutex_unlock(&(server->pending_lock));
+    }
+
+    // cut off the connections being served and let the workers finish
+    pthread_mutex_lock(&(server->pending_lock));
+    server->stopping = true;
+    for (unsigned int i=0; i<server->num_workers; i++) {
+        if (server->workers[i].fd != -1)
+            shutdown(server->workers[i].fd, SHUT_RDWR);
+    }
+    while (server->num_pending > 0) {
+        close(server->pending[server->first_pending]);
+        server->first_pending = (server->first_pending + 1) % SERVER_MAX_PENDING;
+        server->num_pending--;
+    }
+    pthread_cond_broadcast(&(server->pending_cond));
+    pthread_mutex_unlock(&(server->pending_lock));
+    for (unsigned int i=0; i<server->num_workers; i++)
+        pthread_join(server->workers[i].thread, NULL);
+
+    return server->store;
+}
+
+void server_free(server_t* server) {
+    close(server->listen_fd);
+    unlink(server->path);
+    free(server->path);
+    free(server->workers);
+    free(server->pending);
+    pthread_rwlock_destroy(&(server->store_lock));
+    pthread_mutex_destroy(&(server->pending_lock));
+    pthread_cond_destroy(&(server->pending_cond));
+    free(server);
+    server = NULL;
+}
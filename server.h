@@ -0,0 +1,81 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+#include <stdbool.h>
+#include <pthread.h>
+#include "bookstore.h"
+#include "output.h"
+
+// number of worker threads serving connections, unless told otherwise
+#define SERVER_DEFAULT_THREADS 8
+
+// connections waiting for a free worker beyond this many are refused
+#define SERVER_MAX_PENDING 1024
+
+// longest command line a client can send (including its newline), longer
+// ones are rejected
+#define SERVER_MAX_LINE 1024
+
+
+/*
+ * structs
+ */
+
+// what the server needs to know about the commands it runs
+typedef struct server_commands_struct {
+    // runs a command line, returns the (possibly replaced) bookstore
+    bookstore_t* (*run)(bookstore_t* store, output_t* out, char* line);
+    // whether a command line only reads the bookstore
+    bool (*read_only)(const char* line);
+    // whether a command line (which has to be a read-only one) is a report
+    // that can run on a snapshot of the bookstore
+    bool (*report)(const char* line);
+} server_commands_t;
+
+struct server_struct;
+
+// a thread serving one connection at a time
+typedef struct server_worker_struct {
+    struct server_struct* server;
+    pthread_t thread;
+    int fd; // connection being served, -1 if idle
+} server_worker_t;
+
+// serves a bookstore over a Unix domain socket: clients send one command
+// per line and get the output of each, terminated by a NUL byte; read-only
+// commands run in parallel, changes to the bookstore one at a time, and
+// reports on snapshots taken without holding changes off while they run
+typedef struct server_struct {
+    bookstore_t* store;
+    pthread_rwlock_t store_lock;
+    const server_commands_t* commands;
+    output_format_t format; // initial output format of every connection
+    int listen_fd;
+    char* path;
+    unsigned int num_workers;
+    server_worker_t* workers;
+    int* pending; // accepted connections waiting for a worker (ring buffer)
+    unsigned int num_pending;
+    unsigned int first_pending;
+    pthread_mutex_t pending_lock;
+    pthread_cond_t pending_cond;
+    bool stopping;
+} server_t;
+
+
+/*
+ * function prototypes
+ */
+
+// creates a server listening on a socket at the given path
+server_t* server_init(bookstore_t* store, const char* path, const unsigned int num_threads,
+        const server_commands_t* commands, const output_format_t format);
+
+// accepts and serves connections until the process gets SIGINT or SIGTERM,
+// returns the bookstore as the clients left it
+bookstore_t* server_run(server_t* server);
+
+// stops the workers, removes the socket and deallocates the server
+// (but not the bookstore)
+void server_free(server_t* server);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "skiplist.h"
+#include "bookstore.h"
+
+// a key to be sorted along with its book, while building an index
+typedef struct skiplist_entry_struct {
+    uint64_t bits;
+    book_t* book;
+} skiplist_entry_t;
+
+
+static double skiplist_key(const skiplist_t* list, const book_t* book) {
+    switch (list->field) {
+        case BOOK_FIELD_PRICE:
+            return book->price;
+        case BOOK_FIELD_STOCKED_QTY:
+            return (double) book->stocked_qty;
+        case BOOK_FIELD_AUTHOR:
+        case BOOK_FIELD_GENRE:
+        default:
+            exit(EINVAL);
+    }
+}
+
+// maps a key to an integer ordered the same way, zeros of either sign to
+// the same one as they are equal, and NaNs past the infinities of their
+// sign, so that every key has its place in the order
+static uint64_t skiplist_key_bits(const double key) {
+    double zero_fixed = key + 0.0;
+    uint64_t bits;
+    memcpy(&bits, &zero_fixed, sizeof(uint64_t));
+    return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+// orders a key (mapped as above) and seq against the ones of a node
+static int skiplist_cmp(const uint64_t key, const uint64_t seq, const skiplist_node_t* node) {
+    if (key != node->key)
+        return (key > node->key) - (key < node->key);
+    return (seq > node->seq) - (seq < node->seq);
+}
+
+// sorts entries by their keys (least significant byte first, each pass
+// being stable), keeping the entries with equal keys in the order given
+static void skiplist_sort(skiplist_entry_t* entries, const unsigned int num_entries) {
+    unsigned int counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (unsigned int i=0; i<num_entries; i++) {
+        for (unsigned int b=0; b<8; b++)
+            counts[b][(entries[i].bits >> (8 * b)) & 0xff]++;
+    }
+
+    skiplist_entry_t* tmp = malloc(num_entries * sizeof(skiplist_entry_t));
+    if (tmp == NULL) exit(errno);
+    skiplist_entry_t* src = entries;
+    skiplist_entry_t* dst = tmp;
+    for (unsigned int b=0; b<8; b++) {
+        // nothing to do if all the keys have the same byte here
+        if (counts[b][(src[0].bits >> (8 * b)) & 0xff] == num_entries)
+            continue;
+        unsigned int pos = 0;
+        for (unsigned int v=0; v<256; v++) {
+            unsigned int count = counts[b][v];
+            counts[b][v] = pos;
+            pos += count;
+        }
+        for (unsigned int i=0; i<num_entries; i++)
+            dst[counts[b][(src[i].bits >> (8 * b)) & 0xff]++] = src[i];
+        skiplist_entry_t* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != entries)
+        memcpy(entries, src, num_entries * sizeof(skiplist_entry_t));
+    free(tmp);
+}
+
+// xorshift64*, two bits of which decide every next level
+static unsigned int skiplist_random_level(skiplist_t* list) {
+    list->rng ^= list->rng >> 12;
+    list->rng ^= list->rng << 25;
+    list->rng ^= list->rng >> 27;
+    uint64_t bits = (list->rng * 2685821657736338717ULL) >> 32;
+    unsigned int ret = 1;
+    while (ret < SKIPLIST_MAX_LEVEL && (bits & 3) == 0) {
+        ret++;
+        bits >>= 2;
+    }
+    return ret;
+}
+
+static size_t skiplist_node_size(const unsigned int level) {
+    return sizeof(skiplist_node_t) + level * sizeof(skiplist_node_t*);
+}
+
+static skiplist_node_t* skiplist_node_init(skiplist_t* list, book_t* book, const uint64_t key,
+        const unsigned int level) {
+    skiplist_node_t* ret = arena_alloc(list->arena, skiplist_node_size(level));
+    ret->book = book;
+    ret->key = key;
+    ret->seq = (book == NULL) ? 0 : book->seq;
+    ret->level = level;
+    memset(ret->next, 0, level * sizeof(skiplist_node_t*));
+    return ret;
+}
+
+skiplist_t* skiplist_init(const book_field_t field) {
+    skiplist_t* ret = malloc(sizeof(skiplist_t));
+    if (ret == NULL) exit(errno);
+    ret->field = field;
+    ret->level = 1;
+    ret->num_books = 0;
+    ret->rng = 0x9E3779B97F4A7C15ULL;
+    ret->arena = arena_init();
+    ret->head = skiplist_node_init(ret, NULL, 0, SKIPLIST_MAX_LEVEL);
+    return ret;
+}
+
+// finds the last node before the given key and seq on every level
+static void skiplist_find(const skiplist_t* list, const uint64_t key, const uint64_t seq,
+        skiplist_node_t** update) {
+    skiplist_node_t* node = list->head;
+    for (unsigned int i=list->level; i-- > 0;) {
+        while (node->next[i] != NULL && skiplist_cmp(key, seq, node->next[i]) > 0)
+            node = node->next[i];
+        update[i] = node;
+    }
+}
+
+void skiplist_insert(skiplist_t* list, book_t* book) {
+    skiplist_node_t* update[SKIPLIST_MAX_LEVEL];
+    uint64_t key = skiplist_key_bits(skiplist_key(list, book));
+    skiplist_find(list, key, book->seq, update);
+
+    unsigned int level = skiplist_random_level(list);
+    for (unsigned int i=list->level; i<level; i++)
+        update[i] = list->head;
+    if (level > list->level)
+        list->level = level;
+
+    skiplist_node_t* node = skiplist_node_init(list, book, key, level);
+    for (unsigned int i=0; i<level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    list->num_books++;
+}
+
+void skiplist_insert_all(skiplist_t* list, book_t** books, const unsigned int num_books) {
+    if (list->num_books > 0) {
+        for (unsigned int i=0; i<num_books; i++)
+            skiplist_insert(list, books[i]);
+        return;
+    }
+    if (num_books == 0)
+        return;
+
+    // an empty list can be built without searching: sort the books by their
+    // keys (the books coming in the order they were added, which a stable
+    // sort keeps for equal keys), then allocate and link up the nodes in
+    // order, which also keeps neighbours close in memory
+    skiplist_entry_t* sorted = malloc(num_books * sizeof(skiplist_entry_t));
+    if (sorted == NULL) exit(errno);
+    for (unsigned int i=0; i<num_books; i++) {
+        sorted[i].bits = skiplist_key_bits(skiplist_key(list, books[i]));
+        sorted[i].book = books[i];
+    }
+    skiplist_sort(sorted, num_books);
+
+    skiplist_node_t* last[SKIPLIST_MAX_LEVEL];
+    for (unsigned int i=0; i<SKIPLIST_MAX_LEVEL; i++)
+        last[i] = list->head;
+    for (unsigned int i=0; i<num_books; i++) {
+        skiplist_node_t* node = skiplist_node_init(list, sorted[i].book,
+                sorted[i].bits, skiplist_random_level(list));
+        for (unsigned int j=0; j<node->level; j++) {
+            last[j]->next[j] = node;
+            last[j] = node;
+        }
+        if (node->level > list->level)
+            list->level = node->level;
+    }
+    list->num_books = num_books;
+    free(sorted);
+}
+
+void skiplist_remove(skiplist_t* list, const book_t* book) {
+    skiplist_node_t* update[SKIPLIST_MAX_LEVEL];
+    skiplist_find(list, skiplist_key_bits(skiplist_key(list, book)), book->seq, update);
+    skiplist_node_t* node = update[0]->next[0];
+    if (node == NULL || node->book != book)
+        return;
+
+    for (unsigned int i=0; i<node->level; i++)
+        update[i]->next[i] = node->next[i];
+    while (list->level > 1 && list->head->next[list->level - 1] == NULL)
+        list->level--;
+    arena_release(list->arena, node, skiplist_node_size(node->level));
+    list->num_books--;
+}
+
+void skiplist_replace(skiplist_t* list, const book_t* book, book_t* copy) {
+    skiplist_node_t* update[SKIPLIST_MAX_LEVEL];
+    skiplist_find(list, skiplist_key_bits(skiplist_key(list, book)), book->seq, update);
+    skiplist_node_t* node = update[0]->next[0];
+    if (node != NULL && node->book == book)
+        node->book = copy;
+}
+
+void skiplist_range(const skiplist_t* list, const double min, const double max, skiplist_iter_t* it) {
+    const skiplist_node_t* node = list->head;
+    uint64_t min_key = skiplist_key_bits(min);
+    for (unsigned int i=list->level; i-- > 0;) {
+        while (node->next[i] != NULL && node->next[i]->key < min_key)
+            node = node->next[i];
+    }
+    it->node = node->next[0];
+    it->max = skiplist_key_bits(max);
+}
+
+book_t* skiplist_iter_next(skiplist_iter_t* it) {
+    if (it->node == NULL || it->node->key > it->max)
+        return (book_t*) NULL;
+    book_t* ret = it->node->book;
+    it->node = it->node->next[0];
+    return ret;
+}
+
+void skiplist_free(skiplist_t* list) {
+    arena_free(list->arena);
+    list->arena = NULL;
+    list->head = NULL;
+    free(list);
+    list = NULL;
+}
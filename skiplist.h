@@ -0,0 +1,74 @@
+#ifndef __SKIPLIST_H__
+#define __SKIPLIST_H__
+#include <stdint.h>
+#include "index.h"
+#include "arena.h"
+
+// a node is on level i + 1 with probability 1/4 if it is on level i
+#define SKIPLIST_MAX_LEVEL 16
+
+struct book_struct;
+
+
+/*
+ * structs
+ */
+
+typedef struct skiplist_node_struct {
+    struct book_struct* book;
+    uint64_t key; // the book's key mapped to an integer ordered the same way, NaNs included
+    uint64_t seq; // the book's, so that ties are broken without looking at it
+    unsigned int level; // number of forward pointers
+    struct skiplist_node_struct* next[]; // one per level, NULL at the end
+} skiplist_node_t;
+
+// ordered index of books over a numeric attribute, books with equal keys
+// being ordered by when they were added to their bookstore
+typedef struct skiplist_struct {
+    book_field_t field;
+    unsigned int level; // highest level of any node
+    unsigned int num_books;
+    uint64_t rng; // picks the node levels
+    arena_t* arena; // where the nodes are allocated from
+    skiplist_node_t* head; // on every level, but holds no book
+} skiplist_t;
+
+// iterator over the books with keys within a range, in order, valid until
+// the index changes
+typedef struct skiplist_iter_struct {
+    const skiplist_node_t* node; // the next one to return
+    uint64_t max; // mapped like the keys of the nodes
+} skiplist_iter_t;
+
+
+/*
+ * function prototypes
+ */
+
+// allocates a new empty index over the given book attribute (which has to
+// be BOOK_FIELD_PRICE or BOOK_FIELD_STOCKED_QTY)
+skiplist_t* skiplist_init(const book_field_t field);
+
+// inserts a book into the index
+void skiplist_insert(skiplist_t* list, struct book_struct* book);
+
+// inserts many books, given in the order they were added to their bookstore,
+// linking them up in one go after sorting them if the index is still empty
+void skiplist_insert_all(skiplist_t* list, struct book_struct** books, const unsigned int num_books);
+
+// removes a book from the index, looking it up by its current key and seq
+void skiplist_remove(skiplist_t* list, const struct book_struct* book);
+
+// puts a copy of a book (with the same key and seq) where the book was
+void skiplist_replace(skiplist_t* list, const struct book_struct* book, struct book_struct* copy);
+
+// sets up an iterator over the books with keys between min and max (inclusive)
+void skiplist_range(const skiplist_t* list, const double min, const double max, skiplist_iter_t* it);
+
+// returns the next book from an iterator, or NULL when there are no more
+struct book_struct* skiplist_iter_next(skiplist_iter_t* it);
+
+// deallocates the index (but not the books in it)
+void skiplist_free(skiplist_t* list);
+
+#endif
@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "trigram.h"
+#include "bookstore.h"
+
+#define TRIGRAM_INDEX_MIN_SLOTS 1024
+
+// the table is grown once it gets more than 70% full
+#define TRIGRAM_INDEX_FULL(used, slots) ((used) * 10 >= (slots) * 7)
+
+
+static unsigned char trigram_fold(const unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char) (c - 'A' + 'a') : c;
+}
+
+// never 0, as the first byte of a trigram is never a null byte
+static uint32_t trigram_key(const char* str) {
+    const unsigned char* s = (const unsigned char*) str;
+    return (uint32_t) trigram_fold(s[0]) << 16 | (uint32_t) trigram_fold(s[1]) << 8
+        | trigram_fold(s[2]);
+}
+
+static size_t trigram_hash(const uint32_t key) {
+    return (size_t) (((uint64_t) key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// the slot holding a key, or the empty one where it would go
+static trigram_list_t* trigram_slot(const trigram_index_t* idx, const uint32_t key) {
+    size_t mask = idx->num_slots - 1;
+    size_t i = trigram_hash(key) & mask;
+    while (idx->slots[i].key != 0 && idx->slots[i].key != key)
+        i = (i + 1) & mask;
+    return &(idx->slots[i]);
+}
+
+trigram_index_t* trigram_index_init(void) {
+    trigram_index_t* ret = malloc(sizeof(trigram_index_t));
+    if (ret == NULL) exit(errno);
+    ret->num_slots = 0;
+    ret->num_used = 0;
+    ret->slots = NULL;
+    return ret;
+}
+
+static void trigram_index_rehash(trigram_index_t* idx, const size_t num_slots) {
+    trigram_list_t* old_slots = idx->slots;
+    size_t old_num_slots = idx->num_slots;
+
+    idx->slots = calloc(num_slots, sizeof(trigram_list_t));
+    if (idx->slots == NULL) exit(errno);
+    idx->num_slots = num_slots;
+
+    for (size_t i=0; i<old_num_slots; i++) {
+        if (old_slots[i].key != 0)
+            *trigram_slot(idx, old_slots[i].key) = old_slots[i];
+    }
+
+    free(old_slots);
+}
+
+// the list of a trigram, created if there is none yet
+static trigram_list_t* trigram_index_list(trigram_index_t* idx, const uint32_t key) {
+    if (TRIGRAM_INDEX_FULL(idx->num_used + 1, idx->num_slots))
+        trigram_index_rehash(idx, idx->num_slots ? idx->num_slots * 2 : TRIGRAM_INDEX_MIN_SLOTS);
+
+    trigram_list_t* ret = trigram_slot(idx, key);
+    if (ret->key == 0) {
+        ret->key = key;
+        idx->num_used++;
+    }
+    return ret;
+}
+
+// the list of a trigram, NULL if no title has it
+static trigram_list_t* trigram_index_find(const trigram_index_t* idx, const uint32_t key) {
+    if (idx->num_slots == 0)
+        return (trigram_list_t*) NULL;
+    trigram_list_t* ret = trigram_slot(idx, key);
+    if (ret->key == 0 || ret->num_books == ret->num_removed)
+        return (trigram_list_t*) NULL;
+    return ret;
+}
+
+// position of the first book in a list at or after pos (but before end),
+// end if all of them have been removed
+static unsigned int trigram_skip_removed(const trigram_list_t* list, unsigned int pos,
+        const unsigned int end) {
+    while (pos < end && list->books[pos] == NULL)
+        pos++;
+    return pos;
+}
+
+// position of the first book in a list, from lo on, whose seq is not less
+// than seq, given that none of the books from hi on is less either; the
+// books removed are stepped over to the next one still there
+static unsigned int trigram_bisect(const trigram_list_t* list, unsigned int lo, unsigned int hi,
+        const uint64_t seq) {
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        unsigned int next = trigram_skip_removed(list, mid, hi);
+        if (next == hi)
+            hi = mid;
+        else if (list->books[next]->seq < seq)
+            lo = next + 1;
+        else
+            hi = next;
+    }
+    return trigram_skip_removed(list, lo, list->num_books);
+}
+
+// same as trigram_bisect() over the rest of a list starting at lo, but
+// galloping ahead first keeps skipping through a long list cheap when
+// the positions looked for are far apart
+static unsigned int trigram_gallop(const trigram_list_t* list, unsigned int lo, const uint64_t seq) {
+    unsigned int hi = trigram_skip_removed(list, lo, list->num_books);
+    unsigned int step = 1;
+    while (hi < list->num_books && list->books[hi]->seq < seq) {
+        lo = hi + 1;
+        hi = (list->num_books - hi <= step) ? list->num_books : hi + step;
+        hi = trigram_skip_removed(list, hi, list->num_books);
+        step *= 2;
+    }
+    return trigram_bisect(list, lo, hi, seq);
+}
+
+void trigram_index_insert(trigram_index_t* idx, book_t* book) {
+    const char* title = book->title;
+    for (size_t i=0; title[i] && title[i + 1] && title[i + 2]; i++) {
+        trigram_list_t* list = trigram_index_list(idx, trigram_key(&title[i]));
+        // the book comes last in every list it is in, so a trigram seen
+        // before in the same title is easy to tell
+        if (list->num_books > 0 && list->books[list->num_books - 1] == book)
+            continue;
+        if (list->num_books == list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 4;
+            list->books = realloc(list->books, list->capacity * sizeof(book_t*));
+            if (list->books == NULL) exit(errno);
+        }
+        list->books[list->num_books++] = book;
+    }
+}
+
+void trigram_index_insert_all(trigram_index_t* idx, book_t** books, const unsigned int num_books) {
+    for (unsigned int i=0; i<num_books; i++)
+        trigram_index_insert(idx, books[i]);
+}
+
+void trigram_index_remove(trigram_index_t* idx, const book_t* book) {
+    const char* title = book->title;
+    for (size_t i=0; title[i] && title[i + 1] && title[i + 2]; i++) {
+        trigram_list_t* list = trigram_index_find(idx, trigram_key(&title[i]));
+        if (list == NULL)
+            continue;
+        unsigned int pos = trigram_bisect(list, 0, list->num_books, book->seq);
+        // already gone if the trigram occurs more than once in the title
+        if (pos >= list->num_books || list->books[pos] != book)
+            continue;
+
+        list->books[pos] = NULL;
+        list->num_removed++;
+        while (list->num_books > 0 && list->books[list->num_books - 1] == NULL) {
+            list->num_books--;
+            list->num_removed--;
+        }
+        if (list->num_removed * 2 >= list->num_books && list->num_removed > 0) {
+            unsigned int kept = 0;
+            for (unsigned int j=0; j<list->num_books; j++) {
+                if (list->books[j] != NULL)
+                    list->books[kept++] = list->books[j];
+            }
+            list->num_books = kept;
+            list->num_removed = 0;
+        }
+        if (list->num_books == 0) {
+            free(list->books);
+            list->books = NULL;
+            list->capacity = 0;
+        }
+    }
+}
+
+void trigram_index_replace(trigram_index_t* idx, const book_t* book, book_t* copy) {
+    const char* title = book->title;
+    for (size_t i=0; title[i] && title[i + 1] && title[i + 2]; i++) {
+        trigram_list_t* list = trigram_index_find(idx, trigram_key(&title[i]));
+        if (list == NULL)
+            continue;
+        unsigned int pos = trigram_bisect(list, 0, list->num_books, book->seq);
+        if (pos < list->num_books && list->books[pos] == book)
+            list->books[pos] = copy;
+    }
+}
+
+book_t** trigram_index_search(const trigram_index_t* idx, const char* text, unsigned int* num_found) {
+    *num_found = 0;
+    size_t len = strlen(text);
+    if (len < 3)
+        return (book_t**) NULL;
+
+    // the distinct lists of the text's trigrams, shortest first
+    trigram_list_t** lists = malloc((len - 2) * sizeof(trigram_list_t*));
+    if (lists == NULL) exit(errno);
+    unsigned int num_lists = 0;
+    for (size_t i=0; i + 2 < len; i++) {
+        trigram_list_t* list = trigram_index_find(idx, trigram_key(&text[i]));
+        if (list == NULL) {
+            free(lists);
+            return (book_t**) NULL;
+        }
+        unsigned int j = 0;
+        while (j < num_lists && lists[j] != list)
+            j++;
+        if (j < num_lists)
+            continue;
+        while (j > 0 && lists[j - 1]->num_books - lists[j - 1]->num_removed
+                > list->num_books - list->num_removed) {
+            lists[j] = lists[j - 1];
+            j--;
+        }
+        lists[j] = list;
+        num_lists++;
+    }
+
+    // intersect the shortest list with each of the others in turn, all of
+    // them being ordered by seq
+    book_t** ret = malloc((lists[0]->num_books - lists[0]->num_removed) * sizeof(book_t*));
+    if (ret == NULL) exit(errno);
+    unsigned int n = 0;
+    for (unsigned int i=0; i<lists[0]->num_books; i++) {
+        if (lists[0]->books[i] != NULL)
+            ret[n++] = lists[0]->books[i];
+    }
+    for (unsigned int i=1; i<num_lists && n > 0; i++) {
+        unsigned int kept = 0;
+        unsigned int pos = 0;
+        for (unsigned int j=0; j<n; j++) {
+            pos = trigram_gallop(lists[i], pos, ret[j]->seq);
+            if (pos >= lists[i]->num_books)
+                break;
+            if (lists[i]->books[pos] == ret[j])
+                ret[kept++] = ret[j];
+        }
+        n = kept;
+    }
+    free(lists);
+
+    if (n == 0) {
+        free(ret);
+        return (book_t**) NULL;
+    }
+    *num_found = n;
+    return ret;
+}
+
+bool trigram_match(const char* title, const char* text) {
+    if (*text == '\0')
+        return true;
+    for (const unsigned char* t = (const unsigned char*) title; *t; t++) {
+        const unsigned char* s = (const unsigned char*) text;
+        size_t i = 0;
+        while (s[i] && trigram_fold(t[i]) == trigram_fold(s[i]))
+            i++;
+        if (s[i] == '\0')
+            return true;
+    }
+    return false;
+}
+
+void trigram_index_free(trigram_index_t* idx) {
+    for (size_t i=0; i<idx->num_slots; i++)
+        free(idx->slots[i].books);
+    free(idx->slots);
+    idx->slots = NULL;
+    free(idx);
+    idx = NULL;
+}
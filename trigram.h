@@ -0,0 +1,69 @@
+#ifndef __TRIGRAM_H__
+#define __TRIGRAM_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct book_struct;
+
+
+/*
+ * structs
+ */
+
+// all books whose titles contain one trigram, ordered by their seq; a book
+// removed leaves a NULL behind until they make up half of the list
+typedef struct trigram_list_struct {
+    uint32_t key; // the trigram's three case-folded bytes, 0 for an empty slot
+    unsigned int num_books; // including the NULLs
+    unsigned int num_removed; // NULLs among the books
+    unsigned int capacity;
+    struct book_struct** books;
+} trigram_list_t;
+
+// inverted index of book titles: open-addressing (linear probing) hash table
+// of posting lists keyed by every three consecutive (ASCII case-folded)
+// bytes of a title; lists are never removed from the table, only emptied
+typedef struct trigram_index_struct {
+    size_t num_slots; // always a power of two
+    size_t num_used;
+    trigram_list_t* slots;
+} trigram_index_t;
+
+
+/*
+ * function prototypes
+ */
+
+// allocates a new empty trigram index
+trigram_index_t* trigram_index_init(void);
+
+// adds a book to the lists of all the trigrams in its title
+void trigram_index_insert(trigram_index_t* idx, struct book_struct* book);
+
+// adds many books, in order
+void trigram_index_insert_all(trigram_index_t* idx, struct book_struct** books,
+        const unsigned int num_books);
+
+// removes a book from the lists of all the trigrams in its title (in
+// amortized time logarithmic in the lengths of the lists)
+void trigram_index_remove(trigram_index_t* idx, const struct book_struct* book);
+
+// puts a copy of a book (with the same title and seq) where the book was
+void trigram_index_replace(trigram_index_t* idx, const struct book_struct* book,
+        struct book_struct* copy);
+
+// finds the books whose titles contain every trigram of text (which must be
+// at least three bytes long), in the order they were added; returns a
+// newly allocated array of them, or NULL if there are none; the candidates
+// still have to be checked with trigram_match()
+struct book_struct** trigram_index_search(const trigram_index_t* idx, const char* text,
+        unsigned int* num_found);
+
+// tells whether text occurs in title, ignoring (ASCII) case
+bool trigram_match(const char* title, const char* text);
+
+// deallocates the index (but not the books in it)
+void trigram_index_free(trigram_index_t* idx);
+
+#endif
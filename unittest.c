@@ -1,7 +1,15 @@
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
 #include "buffer.h"
 #include "bookstore.h"
+#include "import.h"
+#include "metrics.h"
+#include "lz.h"
 
 int main(void) {
     printf("Initializing bookstore...\n");
@@ -54,16 +62,40 @@ int main(void) {
 
     printf("Adding 3 books into the bookstore...\n");
     bookstore_add_book(store, book_init("42", "MyBook", "Unknown", "all of em", 10, 1, 123.45));
-    bookstore_add_book(store, book_init("43", "MyBook2", "Unknown", "some of em", 20, 11, 234.56));
-    bookstore_add_book(store, book_init("44", "MyBook3", "Unknown", "some of em", 50, 2, 333.33));
+    bookstore_add_book(store, bookstore_new_book(store, "43", "MyBook2", "Unknown", "some of em", 20, 11, 234.56));
+    bookstore_add_book(store, bookstore_new_book(store, "44", "MyBook3", "Unknown", "some of em", 50, 2, 333.33));
+    assert(store->num_heap_books == 1);
+    printf("Checking authors and genres are interned...\n");
+    assert(store->books[1]->author == store->books[2]->author);
+    assert(store->books[1]->genre == store->books[2]->genre);
+    assert(store->books[0]->author_id == store->books[1]->author_id);
 
     printf("Printing the bookstore...\n");
     bookstore_print(store);
 
+    printf("Reserving and shrinking bookstore capacity...\n");
+    bookstore_reserve(store, 100);
+    assert(store->capacity >= 100 && store->num_books == 3);
+    bookstore_shrink(store);
+    assert(store->capacity == 3);
+
+    printf("Looking up books by ISBN...\n");
+    assert(book_find(store, "43") == store->books[1]);
+    assert(book_find(store, "45") == NULL);
+    printf("Trying to add a book with a duplicate ISBN...\n");
+    book = book_init("43", "Duplicate", "Unknown", "none", 0, 0, 0);
+    assert(!bookstore_add_book(store, book));
+    assert(store->num_books == 3);
+    assert(book_find(store, "43") != book);
+    book_free(book);
+
     printf("Initializing a new serialization buffer...\n");
     buf = buf_init();
     printf("Serializing the bookstore into buffer...\n");
     serialize_bookstore(store, buf);
+    assert(buf->capacity >= buf->size);
+    buf_shrink(buf);
+    assert(buf->capacity == buf->size);
     printf("Printing the buffer...\n");
     buf_print(buf);
     printf("Freeing the buffer...\n");
@@ -82,11 +114,160 @@ int main(void) {
         book_print(book);
     }
 
+    printf("Iterating over books by author...\n");
+    book_iter_t it;
+    unsigned int found = 0;
+    books_by_author_iter(store, "Unknown", &it);
+    while ((book = book_iter_next(&it)) != NULL)
+        assert(book == store->books[found++]);
+    assert(found == 3);
+    books_by_author_iter(store, "Nobody", &it);
+    assert(book_iter_next(&it) == NULL);
+
+    printf("Searching titles by their parts, ignoring case...\n");
+    book_t** titled = books_by_title(store, "BOOK", &found);
+    assert(found == 3 && titled[0] == store->books[0] && titled[2] == store->books[2]);
+    free(titled);
+    titled = books_by_title(store, "ook2", &found);
+    assert(found == 1 && titled[0] == store->books[1]);
+    free(titled);
+    titled = books_by_title(store, "k3", &found);
+    assert(found == 1 && titled[0] == store->books[2]);
+    free(titled);
+    assert(books_by_title(store, "Book4", &found) == NULL && found == 0);
+    assert(books_by_title(store, "okMy", &found) == NULL && found == 0);
+
+    printf("Querying books by price and stock ranges...\n");
+    skiplist_iter_t range;
+    books_by_price_iter(store, 40, 50, &range);
+    assert(skiplist_iter_next(&range) == store->books[1]);
+    assert(skiplist_iter_next(&range) == store->books[2]);
+    assert(skiplist_iter_next(&range) == NULL);
+    books_low_stock_iter(store, 11, &range);
+    assert(skiplist_iter_next(&range) == store->books[1]);
+    assert(skiplist_iter_next(&range) == store->books[0]);
+    assert(skiplist_iter_next(&range) == NULL);
+    books_low_stock_iter(store, 0, &range);
+    assert(skiplist_iter_next(&range) == NULL);
+    printf("Reordering them as prices and stock change...\n");
+    book = bookstore_new_book(store, "47", "MyBook6", "Unknown", "none", 5, 0, 41);
+    assert(bookstore_add_book(store, book));
+    books_by_price_iter(store, 0, 42, &range);
+    assert(skiplist_iter_next(&range) == book);
+    book_change_price(book, 50);
+    book_stock(book, 20);
+    books_by_price_iter(store, 0, 42, &range);
+    assert(skiplist_iter_next(&range) == store->books[1]);
+    assert(skiplist_iter_next(&range) == store->books[2]);
+    assert(skiplist_iter_next(&range) == NULL);
+    books_low_stock_iter(store, 30, &range);
+    assert(skiplist_iter_next(&range) == store->books[1]);
+    assert(skiplist_iter_next(&range) == store->books[0]);
+    assert(skiplist_iter_next(&range) == book);
+    assert(skiplist_iter_next(&range) == NULL);
+    bookstore_remove_book(store, book);
+    book_free(book);
+    books_low_stock_iter(store, 30, &range);
+    assert(skiplist_iter_next(&range) == store->books[1]);
+    assert(skiplist_iter_next(&range) == store->books[0]);
+    assert(skiplist_iter_next(&range) == NULL);
+
+    printf("Removing a NaN-priced book from the price index...\n");
+    bookstore_t* priced = bookstore_init();
+    const double prices[] = {5, NAN, 3, 7};
+    const char* priced_isbns[] = {"1", "2", "3", "4"};
+    for (unsigned int i=0; i<4; i++)
+        assert(bookstore_add_book(priced, bookstore_new_book(priced, priced_isbns[i],
+                        "Priced", "x", "g", 1, 0, prices[i])));
+    book = book_find(priced, "2");
+    bookstore_remove_book(priced, book);
+    book_free(book);
+    books_by_price_iter(priced, 0, 100, &range);
+    assert(skiplist_iter_next(&range) == book_find(priced, "3"));
+    assert(skiplist_iter_next(&range) == book_find(priced, "1"));
+    assert(skiplist_iter_next(&range) == book_find(priced, "4"));
+    assert(skiplist_iter_next(&range) == NULL);
+    bookstore_free(priced);
+    printf("Refusing prices that are not finite and non-negative...\n");
+    double price;
+    assert(import_parse_price("12.5", &price) && price > 12.49 && price < 12.51);
+    assert(!import_parse_price("nan", &price));
+    assert(!import_parse_price("inf", &price));
+    assert(!import_parse_price("-1", &price));
+    assert(!import_parse_price("1x", &price));
+
+    printf("Summing up sales and stock from the columns...\n");
+    uint64_t units;
+    double value;
+    bookstore_sales_totals(store, &units, &value);
+    assert(units == 1 + 31 + 22);
+    assert(value > 123.45 + 31 * 42 + 22 * 42 - 0.001 && value < 123.45 + 31 * 42 + 22 * 42 + 0.001);
+    bookstore_stock_totals(store, &units, &value);
+    assert(units == 10 + 0 + 30);
+    assert(store->columns.price[2] > 41.999 && store->columns.price[2] < 42.001);
+    printf("Checking the running totals...\n");
+    assert(store->totals.units_sold == 1 + 31 + 22);
+    assert(store->totals.units_in_stock == 10 + 0 + 30);
+    assert(bookstore_check_totals(store));
+
     printf("Getting top 10 bestsellers (only 3 books available, though)...\n");
     bookstore_get_bestsellers(store, 10);
+    printf("Checking top 2 bestsellers leave the bookstore order alone...\n");
+    book_t* top[2];
+    assert(bookstore_top_sellers(store, 2, top) == 2);
+    assert(strcmp(top[0]->isbn, "43") == 0 && strcmp(top[1]->isbn, "44") == 0);
+    assert(strcmp(store->books[0]->isbn, "42") == 0);
+    printf("Checking equal sales rank by bookstore order...\n");
+    book_stock(store->books[0], 21);
+    assert(book_sell(store->books[0], 21));
+    assert(bookstore_top_sellers(store, 2, top) == 2);
+    assert(strcmp(top[0]->isbn, "43") == 0 && strcmp(top[1]->isbn, "42") == 0);
     printf("Listing sold-out titles...\n");
     bookstore_get_sold_out(store);
 
+    printf("Recycling the memory of a removed book...\n");
+    book = bookstore_new_book(store, "45", "MyBook4", "Unknown", "none", 1, 0, 1);
+    assert(bookstore_add_book(store, book));
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(bookstore_new_book(store, "46", "MyBook5", "Unknown", "none", 1, 0, 1) == book);
+    assert(bookstore_check_totals(store));
+
+    printf("Removing a book by moving the last one into its row...\n");
+    book_t* removed = bookstore_new_book(store, "48", "MyBook7", "Unknown", "none", 1, 0, 1);
+    assert(bookstore_add_book(store, removed));
+    book_t* moved = bookstore_new_book(store, "49", "MyBook8", "Unknown", "none", 2, 0, 1);
+    assert(bookstore_add_book(store, moved));
+    book_handle_t removed_handle = removed->handle;
+    book_handle_t moved_handle = moved->handle;
+    assert(book_get(store, removed_handle) == removed && moved->row == 4);
+    bookstore_remove_book(store, removed);
+    book_free(removed);
+    assert(store->num_books == 4 && moved->row == 3 && store->books[3] == moved);
+    assert(store->columns.stocked_qty[3] == 2);
+    assert(book_get(store, moved_handle) == moved && book_get(store, removed_handle) == NULL);
+    books_by_author_iter(store, "Unknown", &it);
+    found = 0;
+    while ((book = book_iter_next(&it)) != NULL)
+        found++;
+    assert(found == 4 && books_by_author(store, "Unknown", store->books[2]) == moved);
+    titled = books_by_title(store, "book8", &found);
+    assert(found == 1 && titled[0] == moved);
+    free(titled);
+    assert(books_by_title(store, "book7", &found) == NULL);
+    printf("Reusing the slot of a removed book under a new handle...\n");
+    book = bookstore_new_book(store, "50", "MyBook9", "Unknown", "none", 1, 0, 1);
+    assert(bookstore_add_book(store, book));
+    assert((uint32_t) book->handle == (uint32_t) removed_handle && book->handle != removed_handle);
+    assert(book_get(store, removed_handle) == NULL && book_get(store, book->handle) == book);
+    bookstore_remove_book(store, moved);
+    book_free(moved);
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(store->num_books == 3 && book_get(store, moved_handle) == NULL);
+    assert(books_by_title(store, "book8", &found) == NULL);
+    assert(bookstore_check_totals(store));
+
     printf("Saving bookstore to bookstore.dat...\n");
     bookstore_save(store, "bookstore.dat");
 
@@ -103,10 +284,445 @@ int main(void) {
     buf = buf_init();
     serialize_bookstore(store, buf);
     buf_print(buf);
+
+    printf("Serializing it again through a small sink buffer...\n");
+    FILE* sink = tmpfile();
+    buffer_t* chunked = buf_init_sink(sink, 16);
+    serialize_bookstore(store, chunked);
+    assert(chunked->capacity == 16);
+    assert(buf_flush(chunked));
+    buf_free(chunked);
+    assert((size_t) ftell(sink) == buf->size);
+    rewind(sink);
+    chunked = buf_init_from_fd(sink);
+    assert(memcmp(chunked->bytes, buf->bytes, buf->size) == 0);
+    buf_free(chunked);
+    fclose(sink);
     buf_free(buf);
 
+    printf("Checking the loaded books point into the mapped file...\n");
+    assert(store->map != NULL);
+    book = book_find(store, "44");
+    assert(book->title >= store->map && book->title < store->map + store->map_size);
+    printf("Searching titles of the loaded bookstore...\n");
+    titled = books_by_title(store, "mybook", &found);
+    assert(found == 3 && titled[2] == book);
+    free(titled);
+    assert(books_by_title(store, "mybook4", &found) == NULL);
+    books_low_stock_iter(store, 1, &range);
+    assert(skiplist_iter_next(&range) == book_find(store, "43"));
+    assert(skiplist_iter_next(&range) == NULL);
+    printf("Compressing and decompressing repetitive and random data...\n");
+    char raw[5000], packed[LZ_BOUND(5000)], unpacked[5000];
+    for (unsigned int i=0; i<sizeof(raw); i++)
+        raw[i] = (i < 2500) ? "abcab"[i % 5] : (char) (i * 2654435761U >> 13);
+    size_t packed_size = lz_compress(raw, sizeof(raw), packed);
+    assert(packed_size < sizeof(raw));
+    assert(lz_decompress(packed, packed_size, unpacked, sizeof(raw)));
+    assert(memcmp(raw, unpacked, sizeof(raw)) == 0);
+    assert(!lz_decompress(packed, packed_size, unpacked, sizeof(raw) - 1));
+    assert(!lz_decompress(packed, packed_size / 2, unpacked, sizeof(raw)));
+    packed_size = lz_compress(raw, 3, packed);
+    assert(lz_decompress(packed, packed_size, unpacked, 3) && memcmp(raw, unpacked, 3) == 0);
+
+    printf("Saving a compressed copy of the bookstore and loading it back...\n");
+    store->compressed = true;
+    bookstore_save(store, "compressed.dat");
+    bookstore_t* copy = bookstore_load("compressed.dat");
+    assert(copy != NULL && copy->compressed && copy->map == NULL);
+    assert(copy->num_books == store->num_books);
+    for (unsigned int i=0; i<store->num_books; i++) {
+        const book_t* a = store->books[i];
+        const book_t* b = copy->books[i];
+        assert(strcmp(a->isbn, b->isbn) == 0 && strcmp(a->title, b->title) == 0);
+        assert(strcmp(a->author, b->author) == 0 && strcmp(a->genre, b->genre) == 0);
+        assert(a->stocked_qty == b->stocked_qty && a->sold_qty == b->sold_qty);
+        assert(memcmp(&(a->price), &(b->price), sizeof(double)) == 0);
+    }
+    assert(book_find(copy, "44")->author == book_find(copy, "42")->author);
+    assert(bookstore_check_totals(copy));
+    bookstore_free(copy);
+    store->compressed = false;
+
+    printf("Loading a truncated compressed file...\n");
+    FILE* compressed = fopen("compressed.dat", "rb");
+    fseek(compressed, 0, SEEK_END);
+    long compressed_size = ftell(compressed);
+    fclose(compressed);
+    assert(truncate("compressed.dat", compressed_size - 3) == 0);
+    assert(bookstore_load("compressed.dat") == NULL);
+    unlink("compressed.dat");
+    printf("Loading compressed files claiming more than they hold...\n");
+    bookstore_header_t forged;
+    memset(&forged, 0, sizeof(forged));
+    memcpy(forged.magic, BOOKSTORE_MAGIC, sizeof(forged.magic));
+    forged.version = BOOKSTORE_VERSION;
+    forged.flags = BOOKSTORE_FLAG_COMPRESSED;
+    forged.num_books = UINT32_MAX;
+    // an empty dictionary and nothing else, stored as is
+    uint32_t block[2] = {1, 1};
+    compressed = fopen("compressed.dat", "wb");
+    fwrite(&forged, sizeof(forged), 1, compressed);
+    fwrite(block, sizeof(block), 1, compressed);
+    fputc(0, compressed);
+    fclose(compressed);
+    assert(bookstore_load("compressed.dat") == NULL);
+    forged.num_books = 0;
+    block[0] = UINT32_MAX;
+    block[1] = 0;
+    compressed = fopen("compressed.dat", "wb");
+    fwrite(&forged, sizeof(forged), 1, compressed);
+    fwrite(block, sizeof(block), 1, compressed);
+    fclose(compressed);
+    assert(bookstore_load("compressed.dat") == NULL);
+    unlink("compressed.dat");
+
+    printf("Modifying the mapped bookstore and saving it over its own file...\n");
+    assert(book_sell(book, 1));
+    bookstore_save(store, "bookstore.dat");
+    bookstore_free(store);
+    store = bookstore_load("bookstore.dat");
+    assert(store->num_books == 3);
+    assert(book_find(store, "44")->sold_qty == 23);
+    assert(strcmp(book_find(store, "44")->title, "MyBook3") == 0);
+    assert(book_find(store, "42")->author == book_find(store, "44")->author);
+    assert(bookstore_check_totals(store));
+
+    printf("Journaling changes to bookstore.dat...\n");
+    bookstore_journal(store, "bookstore.dat");
+    assert(store->journal != NULL && !store->journal->stale);
+    assert(book_sell(book_find(store, "44"), 1));
+    unsigned int stocked_qty = book_find(store, "42")->stocked_qty;
+    bookstore_t* saved;
+    book_stock(book_find(store, "42"), 5);
+    book_change_price(book_find(store, "42"), 9.5);
+    assert(bookstore_add_book(store, bookstore_new_book(store, "47", "MyBook6", "Unknown", "none", 2, 0, 3)));
+    book = book_find(store, "43");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    bookstore_commit(store);
+    assert(store->journal->size > sizeof(journal_header_t));
+    printf("Selling a batch of books all at once or not at all...\n");
+    size_t journal_size = store->journal->size;
+    unsigned int failed;
+    book_sale_t missing[] = {{"42", 1}, {"nonexistent", 1}};
+    assert(!bookstore_sell_batch(store, missing, 2, &failed) && failed == 1);
+    book_sale_t too_many[] = {{"42", 1}, {"44", book_find(store, "44")->stocked_qty}, {"44", 1}};
+    assert(!bookstore_sell_batch(store, too_many, 3, &failed) && failed == 2);
+    assert(book_find(store, "42")->stocked_qty == stocked_qty + 5 && store->journal->size == journal_size);
+    book_sale_t basket[] = {{"44", 1}, {"42", 2}, {"44", 1}};
+    assert(bookstore_sell_batch(store, basket, 3, &failed));
+    assert(book_find(store, "44")->sold_qty == 26 && book_find(store, "42")->stocked_qty == stocked_qty + 3);
+    assert(store->journal->size > journal_size && store->journal->num_pending == 0);
+    assert(bookstore_check_totals(store));
+    printf("Adding a change that never gets committed...\n");
+    book_stock(book_find(store, "47"), 100);
+    bookstore_free(store);
+
+    printf("Replaying the journal on load...\n");
+    FILE* fd = fopen("bookstore.dat.journal", "ab");
+    assert(fd != NULL);
+    fputs("torn", fd);
+    fclose(fd);
+    store = bookstore_load("bookstore.dat");
+    assert(store->num_books == 3);
+    assert(book_find(store, "43") == NULL);
+    assert(book_find(store, "44")->sold_qty == 26);
+    assert(book_find(store, "42")->stocked_qty == stocked_qty + 3 && book_find(store, "42")->price > 9.4);
+    assert(book_find(store, "47")->stocked_qty == 2);
+    assert(bookstore_check_totals(store));
+
+    printf("Compacting the journal into a new snapshot...\n");
+    bookstore_journal(store, "bookstore.dat");
+    assert(!store->journal->stale);
+    bookstore_compact(store);
+    assert(store->journal->size == sizeof(journal_header_t));
+    bookstore_free(store);
+    store = bookstore_load("bookstore.dat");
+    assert(store->num_books == 3 && book_find(store, "47") != NULL);
+    printf("Journaling a bookstore that is not the one in the file...\n");
+    bookstore_free(store);
+    store = bookstore_init();
+    bookstore_journal(store, "bookstore.dat");
+    assert(store->journal->stale && journal_needs_compaction(store->journal));
+    bookstore_free(store);
+    store = bookstore_load("bookstore.dat");
+    assert(store->num_books == 3);
+
+    printf("Checkpointing only the books changed since the last checkpoint...\n");
+    bookstore_journal(store, "bookstore.dat");
+    bookstore_track_changes(store);
+    assert(store->journal->deferred && !bookstore_checkpoint(store));
+    journal_size = store->journal->size;
+    assert(book_sell(book_find(store, "44"), 1));
+    book_stock(book_find(store, "44"), 2);
+    assert(bookstore_add_book(store, bookstore_new_book(store, "48", "MyBook7", "Unknown", "none", 1, 0, 4)));
+    book = book_find(store, "47");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(store->num_dirty == 2 && store->num_removed == 1 && store->num_changes == 4);
+    assert(store->journal->size == journal_size);
+    assert(bookstore_checkpoint(store));
+    assert(store->num_dirty == 0 && store->num_changes == 0 && store->dirty_since == 0);
+    assert(bookstore_wait_save(store));
+    assert(store->checkpoints.count == 1 && store->checkpoints.last_books == 3);
+    assert(store->journal->size > journal_size);
+    printf("Leaving out books added and removed between checkpoints...\n");
+    assert(bookstore_add_book(store, bookstore_new_book(store, "49", "MyBook8", "Unknown", "none", 1, 0, 4)));
+    book = book_find(store, "49");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(store->num_dirty == 0 && store->num_removed == 0);
+    printf("Syncing a batch of sales without waiting for a checkpoint...\n");
+    journal_size = store->journal->size;
+    book_stock(book_find(store, "44"), 1);
+    assert(bookstore_add_book(store, bookstore_new_book(store, "59", "MyBook10", "Unknown", "none", 2, 0, 4)));
+    unsigned int stocked_44 = book_find(store, "44")->stocked_qty;
+    book_sale_t tracked[] = {{"44", 1}, {"48", 1}, {"59", 1}};
+    assert(bookstore_sell_batch(store, tracked, 3, &failed));
+    assert(store->num_dirty == 3 && store->journal->size > journal_size && !bookstore_save_running(store));
+    // left without a checkpoint, the basket comes back from the journal
+    bookstore_free(store);
+    store = bookstore_load("bookstore.dat");
+    assert(store->num_books == 4 && book_find(store, "47") == NULL && book_find(store, "49") == NULL);
+    assert(book_find(store, "44")->sold_qty == 28 && book_find(store, "44")->stocked_qty == stocked_44 - 1);
+    assert(strcmp(book_find(store, "48")->title, "MyBook7") == 0 && book_find(store, "48")->sold_qty == 1);
+    assert(book_find(store, "59")->sold_qty == 1 && book_find(store, "59")->stocked_qty == 1);
+    assert(bookstore_check_totals(store));
+    book = book_find(store, "59");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    unlink("bookstore.dat.journal");
+
+    printf("Checkpointing a new snapshot when the journal is stale...\n");
+    saved = bookstore_init();
+    bookstore_journal(saved, "checkpoint.dat");
+    bookstore_track_changes(saved);
+    assert(bookstore_add_book(saved, bookstore_new_book(saved, "60", "MyBook9", "Unknown", "none", 1, 0, 4)));
+    assert(bookstore_checkpoint(saved) && bookstore_wait_save(saved));
+    assert(!saved->journal->stale && saved->checkpoints.last_books == 1);
+    bookstore_free(saved);
+    saved = bookstore_load("checkpoint.dat");
+    assert(saved != NULL && saved->num_books == 1 && book_find(saved, "60") != NULL);
+    printf("Keeping the changes of a failed checkpoint for the next one...\n");
+    bookstore_journal(saved, "checkpoint.dat");
+    bookstore_track_changes(saved);
+    book_stock(book_find(saved, "60"), 2);
+    int journal_fd = saved->journal->fd;
+    saved->journal->fd = open("/dev/null", O_RDONLY);
+    assert(bookstore_checkpoint(saved) && !bookstore_wait_save(saved));
+    assert(saved->checkpoints.failed == 1 && saved->checkpoints.count == 0);
+    assert(saved->journal->stale && saved->num_changes > 0 && saved->dirty_since != 0);
+    close(saved->journal->fd);
+    saved->journal->fd = journal_fd;
+    assert(bookstore_checkpoint(saved) && bookstore_wait_save(saved));
+    assert(!saved->journal->stale && saved->num_changes == 0);
+    bookstore_free(saved);
+    saved = bookstore_load("checkpoint.dat");
+    assert(saved != NULL && book_find(saved, "60")->stocked_qty == 3);
+    bookstore_free(saved);
+    unlink("checkpoint.dat");
+    unlink("checkpoint.dat.journal");
+
+    printf("Importing books from a CSV file...\n");
+    fd = fopen("import.csv", "wb");
+    assert(fd != NULL);
+    fputs("isbn,title,author,genre,stocked_qty,sold_qty,price\n"
+            "50,\"Commas, \"\"Quotes\"\" and spaces\",Unknown,none,3,1,9.99\r\n"
+            "51,Plain,Someone Else,none,0,7,1.5\n"
+            "\n"
+            "52,Broken,Unknown,none,many,0,1\n"
+            "50,Duplicate,Unknown,none,1,1,1\n"
+            "53,\"Multi\nline\",Unknown,none,1,0,2", fd);
+    fclose(fd);
+    import_stats_t stats;
+    assert(bookstore_import(store, "import.csv", &stats));
+    assert(stats.num_rows == 5 && stats.num_imported == 3 && stats.num_skipped == 2);
+    assert(store->num_books == 6);
+    assert(strcmp(book_find(store, "50")->title, "Commas, \"Quotes\" and spaces") == 0);
+    assert(strcmp(book_find(store, "53")->title, "Multi\nline") == 0);
+    assert(book_find(store, "51")->sold_qty == 7);
+    books_by_author_iter(store, "Unknown", &it);
+    found = 0;
+    while ((book = book_iter_next(&it)) != NULL)
+        found++;
+    assert(found == 5 && book == NULL);
+    assert(bookstore_check_totals(store));
+    unlink("import.csv");
+
+    printf("Changing books while a snapshot sees them...\n");
+    bookstore_snapshot_t* snap = bookstore_snapshot(store);
+    book = book_find(store, "51");
+    unsigned int row = book->row;
+    book_stock(book, 3);
+    assert(book_find(store, "51") != book && book_find(store, "51")->stocked_qty == 3);
+    assert(book->retired && book->stocked_qty == 0);
+    assert(snap->view.books[row] == book && snap->view.columns.stocked_qty[row] == 0);
+    assert(books_by_author(store, "Someone Else", NULL) == book_find(store, "51"));
+    book_stock(book_find(store, "51"), 1);
+    assert(store->num_retired == 1);
+    book = book_find(store, "50");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(book->retired && strcmp(book->title, "Commas, \"Quotes\" and spaces") == 0);
+    assert(snap->view.num_books == 6 && store->num_books == 5);
+    assert(snap->view.totals.units_in_stock + 4 - 3 == store->totals.units_in_stock);
+    assert(bookstore_check_totals(store) && bookstore_check_totals(&(snap->view)));
+
+    printf("Saving the bookstore in the background while it changes...\n");
+    bookstore_save_background(store, "snapshot.dat");
+    assert(book_sell(book_find(store, "51"), 4));
+    assert(bookstore_wait_save(store));
+    saved = bookstore_load("snapshot.dat");
+    assert(saved != NULL && saved->num_books == 5 && book_find(saved, "50") == NULL);
+    assert(book_find(saved, "51")->stocked_qty == 4 && book_find(store, "51")->stocked_qty == 0);
+    assert(strcmp(book_find(saved, "53")->author, "Unknown") == 0);
+    bookstore_free(saved);
+    unlink("snapshot.dat");
+
+    printf("Freeing the books no snapshot sees anymore...\n");
+    bookstore_snapshot_release(snap);
+    assert(store->num_retired > 0);
+    book_stock(book_find(store, "51"), 1);
+    assert(store->num_retired == 0);
+
+    printf("Copying books from book_init() while a snapshot sees them...\n");
+    saved = bookstore_init();
+    snap = bookstore_snapshot(saved);
+    assert(snap->view.num_books == 0);
+    bookstore_snapshot_release(snap);
+    assert(bookstore_add_book(saved, book_init("1", "MyBook", "Someone", "none", 5, 0, 1)));
+    assert(bookstore_add_book(saved, book_init("2", "MyBook2", "Someone", "none", 5, 0, 1)));
+    snap = bookstore_snapshot(saved);
+    assert(book_sell(book_find(saved, "1"), 1));
+    bookstore_snapshot_release(snap);
+    book_stock(book_find(saved, "2"), 1);
+    assert(saved->num_retired == 0);
+    assert(strcmp(book_find(saved, "1")->author, "Someone") == 0);
+    assert(strcmp(book_find(saved, "1")->genre, "none") == 0);
+    printf("Finding titles by short text in the order the books were added...\n");
+    assert(bookstore_add_book(saved, book_init("3", "MyBook3", "Someone", "none", 5, 0, 1)));
+    book = book_find(saved, "1");
+    bookstore_remove_book(saved, book);
+    book_free(book);
+    assert(saved->books[0] == book_find(saved, "3"));
+    titled = books_by_title(saved, "My", &found);
+    assert(found == 2 && titled[0] == book_find(saved, "2") && titled[1] == book_find(saved, "3"));
+    free(titled);
+    bookstore_free(saved);
+
+    printf("Loading a missing file...\n");
+    assert(bookstore_load("nonexistent.dat") == NULL);
+
+    printf("Counting books scanned by a search...\n");
+    uint64_t scanned = metrics_counter(METRICS_BOOKS_SCANNED);
+    books_by_author_iter(store, "Unknown", &it);
+    assert(metrics_counter(METRICS_BOOKS_SCANNED) == scanned + 4);
+    assert(metrics_counter(METRICS_ALLOCATIONS) > 0);
+
+    printf("Ranking the books sold within the last hour, replayed ones included...\n");
+    book_t* window_top[3];
+    unsigned int window_qty[3];
+    assert(book_sell(book_find(store, "44"), 1));
+    assert(bookstore_window_top_sellers(store, LEDGER_HOUR, 3, window_top, window_qty) == 3);
+    assert(window_top[0] == book_find(store, "51") && window_qty[0] == 4);
+    assert(window_top[1] == book_find(store, "44") && window_qty[1] == 2);
+    assert(window_top[2] == book_find(store, "48") && window_qty[2] == 1);
+    book = book_find(store, "51");
+    bookstore_remove_book(store, book);
+    book_free(book);
+    assert(bookstore_window_top_sellers(store, LEDGER_WEEK, 3, window_top, window_qty) == 2);
+    assert(window_top[0] == book_find(store, "44"));
+
     printf("Freeing the bookstore...\n");
     bookstore_free(store);
 
+    printf("Counting sales over rolling windows...\n");
+    ledger_t* ledger = ledger_init();
+    uint64_t handles[3];
+    unsigned int qty[3];
+    int64_t t = 1000000020;
+    ledger_record(ledger, 1, 0, 5, t);
+    ledger_record(ledger, 2, 1, 3, t + 1800);
+    ledger_record(ledger, 2, 1, 4, t + 7200);
+    assert(ledger_top(ledger, LEDGER_HOUR, t + 7200, 3, handles, qty) == 1);
+    assert(handles[0] == 2 && qty[0] == 4);
+    assert(ledger_top(ledger, LEDGER_DAY, t + 7200, 3, handles, qty) == 2);
+    assert(handles[0] == 2 && qty[0] == 7 && handles[1] == 1 && qty[1] == 5);
+    ledger_record(ledger, 3, 2, 7, t + 7300);
+    assert(ledger_top(ledger, LEDGER_DAY, t + 7300, 2, handles, qty) == 2);
+    assert(handles[0] == 2 && handles[1] == 3 && qty[1] == 7);
+    printf("Expiring the partitions older than a week...\n");
+    assert(ledger_top(ledger, LEDGER_WEEK, t + 8 * 86400, 3, handles, qty) == 0);
+    assert(ledger->num_events == 0 && ledger->first == ledger->end && ledger->num_active == 0);
+    ledger_record(ledger, 1, 0, 2, t);
+    assert(ledger_top(ledger, LEDGER_HOUR, t + 8 * 86400, 3, handles, qty) == 1 && qty[0] == 2);
+    printf("Forgetting a book removed before its sales expire...\n");
+    ledger_forget(ledger, 1);
+    ledger_record(ledger, 1ULL << 32 | 1, 5, 1, t + 8 * 86400 + 60);
+    assert(ledger_top(ledger, LEDGER_WEEK, t + 8 * 86400 + 60, 3, handles, qty) == 1);
+    assert(handles[0] == (1ULL << 32 | 1) && qty[0] == 1);
+    assert(ledger_top(ledger, LEDGER_WEEK, t + 16 * 86400, 3, handles, qty) == 0);
+    assert(ledger->num_active == 0);
+    printf("Rolling the windows over a sale every minute for two days...\n");
+    t += 16 * 86400;
+    for (int64_t i=0; i<2880; i++)
+        ledger_record(ledger, 0, 0, 1, t + 60 * i);
+    assert(ledger_top(ledger, LEDGER_HOUR, t + 60 * 2879, 1, handles, qty) == 1 && qty[0] == 60);
+    assert(ledger_top(ledger, LEDGER_DAY, t + 60 * 2879, 1, handles, qty) == 1 && qty[0] == 1440);
+    assert(ledger_top(ledger, LEDGER_WEEK, t + 60 * 2879, 1, handles, qty) == 1 && qty[0] == 2880);
+    assert(ledger->num_events == 2880);
+    ledger_free(ledger);
+
+    printf("Putting the sales of the last week back into the ledger on load...\n");
+    bookstore_t* timed = bookstore_init();
+    const char* timed_isbns[] = {"1", "2", "3"};
+    for (unsigned int i=0; i<3; i++)
+        assert(bookstore_add_book(timed, bookstore_new_book(timed, timed_isbns[i],
+                        "Timed", "Unknown", "none", 10, 0, 1)));
+    bookstore_save(timed, "timed.dat");
+    bookstore_journal(timed, "timed.dat");
+    int64_t now = (int64_t) time(NULL);
+    assert(book_sell_at(book_find(timed, "1"), 2, now - 8 * 86400));
+    assert(book_sell_at(book_find(timed, "2"), 3, now - 2 * 3600));
+    book_sale_t timed_basket[] = {{"3", 1}, {"2", 1}};
+    assert(bookstore_sell_batch_at(timed, timed_basket, 2, now - 60, &failed));
+    bookstore_free(timed);
+    timed = bookstore_load("timed.dat");
+    assert(book_find(timed, "1")->sold_qty == 2 && book_find(timed, "2")->sold_qty == 4);
+    assert(bookstore_window_top_sellers(timed, LEDGER_HOUR, 3, window_top, window_qty) == 2);
+    assert(window_top[0] == book_find(timed, "2") && window_qty[0] == 1);
+    assert(window_top[1] == book_find(timed, "3") && window_qty[1] == 1);
+    assert(bookstore_window_top_sellers(timed, LEDGER_DAY, 3, window_top, window_qty) == 2);
+    assert(window_top[0] == book_find(timed, "2") && window_qty[0] == 4);
+    assert(bookstore_window_top_sellers(timed, LEDGER_WEEK, 3, window_top, window_qty) == 2);
+    bookstore_free(timed);
+    unlink("timed.dat");
+    unlink("timed.dat.journal");
+
+    printf("Recording latencies into a histogram...\n");
+    static metrics_histogram_t hist;
+    for (uint64_t i=1; i<=1000; i++)
+        metrics_histogram_add(&hist, i * 1000);
+    assert(hist.count == 1000 && hist.max == 1000000);
+    uint64_t p50 = metrics_histogram_percentile(&hist, 0.5);
+    uint64_t p99 = metrics_histogram_percentile(&hist, 0.99);
+    assert(p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+    assert(p99 >= 990000 && p99 <= 1000000);
+    assert(metrics_histogram_percentile(&hist, 1) == 1000000);
+    metrics_histogram_add(&hist, UINT64_MAX);
+    assert(metrics_histogram_percentile(&hist, 1) == UINT64_MAX);
+
+    printf("Recording command calls...\n");
+    const char* names[] = {"info", "(other)"};
+    metrics_init(names, 2);
+    assert(metrics_command("info") != metrics_command("nonsense"));
+    assert(strcmp(metrics_command("nonsense")->name, "(other)") == 0);
+    metrics_record(metrics_command("info"), 7);
+    metrics_summary_t summary;
+    metrics_summarize(0, &summary);
+    assert(summary.calls == 1 && summary.p50 == 7 && summary.max == 7);
+    metrics_free();
+
     return 0;
 }